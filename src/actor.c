@@ -1,11 +1,53 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <signal.h>
+#include <sched.h>
+#include <time.h>
 #include "actor.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
 // Simple wrapper function
 #define bool_cas(ptr, old, new) __sync_bool_compare_and_swap(ptr, old, new)
 
+#define load_relaxed(ptr) __atomic_load_n(ptr, __ATOMIC_RELAXED)
+#define load_acquire(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define store_relaxed(ptr, value) __atomic_store_n(ptr, value, __ATOMIC_RELAXED)
+#define store_release(ptr, value) __atomic_store_n(ptr, value, __ATOMIC_RELEASE)
+#define weak_cas(ptr, old, new) __atomic_compare_exchange_n(ptr, old, new, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_pause() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_pause() __asm__ __volatile__ ("yield" ::: "memory")
+#else
+#define cpu_pause() __asm__ __volatile__ ("" ::: "memory")
+#endif
+
+#ifdef __linux__
+#define futex_wait(ptr, value) syscall(SYS_futex, ptr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0)
+#define futex_wake(ptr, count) syscall(SYS_futex, ptr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0)
+#define futex_waitfor(ptr, value, ts) syscall(SYS_futex, ptr, FUTEX_WAIT_PRIVATE, value, ts, NULL, 0)
+#else
+#define futex_wait(ptr, value) do { if (load_acquire(ptr) == (value)) sched_yield(); } while (0)
+#define futex_waitfor(ptr, value, ts) futex_wait(ptr, value)
+#define futex_wake(ptr, count) do {} while (0)
+#endif
+
 #define sync_value(type, ptr, value) do {\
     type old; type new;\
     do {\
@@ -54,622 +96,3611 @@ static inline void *anmalloc(size_t size) {
     return ptr;
 }
 
+static inline void *analign(size_t size) {
+    void *ptr = NULL;
+
+    if (posix_memalign(&ptr, 64, size) != 0 && size) abort();
+
+    return ptr;
+}
+
 static inline void anfree(void *ptr) {
     free(ptr);
 }
 
-static inline int thread_alive(pthread_t thread) {
-    if (thread && pthread_kill(thread, 0) == 0)
-        return 1;
-    else
-        return 0;
-}
+static inline uint64_t actor_now(void) {
+    struct timespec ts;
 
-// Hash table management
-HASH_TABLE *hash_init(uint64_t size) {
-    HASH_TABLE *htable = (HASH_TABLE *)anmalloc(sizeof(HASH_TABLE));
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-    uint32_t seed = 0x00100001;
-    uint32_t i = 0, j = 0, k = 0;
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-    for (i = 0; i < 256; ++i) {
-        for (j = i, k = 0; k < 5; j += 256, ++k) {
-            htable->table[j] = 0;
-            seed = (seed * 125 + 3) % 0x2AAAAB;
-            htable->table[j] |= (seed & 0xFFFF) << 16;
-            seed = (seed * 125 + 3) % 0x2AAAAB;
-            htable->table[j] |= seed & 0xFFFF;
-        }
-    }
+// Hash table management, readers are lock-free and go through a per-slot seqlock, writers share one spinlock
+static HASH_ARRAY *hash_array(uint64_t size) {
+    HASH_ARRAY *array = (HASH_ARRAY *)anmalloc(sizeof(HASH_ARRAY));
+    uint32_t i = 0;
 
-    while (size > (2 << i)) ++i; size = 2 << i;
+    size = size > HASH_GROUP ? size : HASH_GROUP;
+    while (size > (2ULL << i)) ++i;
+    size = 2ULL << i;
 
-    htable->elems = (HASH_ELEM *)anmalloc(sizeof(HASH_ELEM) * size);
-    memset(htable->elems, 0, sizeof(HASH_ELEM) * size);
-    for (i = 0; i < size; ++i) pthread_spin_init(&htable->elems[i].lock, PTHREAD_PROCESS_PRIVATE);
-    htable->size = size;
+    array->tags = (uint8_t volatile *)analign(size);
+    memset((void *)array->tags, HASH_EMPTY, size);
 
-    return htable;
-}
+    array->elems = (HASH_ELEM *)analign(sizeof(HASH_ELEM) * size);
+    memset(array->elems, 0, sizeof(HASH_ELEM) * size);
 
-uint32_t hash_string(const HASH_TABLE *htable, const char *str, uint32_t type) {
-    uint8_t *key = (uint8_t *)str;
-    uint32_t hash = 0x7FED7FED;
-    uint32_t mask = 0xEEEEEEEE;
+    array->size = size;
+    array->count = 0;
+    array->used = 0;
+    array->next = NULL;
 
-    while (*key != 0) {
-        hash = htable->table[(type << 8) + (*key)] ^ (hash + mask);
-        mask = (*key) + hash + mask + (mask << 5) + 3;
-        ++key;
-    }
+    return array;
+}
 
-    return hash;
+static void hash_release(HASH_ARRAY *array) {
+    anfree((void *)array->tags);
+    anfree(array->elems);
+    anfree(array);
 }
 
-void *hash_table(const HASH_TABLE *htable, const char *key, void *data, int action) {
-    uint32_t hash = hash_string(htable, key, 0);
-    uint32_t hash1 = hash_string(htable, key, 1);
-    uint32_t hash2 = hash_string(htable, key, 2);
+HASH_TABLE *hash_init(uint64_t size) {
+    HASH_TABLE *htable = (HASH_TABLE *)anmalloc(sizeof(HASH_TABLE));
 
-    uint64_t cur = hash & (htable->size - 1);
-    uint64_t pos = cur, max = htable->size, exist = 0;
+    // Start with room for the hint at a load factor of one half, the table grows on demand
+    htable->current = hash_array(size * 2);
+    htable->previous = NULL;
+    htable->retired = NULL;
+    memset(htable->keys, 0, sizeof(htable->keys));
+    htable->migrate = 0;
+    htable->seed = 0x9E3779B97F4A7C15ULL ^ (uint64_t)(uintptr_t)htable;
+    pthread_spin_init(&htable->lock, PTHREAD_PROCESS_PRIVATE);
 
-    while (1) {
-        pthread_spin_lock(&htable->elems[pos].lock);
-        if (htable->elems[pos].exist) {
-            if (htable->elems[pos].hash1 == hash1 && htable->elems[pos].hash2 == hash2) {
-                exist = 1; break;
-            } else {
-                pthread_spin_unlock(&htable->elems[pos].lock);
-                pos = (pos + 1) & (htable->size - 1);
-            }
+    return htable;
+}
 
-            if (pos == cur) {
-                pos = max; break;
-            }
-        } else
-            break;
-    }
+static inline uint64_t hash_mix(uint64_t value) {
+    value ^= value >> 33;
+    value *= 0xFF51AFD7ED558CCDULL;
+    value ^= value >> 33;
+    value *= 0xC4CEB9FE1A85EC53ULL;
+    value ^= value >> 33;
 
-    if (action == HTABLE_FIND) {
-        if (pos < max && exist) {
-            data = htable->elems[pos].data;
-            pthread_spin_unlock(&htable->elems[pos].lock);
+    return value;
+}
 
-            return data;
-        }
-    } else if (action == HTABLE_SET) {
-        if (pos < max && exist) {
-            htable->elems[pos].data = data;
-            pthread_spin_unlock(&htable->elems[pos].lock);
+// One pass over the key, eight bytes at a time
+uint64_t hash_bytes(const HASH_TABLE *htable, const void *key, size_t len) {
+    const char *str = (const char *)key; size_t left = len;
+    uint64_t hash = htable->seed ^ (len * 0x9E3779B97F4A7C15ULL), word = 0;
 
-            return data;
-        }
-    } else if (action == HTABLE_CREATE) {
-        if (pos < max && !exist) {
-            htable->elems[pos].exist = 1;
-            htable->elems[pos].hash1 = hash1;
-            htable->elems[pos].hash2 = hash2;
-            htable->elems[pos].data = data;
-            pthread_spin_unlock(&htable->elems[pos].lock);
-
-            return data;
-        }
-    } else if (action == HTABLE_DELETE) {
-        if (pos < max && exist) {
-            data = htable->elems[pos].data;
-            htable->elems[pos].exist = 0;
-            htable->elems[pos].hash1 = 0;
-            htable->elems[pos].hash2 = 0;
-            htable->elems[pos].data = NULL;
-            pthread_spin_unlock(&htable->elems[pos].lock);
-
-            return data;
-        }
+    for (; left >= 8; left -= 8, str += 8) {
+        memcpy(&word, str, 8);
+        hash = (hash ^ hash_mix(word)) * 0x9E3779B97F4A7C15ULL;
+        hash = hash << 31 | hash >> 33;
     }
 
-    if (pos < max) pthread_spin_unlock(&htable->elems[pos].lock);
+    word = 0;
+    memcpy(&word, str, left);
+    hash = hash_mix(hash ^ word ^ ((uint64_t)left << 56));
 
-    return NULL;
+    return hash != 0 ? hash : 1;
 }
 
-void hash_clean(HASH_TABLE *htable) {
-    int i = 0; for (i = 0; i < htable->size; ++i) pthread_spin_destroy(&htable->elems[i].lock);
-    anfree(htable->elems);
-    anfree(htable);
+static inline uint8_t hash_tag(uint64_t hash) {
+    return (uint8_t)(hash >> 57) | 0x80;
 }
 
-// Ring buffer function
-RING_BUFFER *buffer_init(uint64_t size) {
-    RING_BUFFER *buffer = (RING_BUFFER *)anmalloc(sizeof(RING_BUFFER));
+static inline uint32_t hash_match(const uint8_t volatile *tags, uint8_t tag) {
+#ifdef __SSE2__
+    __m128i group = _mm_load_si128((const __m128i *)tags);
 
-    int i = 0; while (size > (2 << i)) ++i; size = 2 << i;
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+#else
+    uint32_t mask = 0, i = 0;
 
-    buffer->size = size;
-    buffer->elems = (RING_ELEM *)anmalloc(sizeof(RING_ELEM) * size);
-    memset(buffer->elems, 0, sizeof(RING_ELEM) * size);
-    buffer->read = 0;
-    buffer->write = 0;
-    buffer->valid = 0;
+    for (i = 0; i < HASH_GROUP; ++i)
+        if (tags[i] == tag) mask |= 1U << i;
 
-    return buffer;
+    return mask;
+#endif
 }
 
-int buffer_write(RING_BUFFER *buffer, void *data) {
-    uint64_t old = 0, new = 0, idx = 0;
-
-    do {
-        old = buffer->write;
-        new = old + 1;
-    } while (!bool_cas(&buffer->write, old, new));
-
-    idx = old & (buffer->size - 1);
-
-    if (new < buffer->read + buffer->size) {
-        buffer->elems[idx].data = data;
-        sync_add(uint64_t, buffer->valid, 1);
-        return 1;
-    } else {
-        sync_sub(uint64_t, buffer->write, 1);
-        return 0;
-    }
+static inline uint32_t hash_class(size_t len) {
+    return len <= 16 ? 4 : 64 - __builtin_clzll(len - 1);
 }
 
-int buffer_read(RING_BUFFER *buffer, void **data) {
-    uint64_t old = 0, new = 0, idx = 0;
+// Writers only, under the table lock
+static HASH_KEY *hash_key(HASH_TABLE *htable, const void *key, size_t len) {
+    uint32_t class = hash_class(len); HASH_KEY *record = htable->keys[class];
 
-    do {
-        old = buffer->read;
-        new = old + 1;
-    } while (!bool_cas(&buffer->read, old, new));
+    if (record != NULL)
+        htable->keys[class] = record->next;
+    else
+        record = (HASH_KEY *)anmalloc(sizeof(HASH_KEY) + (1ULL << class));
 
-    idx = old & (buffer->size - 1);
+    record->next = NULL;
+    record->len = len;
+    memcpy(record->data, key, len);
 
-    if (new <= buffer->valid) {
-        if (data != NULL) *data = buffer->elems[idx].data;
-        return 1;
-    } else {
-        sync_sub(uint64_t, buffer->read, 1);
-        return 0;
-    }
+    return record;
 }
 
-void buffer_clean(RING_BUFFER *buffer) {
-    anfree(buffer->elems);
-    anfree(buffer);
+static void hash_unkey(HASH_TABLE *htable, HASH_KEY *record) {
+    uint32_t class = hash_class(record->len);
+
+    record->next = htable->keys[class];
+    htable->keys[class] = record;
 }
 
-// Actor model section
-static inline void root_callback(ACTOR_ROOT *root, void *data) { actor_broadcast(root, data); }
+// Equal hashes are only a hit when the stored key matches too, the compare runs inside the seqlock
+// so a record recycled meanwhile makes the read retry
+static inline int hash_read(HASH_ELEM *elem, uint64_t hash, const void *key, size_t len, void **data) {
+    uint64_t seq = 0; void *ptr = NULL; HASH_KEY *stored = NULL; int same = 0;
 
-static inline int send_mail(ACTOR_ROOT *root, ACTOR_NODE *node, void *data) {
-    uint64_t old = node->status, new = 0;
+    while (1) {
+        seq = load_acquire(&elem->seq);
 
-    if (!(old & ACTOR_DEFAULT && old & ACTOR_RUNNABLE)) return 0;
+        if (seq & 1) { cpu_pause(); continue; }
 
-    if (buffer_size(node->inbox) >= root->maxinbox - 1) return 0;
+        ptr = load_relaxed(&elem->data);
+        stored = load_relaxed(&elem->key);
+        same = load_relaxed(&elem->hash) == hash && stored != NULL && stored->len == len && memcmp(stored->data, key, len) == 0;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
 
-    while (!buffer_write(node->inbox, data));
+        if (load_relaxed(&elem->seq) == seq) break;
+    }
 
-    if (!(old & ACTOR_RUNTASK)) {
-        new = old | ACTOR_RUNTASK;
+    if (!same) return 0;
 
-        if (bool_cas(&node->status, old, new) && buffer_size(root->task) < root->maxnode)
-            while (!buffer_write(root->task, node));
-    }
+    *data = ptr;
 
     return 1;
 }
 
-ACTOR_ROOT *actor_init(const char *name, size_t maxnode, size_t maxworker, size_t maxinbox) {
-    if (name == NULL || maxnode == 0 || maxworker == 0 || maxinbox == 0) return NULL;
-
-    ACTOR_ROOT *root = (ACTOR_ROOT *)anmalloc(sizeof(ACTOR_ROOT));
-    memset(root, 0 , sizeof(ACTOR_ROOT));
-
-    root->nodestable = hash_init(maxnode + 1);
-    if (hash_table(root->nodestable, name, root, HTABLE_CREATE) == NULL) {
-        hash_clean(root->nodestable);
-        anfree(root);
-        return NULL;
-    }
+static inline void hash_write(HASH_ELEM *elem, uint64_t hash, HASH_KEY *key, void *data) {
+    uint64_t seq = elem->seq;
 
-    root->status = ACTOR_DEFAULT | ACTOR_RUNNABLE;
-    root->cb = root_callback;
-    root->inbox = buffer_init(maxinbox);
+    store_relaxed(&elem->seq, seq + 1);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
 
-    root->breakout = 0;
+    store_relaxed(&elem->hash, hash);
+    store_relaxed(&elem->key, key);
+    store_relaxed(&elem->data, data);
 
-    root->nodes = (ACTOR_NODE *)anmalloc(sizeof(ACTOR_NODE) * maxnode);
-    memset(root->nodes, 0, sizeof(ACTOR_NODE) * maxnode);
+    store_release(&elem->seq, seq + 2);
+}
 
-    root->maxnode = maxnode;
-    root->maxworker = maxworker;
-    root->maxinbox = maxinbox;
-    root->task = buffer_init(maxnode + 1);
+// Returns the slot holding the key or size, free receives the first reusable slot on the probe path
+static inline uint64_t hash_probe(HASH_ARRAY *array, uint64_t hash, const void *key, size_t len, void **data, uint64_t *free) {
+    uint64_t groups = array->size / HASH_GROUP, group = hash & (groups - 1), i = 0, pos = 0;
+    uint8_t tag = hash_tag(hash); uint32_t mask = 0;
+    void *value = NULL;
 
-    root->master = 0;
-    pthread_mutex_init(&root->masterlock, NULL);
-    pthread_cond_init(&root->mastercond, NULL);
+    if (free != NULL) *free = array->size;
 
-    root->workers = (pthread_t *)anmalloc(sizeof(pthread_t) * maxworker);
-    memset(root->workers, 0, sizeof(pthread_t) * maxworker);
-    pthread_mutex_init(&root->workerlock, NULL);
-    pthread_cond_init(&root->workercond, NULL);
+    for (i = 0; i < groups; ++i, group = (group + 1) & (groups - 1)) {
+        uint8_t volatile *tags = array->tags + group * HASH_GROUP;
 
-    return root;
-}
+        for (mask = hash_match(tags, tag); mask; mask &= mask - 1) {
+            pos = group * HASH_GROUP + __builtin_ctz(mask);
 
-static void *thread_worker(void *data) {
-    ACTOR_ROOT *root = (ACTOR_ROOT *)data;
-    ACTOR_NODE *node = NULL; uint64_t status = 0;
+            if (hash_read(array->elems + pos, hash, key, len, &value)) {
+                if (data != NULL) *data = value;
+                return pos;
+            }
+        }
 
-    while (!root->breakout) {
-        if (buffer_size(root->task) == 0) {
-            pthread_mutex_lock(&root->masterlock);
-            pthread_cond_signal(&root->mastercond);
-            pthread_mutex_unlock(&root->masterlock);
-
-            pthread_mutex_lock(&root->workerlock);
-            pthread_cond_wait(&root->workercond, &root->workerlock);
-            pthread_mutex_unlock(&root->workerlock);
-            continue;
+        if (free != NULL && *free == array->size) {
+            mask = hash_match(tags, HASH_EMPTY) | hash_match(tags, HASH_DELETED);
+            if (mask) *free = group * HASH_GROUP + __builtin_ctz(mask);
         }
 
-        if (buffer_read(root->task, &data) && data != NULL) {
-            node = (ACTOR_NODE *)data; status = node->status;
+        if (hash_match(tags, HASH_EMPTY)) break;
+    }
 
-            if (status & ACTOR_RUNNABLE && status & ACTOR_RUNTASK) {
-                while (buffer_read(node->inbox, &data)) {
-                    if (node->cb != NULL) { node->cb(root, data); loop_delay(100); }
-                }
-            }
+    return array->size;
+}
 
-            sync_xor(uint64_t, node->status, ACTOR_RUNTASK);
-        }
-    }
+static inline void hash_insert(HASH_ARRAY *array, uint64_t pos, uint64_t hash, HASH_KEY *key, void *data) {
+    if (array->tags[pos] == HASH_EMPTY) ++array->used;
+    ++array->count;
 
-    pthread_exit(NULL);
+    hash_write(array->elems + pos, hash, key, data);
+    store_release(&array->tags[pos], hash_tag(hash));
 }
 
-static void *thread_master(void *data) {
-    size_t i = 0, retry = 10; uint64_t size = 0;
-    ACTOR_ROOT *root = (ACTOR_ROOT *)data;
+static inline void hash_remove(HASH_ARRAY *array, uint64_t pos) {
+    --array->count;
 
-    while (!root->breakout) {
-        //loop_delay(100);
-        size = buffer_size(root->task);
+    // Leave a tombstone so the probe chains running through this slot stay intact, the key record stays with the caller
+    store_release(&array->tags[pos], HASH_DELETED);
+    hash_write(array->elems + pos, 0, NULL, NULL);
+}
 
-        if (size == 0) {
-            //if (retry == 0) {
-                pthread_mutex_lock(&root->masterlock);
-                pthread_cond_wait(&root->mastercond, &root->masterlock);
-                pthread_mutex_unlock(&root->masterlock);
-            //} else
-                --retry;
+// Move a few slots from the previous array, a key is written to the new array before it leaves the old one
+static void hash_migrate(HASH_TABLE *htable, uint64_t count) {
+    HASH_ARRAY *previous = htable->previous, *current = htable->current;
+    uint64_t free = 0;
 
-            continue;
-        } else {
-            retry = 10;
+    if (previous == NULL) return;
 
-            if (size > root->maxworker)
-                size = root->maxworker;
-        }
+    for (; count && htable->migrate < previous->size; --count, ++htable->migrate) {
+        uint64_t pos = htable->migrate;
 
-        for (i = 0; i < size; ++i) {
-            if (!thread_alive(root->workers[i])) {
-                pthread_attr_t attr;
-                pthread_attr_init(&attr);
-                pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+        if (previous->tags[pos] == HASH_EMPTY || previous->tags[pos] == HASH_DELETED) continue;
 
-                if (pthread_create(root->workers + i, &attr, thread_worker, root) != 0) {
-                    root->breakout = 1; break;
-                }
+        HASH_ELEM *elem = previous->elems + pos;
 
-                pthread_attr_destroy(&attr);
-            } else {
-                pthread_mutex_lock(&root->workerlock);
-                pthread_cond_signal(&root->workercond);
-                pthread_mutex_unlock(&root->workerlock);
-            }
-        }
+        hash_probe(current, elem->hash, elem->key->data, elem->key->len, NULL, &free);
+        hash_insert(current, free, elem->hash, elem->key, elem->data);
+        hash_remove(previous, pos);
     }
 
-    pthread_mutex_lock(&root->workerlock);
-    pthread_cond_broadcast(&root->workercond);
-    pthread_mutex_unlock(&root->workerlock);
+    if (htable->migrate == previous->size) {
+        store_release(&htable->previous, NULL);
 
-    for (i = 0; i < size; ++i)
-        if (thread_alive(root->workers[i]))
-            pthread_join(root->workers[i], NULL);
-
-    pthread_exit(NULL);
+        // Lock-free readers may still be walking it, so it is only released by hash_clean
+        previous->next = htable->retired;
+        htable->retired = previous;
+    }
 }
 
-void actor_run(ACTOR_ROOT *root) {
-    if (root == NULL) return;
+static void hash_grow(HASH_TABLE *htable) {
+    HASH_ARRAY *current = htable->current;
 
-    if (thread_alive(root->master)) return;
+    // Finish any migration still running before starting the next one
+    while (htable->previous != NULL) hash_migrate(htable, current->size);
 
-    pthread_attr_t attr;
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+    if ((current->used + 1) * 4 <= current->size * 3) return;
 
-    if (pthread_create(&root->master, &attr, thread_master, root) != 0)
-        root->breakout = 1;
-    else
-        root->breakout = 0;
+    // Mostly tombstones rebuild at the same size, otherwise double
+    uint64_t size = current->count * 4 < current->size ? current->size : current->size * 2;
 
-    pthread_attr_destroy(&attr);
+    htable->migrate = 0;
+    store_release(&htable->previous, current);
+    store_release(&htable->current, hash_array(size));
 }
 
-ACTOR_NODE *actorn_manage(ACTOR_ROOT *root, ACTOR_NODE *node, ACTOR_CB cb, int action) {
-    size_t i = 0; if (root == NULL) return NULL;
+void *hash_tablek(HASH_TABLE *htable, const void *key, size_t len, void *data, int action) {
+    uint64_t hash = hash_bytes(htable, key, len), pos = 0, free = 0;
+    HASH_ARRAY *current = NULL, *previous = NULL; HASH_KEY *record = NULL;
+    void *value = NULL;
 
-    if (action == ACTORN_FIND) {
-        for (i = 0; i < root->maxnode; ++i)
-            if (root->nodes + i == node)
-                break;
+    if (action == HTABLE_FIND) {
+        do {
+            current = load_acquire(&htable->current);
+            previous = load_acquire(&htable->previous);
 
-        if (i == root->maxnode) return NULL;
-    } else if (action == ACTORN_SET) {
-        if (node == NULL || node->status & ACTOR_RUNNABLE) return NULL;
+            // Old array first, a migrating key reaches the new array before it leaves the old one
+            if (previous != NULL && previous != current && hash_probe(previous, hash, key, len, &value, NULL) < previous->size)
+                return value;
 
-        sync_value(ACTOR_CB, node->cb, cb);
-    } else if (action == ACTORN_CREATE) {
-        for (i = 0; i < root->maxnode; ++i) {
-            if (root->nodes + i == node) return NULL;
+            if (hash_probe(current, hash, key, len, &value, NULL) < current->size)
+                return value;
+        } while (load_acquire(&htable->current) != current);
 
-            if (root->nodes[i].status == 0) break;
-        }
+        return NULL;
+    }
 
-        if (i == root->maxnode) return NULL;
+    pthread_spin_lock(&htable->lock);
 
-        node = &root->nodes[i];
+    if (action == HTABLE_CREATE) hash_grow(htable);
 
-        sync_value(uint64_t, node->status, ACTOR_DEFAULT);
-        sync_value(ACTOR_CB, node->cb, cb);
-        node->inbox = buffer_init(root->maxinbox);
-    } else if (action == ACTORN_START) {
-        if (node == NULL || node->status & ACTOR_RUNNABLE) return node;
+    hash_migrate(htable, HASH_MIGRATE);
 
-        sync_or(uint64_t, node->status, ACTOR_RUNNABLE);
-    } else if (action == ACTORN_STOP) {
-        if (node == NULL || !(node->status & ACTOR_RUNNABLE)) return node;
+    current = htable->current;
+    previous = htable->previous;
+    value = NULL;
 
-        sync_xor(uint64_t, node->status, ACTOR_RUNNABLE);
-    } else if (action == ACTORN_DELETE) {
-        if (node == NULL || node->status != ACTOR_DEFAULT) return NULL;
+    if (previous != NULL && (pos = hash_probe(previous, hash, key, len, &value, NULL)) < previous->size) {
+        record = previous->elems[pos].key;
 
-        sync_value(uint64_t, node->status, 0);
-        sync_value(ACTOR_CB, node->cb, NULL);
-        buffer_clean(node->inbox);
+        if (action == HTABLE_SET) {
+            hash_probe(current, hash, key, len, NULL, &free);
+            hash_insert(current, free, hash, record, data);
+            hash_remove(previous, pos);
+            value = data;
+        } else if (action == HTABLE_DELETE) {
+            hash_remove(previous, pos);
+            hash_unkey(htable, record);
+        } else
+            value = NULL;
+    } else if ((pos = hash_probe(current, hash, key, len, &value, &free)) < current->size) {
+        record = current->elems[pos].key;
+
+        if (action == HTABLE_SET) {
+            hash_write(current->elems + pos, hash, record, data);
+            value = data;
+        } else if (action == HTABLE_DELETE) {
+            hash_remove(current, pos);
+            hash_unkey(htable, record);
+        } else
+            value = NULL;
+    } else if (action == HTABLE_CREATE && free < current->size) {
+        hash_insert(current, free, hash, hash_key(htable, key, len), data);
+        value = data;
     } else
-        return NULL;
+        value = NULL;
 
-    return node;
-}
+    pthread_spin_unlock(&htable->lock);
 
-int actorn_send(ACTOR_ROOT *root, ACTOR_NODE *node, void *data) {
-    if (root == NULL || node == NULL) return 0;
+    return value;
+}
 
-    if (!send_mail(root, node, data)) return 0;
+uint64_t hash_count(HASH_TABLE *htable) {
+    HASH_ARRAY *previous = NULL; uint64_t count = 0;
 
-    pthread_mutex_lock(&root->masterlock);
-    pthread_cond_signal(&root->mastercond);
-    pthread_mutex_unlock(&root->masterlock);
+    pthread_spin_lock(&htable->lock);
 
-    return 1;
-}
+    previous = htable->previous;
+    count = htable->current->count + (previous != NULL ? previous->count : 0);
 
-int actors_manage(ACTOR_ROOT *root, const char *name, ACTOR_CB cb, int action) {
-    if (root == NULL || name == NULL) return 0;
+    pthread_spin_unlock(&htable->lock);
 
-    size_t i = 0; ACTOR_NODE *node = NULL;
+    return count;
+}
 
-    if (action == ACTORS_FIND) {
-        node = hash_table(root->nodestable, name, NULL, HTABLE_FIND);
+void hash_clean(HASH_TABLE *htable) {
+    HASH_ARRAY *array = NULL, *next = NULL; HASH_KEY *record = NULL, *after = NULL;
+    uint64_t i = 0; uint32_t class = 0;
 
-        if (node == NULL) return 0;
-    } else if (action == ACTORS_SET) {
-        node = hash_table(root->nodestable, name, NULL, HTABLE_FIND);
+    // Live keys sit in exactly one of the two arrays, tombstones hold none
+    for (i = 0; i < htable->current->size; ++i)
+        anfree(htable->current->elems[i].key);
 
-        if (node == NULL) return 0;
+    for (i = 0; htable->previous != NULL && i < htable->previous->size; ++i)
+        anfree(htable->previous->elems[i].key);
 
-        if (node->status & ACTOR_RUNNABLE) return 0;
+    for (class = 0; class < HASH_KEYCLASSES; ++class)
+        for (record = htable->keys[class]; record != NULL; record = after) {
+            after = record->next;
+            anfree(record);
+        }
 
-        sync_value(ACTOR_CB, node->cb, cb);
-    } else if (action == ACTORS_CREATE) {
-        for (i = 0; i < root->maxnode; ++i)
-            if (root->nodes[i].status == 0)
-                break;
+    if (htable->previous != NULL) hash_release(htable->previous);
+    hash_release(htable->current);
 
-        if (i == root->maxnode) return 0;
+    for (array = htable->retired; array != NULL; array = next) {
+        next = array->next;
+        hash_release(array);
+    }
 
-        node = &root->nodes[i];
+    pthread_spin_destroy(&htable->lock);
+    anfree(htable);
+}
 
-        if (hash_table(root->nodestable, name, node, HTABLE_CREATE) == NULL) return 0;
+// Ring buffer function, bounded mpmc queue with a sequence number per slot
+RING_BUFFER *buffer_init(uint64_t size) {
+    RING_BUFFER *buffer = (RING_BUFFER *)analign(sizeof(RING_BUFFER));
+    memset(buffer, 0, sizeof(RING_BUFFER));
 
-        sync_value(uint64_t, node->status, ACTOR_DEFAULT);
-        sync_value(ACTOR_CB, node->cb, cb);
-        node->inbox = buffer_init(root->maxinbox);
-    } else if (action == ACTORS_START) {
-        node = hash_table(root->nodestable, name, NULL, HTABLE_FIND);
+    int i = 0; while (size > (2 << i)) ++i; size = 2 << i;
 
-        if (node == NULL) return 0;
+    buffer->size = size;
+    buffer->elems = (RING_ELEM *)analign(sizeof(RING_ELEM) * size);
+    memset(buffer->elems, 0, sizeof(RING_ELEM) * size);
+    for (i = 0; i < size; ++i) buffer->elems[i].seq = i;
+    buffer->read = 0;
+    buffer->write = 0;
 
-        if (node->status & ACTOR_RUNNABLE) return 1;
+    return buffer;
+}
 
-        sync_or(uint64_t, node->status, ACTOR_RUNNABLE);
-    } else if (action == ACTORS_STOP) {
-        node = hash_table(root->nodestable, name, NULL, HTABLE_FIND);
+int buffer_write(RING_BUFFER *buffer, void *data) {
+    uint64_t pos = load_relaxed(&buffer->write), seq = 0;
+    RING_ELEM *elem = NULL;
 
-        if (node == NULL) return 0;
+    while (1) {
+        elem = buffer->elems + (pos & (buffer->size - 1));
+        seq = load_acquire(&elem->seq);
+
+        if (seq == pos) {
+            if (weak_cas(&buffer->write, &pos, pos + 1)) break;
+        } else if ((int64_t)(seq - pos) < 0)
+            return 0;
+        else
+            pos = load_relaxed(&buffer->write);
+    }
 
-        if (!(node->status & ACTOR_RUNNABLE)) return 1;
+    elem->data = data;
+    store_release(&elem->seq, pos + 1);
 
-        sync_xor(uint64_t, node->status, ACTOR_RUNNABLE);
-    } else if (action == ACTORS_DELETE) {
-        node = hash_table(root->nodestable, name, NULL, HTABLE_DELETE);
+    return 1;
+}
 
-        if (node == NULL) return 0;
+int buffer_read(RING_BUFFER *buffer, void **data) {
+    uint64_t pos = load_relaxed(&buffer->read), seq = 0;
+    RING_ELEM *elem = NULL;
 
-        if (node->status != ACTOR_DEFAULT) return 0;
+    while (1) {
+        elem = buffer->elems + (pos & (buffer->size - 1));
+        seq = load_acquire(&elem->seq);
+
+        if (seq == pos + 1) {
+            if (weak_cas(&buffer->read, &pos, pos + 1)) break;
+        } else if ((int64_t)(seq - (pos + 1)) < 0)
+            return 0;
+        else
+            pos = load_relaxed(&buffer->read);
+    }
 
-        sync_value(uint64_t, node->status, 0);
-        sync_value(ACTOR_CB, node->cb, NULL);
-        buffer_clean(node->inbox);
-    } else
-        return 0;
+    if (data != NULL) *data = elem->data;
+    store_release(&elem->seq, pos + buffer->size);
 
     return 1;
 }
 
-int actors_send(ACTOR_ROOT *root, const char *name, void *data) {
-    if (root == NULL || name == NULL) return 0;
+void buffer_clean(RING_BUFFER *buffer) {
+    anfree(buffer->elems);
+    anfree(buffer);
+}
 
-    ACTOR_NODE *node = hash_table(root->nodestable, name, NULL, HTABLE_FIND);
+// Mailbox function, mpsc queue of linked segments taken from a shared pool as messages arrive
+MAILBOX_POOL *mailbox_pool(uint64_t max) {
+    MAILBOX_POOL *pool = (MAILBOX_POOL *)analign(sizeof(MAILBOX_POOL));
 
-    if (node == NULL) return 0;
+    pthread_spin_init(&pool->lock, PTHREAD_PROCESS_PRIVATE);
+    pool->free = NULL;
+    pool->count = 0;
+    pool->max = max;
+    pool->notifies = NULL;
 
-    if (!send_mail(root, node, data)) return 0;
+    return pool;
+}
 
-    pthread_mutex_lock(&root->masterlock);
-    pthread_cond_signal(&root->mastercond);
-    pthread_mutex_unlock(&root->masterlock);
+static MAILBOX_SEGMENT *segment_get(MAILBOX_POOL *pool) {
+    MAILBOX_SEGMENT *segment = NULL;
 
-    return 1;
-}
+    pthread_spin_lock(&pool->lock);
 
-int actor_broadcast(ACTOR_ROOT *root, void *data) {
-    uint64_t i = 0; if (root == NULL) return 0;
+    if ((segment = pool->free) != NULL) {
+        pool->free = segment->next;
+        --pool->count;
+    }
 
-    for (i = 0; i < root->maxnode; ++i)
-        if (!send_mail(root, &root->nodes[i], data)) return 0;
+    pthread_spin_unlock(&pool->lock);
 
-    pthread_mutex_lock(&root->masterlock);
-    pthread_cond_signal(&root->mastercond);
-    pthread_mutex_unlock(&root->masterlock);
+    if (segment == NULL) segment = (MAILBOX_SEGMENT *)analign(sizeof(MAILBOX_SEGMENT));
 
-    return 1;
+    segment->next = NULL;
+    segment->marks = 0;
+
+    return segment;
 }
 
-void actor_wait(ACTOR_ROOT *root) {
-    if (root == NULL) return;
+static void segment_put(MAILBOX_POOL *pool, MAILBOX_SEGMENT *segment) {
+    pthread_spin_lock(&pool->lock);
+
+    if (pool->count < pool->max) {
+        segment->next = pool->free;
+        pool->free = segment;
+        ++pool->count;
+        segment = NULL;
+    }
 
-    if (thread_alive(root->master))
-        pthread_join(root->master, NULL);
+    pthread_spin_unlock(&pool->lock);
+
+    if (segment != NULL) anfree(segment);
 }
 
-void actor_break(ACTOR_ROOT *root) {
-    if (root == NULL) return;
+void mailbox_release(MAILBOX_POOL *pool) {
+    MAILBOX_SEGMENT *segment = NULL, *next = NULL;
+    MAILBOX_NOTIFY *notify = NULL, *after = NULL;
 
-    if (thread_alive(root->master)) {
-        root->breakout = 1;
+    for (segment = pool->free; segment != NULL; segment = next) {
+        next = segment->next;
+        anfree(segment);
+    }
 
-        pthread_mutex_lock(&root->masterlock);
-        pthread_cond_signal(&root->mastercond);
-        pthread_mutex_unlock(&root->masterlock);
+    for (notify = pool->notifies; notify != NULL; notify = after) {
+        after = notify->next;
+        anfree(notify);
     }
+
+    pthread_spin_destroy(&pool->lock);
+    anfree(pool);
 }
 
-void actor_clean(ACTOR_ROOT *root) {
-    int i = 0; if (root == NULL) return;
+MAILBOX *mailbox_init(MAILBOX_POOL *pool, uint64_t size) {
+    MAILBOX *mailbox = (MAILBOX *)analign(sizeof(MAILBOX));
+    memset(mailbox, 0, sizeof(MAILBOX));
 
-    buffer_clean(root->inbox);
-    hash_clean(root->nodestable);
+    // No segment until the first message, an idle mailbox costs only this header
+    mailbox->pool = pool;
+    mailbox->size = size;
+    pthread_spin_init(&mailbox->lock, PTHREAD_PROCESS_PRIVATE);
 
-    for (i = 0; i < root->maxnode; ++i)
-        if (root->nodes[i].status != 0)
-            buffer_clean(root->nodes[i].inbox);
+    return mailbox;
+}
 
-    buffer_clean(root->task);
+// The caller holds the mailbox lock
+static int mailbox_push(MAILBOX *mailbox, void *data, int mark, uint64_t size) {
+    MAILBOX_SEGMENT *segment = NULL;
+
+    if (mailbox->write - load_acquire(&mailbox->read) >= size) return 0;
+
+    if (mailbox->tail == NULL) {
+        segment = segment_get(mailbox->pool);
+        mailbox->head = mailbox->tail = segment;
+        mailbox->headpos = mailbox->tailpos = 0;
+    } else if (mailbox->tailpos == MAILBOX_SLOTS) {
+        segment = segment_get(mailbox->pool);
+        store_relaxed(&mailbox->tail->next, segment);
+        mailbox->tail = segment;
+        mailbox->tailpos = 0;
+    }
 
-    pthread_mutex_destroy(&root->masterlock);
-    pthread_cond_destroy(&root->mastercond);
-    pthread_mutex_destroy(&root->workerlock);
-    pthread_cond_destroy(&root->workercond);
+    // Set before write is released, the reader sees the mark together with the slot
+    if (mark) store_relaxed(&mailbox->tail->marks, mailbox->tail->marks | 1ULL << mailbox->tailpos);
 
-    anfree(root->workers);
-    anfree(root->nodes);
-    anfree(root);
+    store_relaxed(&mailbox->tail->slots[mailbox->tailpos++], data);
+    store_release(&mailbox->write, mailbox->write + 1);
+
+    return 1;
 }
 
+int mailbox_write(MAILBOX *mailbox, void *data) {
+    int ret = 0;
 
+    pthread_spin_lock(&mailbox->lock);
+    ret = mailbox_push(mailbox, data, 0, mailbox->size);
+    pthread_spin_unlock(&mailbox->lock);
 
+    return ret;
+}
 
+// Only the worker currently running the actor reads, so the consumer side needs no lock
+static int mailbox_take(MAILBOX *mailbox, void **data, int *mark) {
+    MAILBOX_SEGMENT *segment = NULL;
+    uint64_t read = mailbox->read;
 
+    if (read == load_acquire(&mailbox->write)) return 0;
 
-#include <stdio.h>
-#include <unistd.h>
+    if (mailbox->headpos == MAILBOX_SLOTS) {
+        segment = mailbox->head;
+        mailbox->head = load_relaxed(&segment->next);
+        mailbox->headpos = 0;
+        segment_put(mailbox->pool, segment);
+    }
 
-void count_cb(ACTOR_ROOT *root, void *data) {
-    int *count = (int *)data;
+    *mark = (int)(load_relaxed(&mailbox->head->marks) >> mailbox->headpos & 1);
+    *data = load_relaxed(&mailbox->head->slots[mailbox->headpos++]);
+    store_release(&mailbox->read, read + 1);
 
-    ++(*count);
-}
+    // Pairs with the waiter count in mailbox_wait, a blocked sender either sees the room or gets woken
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
 
-void producer_cb(ACTOR_ROOT *root, void *data) {
-    int i = 0;
+    if (load_relaxed(&mailbox->waiters)) {
+        __atomic_fetch_add(&mailbox->space, 1, __ATOMIC_RELEASE);
+        futex_wake(&mailbox->space, 1);
+    }
 
-    for (i = 0; i < 10000; ++i)
-        while (!actors_send(root, "count", data));
+    return 1;
 }
 
-void producer2_cb(ACTOR_ROOT *root, void *data) {
-    int i = 0;
+int mailbox_read(MAILBOX *mailbox, void **data) {
+    int mark = 0;
 
-    for (i = 0; i < 10000; ++i)
-        while (!actors_send(root, "count", data));
+    return mailbox_take(mailbox, data, &mark);
 }
 
-void consumer_cb(ACTOR_ROOT *root, void *data) {
-    int i = 0;
-
-    for (i = 0; i < 20000; ++i)
-        while (!actors_send(root, "count", data));
+static inline int mailbox_full(MAILBOX *mailbox) {
+    return load_acquire(&mailbox->write) - load_acquire(&mailbox->read) >= mailbox->size;
 }
 
-void consumer2_cb(ACTOR_ROOT *root, void *data) {
-    int i = 0;
+// Park until the reader makes room, timeout is in nanoseconds and zero waits forever
+int mailbox_wait(MAILBOX *mailbox, uint64_t timeout) {
+    uint64_t deadline = timeout ? actor_now() + timeout : 0, now = 0;
+    uint32_t space = 0; int ret = 1;
 
-    for (i = 0; i < 20000; ++i)
-        while (!actors_send(root, "count", data));
-}
+    while (1) {
+        space = load_acquire(&mailbox->space);
+        __atomic_fetch_add(&mailbox->waiters, 1, __ATOMIC_SEQ_CST);
 
-void ping_cb(ACTOR_ROOT *root, void *data) {
-    int *count = (int *)data;
+        if (!mailbox_full(mailbox)) break;
 
-    ++(*count);
-    ++(*count);
+        if (deadline) {
+            struct timespec ts;
 
-    printf("count: %d\n", *count);
-    while (!actors_send(root, "pong", data));
+            if ((now = actor_now()) >= deadline) { ret = 0; break; }
+
+            ts.tv_sec = (deadline - now) / 1000000000ULL;
+            ts.tv_nsec = (deadline - now) % 1000000000ULL;
+            futex_waitfor(&mailbox->space, space, &ts);
+        } else
+            futex_wait(&mailbox->space, space);
+
+        __atomic_fetch_sub(&mailbox->waiters, 1, __ATOMIC_RELAXED);
+    }
+
+    __atomic_fetch_sub(&mailbox->waiters, 1, __ATOMIC_RELAXED);
+
+    return ret;
+}
+
+// Register interest in room, returns 0 without registering when the mailbox is no longer full
+int mailbox_notify(MAILBOX *mailbox, uint64_t waiter, void *token) {
+    MAILBOX_NOTIFY *notify = NULL; int ret = 0;
+
+    pthread_spin_lock(&mailbox->lock);
+
+    if (mailbox->write - load_acquire(&mailbox->read) >= mailbox->size) {
+        pthread_spin_lock(&mailbox->pool->lock);
+        if ((notify = mailbox->pool->notifies) != NULL) mailbox->pool->notifies = notify->next;
+        pthread_spin_unlock(&mailbox->pool->lock);
+
+        if (notify == NULL) notify = (MAILBOX_NOTIFY *)anmalloc(sizeof(MAILBOX_NOTIFY));
+
+        notify->waiter = waiter;
+        notify->token = token;
+        notify->next = mailbox->notify;
+        store_release(&mailbox->notify, notify);
+        ret = 1;
+    }
+
+    pthread_spin_unlock(&mailbox->lock);
+
+    return ret;
+}
+
+// Take every registered notification, the caller delivers them and hands the list to mailbox_unnotify
+MAILBOX_NOTIFY *mailbox_notified(MAILBOX *mailbox) {
+    MAILBOX_NOTIFY *notify = NULL;
+
+    if (load_acquire(&mailbox->notify) == NULL) return NULL;
+
+    pthread_spin_lock(&mailbox->lock);
+    notify = mailbox->notify;
+    mailbox->notify = NULL;
+    pthread_spin_unlock(&mailbox->lock);
+
+    return notify;
+}
+
+void mailbox_unnotify(MAILBOX *mailbox, MAILBOX_NOTIFY *notify) {
+    MAILBOX_NOTIFY *last = notify;
+
+    if (notify == NULL) return;
+
+    while (last->next != NULL) last = last->next;
+
+    pthread_spin_lock(&mailbox->pool->lock);
+    last->next = mailbox->pool->notifies;
+    mailbox->pool->notifies = notify;
+    pthread_spin_unlock(&mailbox->pool->lock);
+}
+
+// Drop pending mail and hand every segment back, no sender or reader may be active
+void mailbox_reset(MAILBOX *mailbox) {
+    MAILBOX_SEGMENT *segment = NULL, *next = NULL;
+
+    for (segment = mailbox->head; segment != NULL; segment = next) {
+        next = segment->next;
+        segment_put(mailbox->pool, segment);
+    }
+
+    mailbox->head = mailbox->tail = NULL;
+    mailbox->headpos = mailbox->tailpos = 0;
+    mailbox->read = mailbox->write = 0;
+
+    mailbox_unnotify(mailbox, mailbox_notified(mailbox));
+}
+
+void mailbox_clean(MAILBOX *mailbox) {
+    mailbox_reset(mailbox);
+    pthread_spin_destroy(&mailbox->lock);
+    anfree(mailbox);
+}
+
+// Message envelope, typed messages carved from per-thread slabs so steady state passing never mallocs
+typedef struct message_slab {
+    struct message_slab *next;
+    MESSAGE messages[MESSAGE_PERSLAB];
+} MESSAGE_SLAB;
+
+static MESSAGE_CACHE * volatile message_caches = NULL;
+static __thread MESSAGE_CACHE *message_cache = NULL;
+
+// Caches of exited threads, adopted before a new one is made so grow and retire cycles reuse the same slabs
+static MESSAGE_CACHE *message_spares = NULL;
+static pthread_mutex_t message_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Cross-thread frees collect here until the batch is full or goes to another owner
+static __thread MESSAGE_CACHE *message_owner = NULL;
+static __thread MESSAGE *message_head = NULL, *message_tail = NULL;
+static __thread size_t message_count = 0;
+
+MESSAGE_BLOB *blob_alloc(size_t size) {
+    MESSAGE_BLOB *blob = (MESSAGE_BLOB *)anmalloc(sizeof(MESSAGE_BLOB) + size);
+
+    blob->refs = 1;
+    blob->size = size;
+
+    return blob;
+}
+
+MESSAGE_BLOB *blob_ref(MESSAGE_BLOB *blob) {
+    __atomic_add_fetch(&blob->refs, 1, __ATOMIC_RELAXED);
+
+    return blob;
+}
+
+void blob_free(MESSAGE_BLOB *blob) {
+    if (blob != NULL && __atomic_sub_fetch(&blob->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        anfree(blob);
+}
+
+static MESSAGE_CACHE *cache_attach(void) {
+    MESSAGE_CACHE *cache = NULL;
+
+    pthread_mutex_lock(&message_lock);
+
+    if ((cache = message_spares) != NULL) {
+        message_spares = cache->spare;
+        cache->spare = NULL;
+    }
+
+    pthread_mutex_unlock(&message_lock);
+
+    // Frees from other threads kept landing on remote meanwhile, cache_get picks them up as usual
+    if (cache != NULL) return message_cache = cache;
+
+    cache = (MESSAGE_CACHE *)analign(sizeof(MESSAGE_CACHE));
+    memset(cache, 0, sizeof(MESSAGE_CACHE));
+
+    do cache->next = message_caches; while (!bool_cas(&message_caches, cache->next, cache));
+
+    return message_cache = cache;
+}
+
+static MESSAGE *cache_get(void) {
+    MESSAGE_CACHE *cache = message_cache != NULL ? message_cache : cache_attach();
+    MESSAGE *message = NULL; size_t i = 0;
+
+    if (cache->free == NULL && load_relaxed(&cache->remote) != NULL)
+        cache->free = __atomic_exchange_n(&cache->remote, NULL, __ATOMIC_ACQUIRE);
+
+    if (cache->free == NULL) {
+        MESSAGE_SLAB *slab = (MESSAGE_SLAB *)analign(sizeof(MESSAGE_SLAB));
+
+        slab->next = cache->slabs;
+        cache->slabs = slab;
+
+        for (i = 0; i < MESSAGE_PERSLAB; ++i) {
+            slab->messages[i].owner = cache;
+            slab->messages[i].next = i + 1 < MESSAGE_PERSLAB ? slab->messages + i + 1 : NULL;
+        }
+
+        cache->free = slab->messages;
+    }
+
+    message = cache->free;
+    cache->free = message->next;
+
+    return message;
+}
+
+MESSAGE *message_alloc(uint32_t type, const void *payload, size_t size) {
+    MESSAGE *message = cache_get();
+
+    message->type = type;
+    message->size = (uint32_t)size;
+    message->blob = NULL;
+
+    // Small payloads ride inline, anything bigger gets a blob of its own
+    if (size > MESSAGE_INLINE)
+        message->blob = blob_alloc(size);
+
+    if (payload != NULL && size) memcpy(message_data(message), payload, size);
+
+    return message;
+}
+
+MESSAGE *message_blob(uint32_t type, MESSAGE_BLOB *blob) {
+    MESSAGE *message = cache_get();
+
+    message->type = type;
+    message->size = blob != NULL ? (uint32_t)blob->size : 0;
+    message->blob = blob != NULL ? blob_ref(blob) : NULL;
+
+    return message;
+}
+
+void message_flush(void) {
+    MESSAGE *head = NULL;
+
+    if (message_owner == NULL) return;
+
+    head = load_relaxed(&message_owner->remote);
+
+    do message_tail->next = head; while (!__atomic_compare_exchange_n(&message_owner->remote, &head, message_head, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    message_owner = NULL;
+    message_head = message_tail = NULL;
+    message_count = 0;
+}
+
+void message_free(MESSAGE *message) {
+    if (message == NULL) return;
+
+    blob_free(message->blob);
+    message->blob = NULL;
+
+    if (message->owner == message_cache) {
+        message->next = message_cache->free;
+        message_cache->free = message;
+        return;
+    }
+
+    if (message_owner != message->owner) message_flush();
+
+    message->next = message_head;
+    message_head = message;
+    if (message_tail == NULL) message_tail = message;
+    message_owner = message->owner;
+
+    if (++message_count >= MESSAGE_BATCH) message_flush();
+}
+
+void message_detach(void) {
+    message_flush();
+
+    if (message_cache == NULL) return;
+
+    pthread_mutex_lock(&message_lock);
+    message_cache->spare = message_spares;
+    message_spares = message_cache;
+    pthread_mutex_unlock(&message_lock);
+
+    message_cache = NULL;
+}
+
+// Only safe once no thread passes messages anymore, every slab of every cache is released
+void message_clean(void) {
+    MESSAGE_CACHE *cache = NULL, *next = NULL;
+    MESSAGE_SLAB *slab = NULL, *pending = NULL;
+
+    message_flush();
+
+    for (cache = message_caches; cache != NULL; cache = next) {
+        next = cache->next;
+
+        for (slab = cache->slabs; slab != NULL; slab = pending) {
+            pending = slab->next;
+            anfree(slab);
+        }
+
+        anfree(cache);
+    }
+
+    message_caches = NULL;
+    message_cache = NULL;
+    message_spares = NULL;
+}
+
+// Work stealing deque, the owner pushes and pops at the bottom, thieves steal at the top
+static void deque_init(ACTOR_DEQUE *deque, uint64_t size) {
+    int i = 0; while (size > (2 << i)) ++i; size = 2 << i;
+
+    deque->top = 0;
+    deque->bottom = 0;
+    deque->size = size;
+    deque->elems = (ACTOR_NODE * volatile *)anmalloc(sizeof(ACTOR_NODE *) * size);
+    memset((void *)deque->elems, 0, sizeof(ACTOR_NODE *) * size);
+}
+
+static inline void deque_push(ACTOR_DEQUE *deque, ACTOR_NODE *node) {
+    int64_t bottom = load_relaxed(&deque->bottom);
+
+    store_relaxed(&deque->elems[bottom & (deque->size - 1)], node);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    store_relaxed(&deque->bottom, bottom + 1);
+}
+
+static inline ACTOR_NODE *deque_pop(ACTOR_DEQUE *deque) {
+    int64_t bottom = load_relaxed(&deque->bottom) - 1, top = 0;
+    ACTOR_NODE *node = NULL;
+
+    store_relaxed(&deque->bottom, bottom);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    top = load_relaxed(&deque->top);
+
+    if (top <= bottom) {
+        node = load_relaxed(&deque->elems[bottom & (deque->size - 1)]);
+
+        if (top == bottom) {
+            if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                node = NULL;
+
+            store_relaxed(&deque->bottom, bottom + 1);
+        }
+    } else
+        store_relaxed(&deque->bottom, bottom + 1);
+
+    return node;
+}
+
+static inline ACTOR_NODE *deque_steal(ACTOR_DEQUE *deque) {
+    int64_t top = load_acquire(&deque->top), bottom = 0;
+    ACTOR_NODE *node = NULL;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    bottom = load_acquire(&deque->bottom);
+
+    if (top < bottom) {
+        node = load_relaxed(&deque->elems[top & (deque->size - 1)]);
+
+        if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            return NULL;
+    }
+
+    return node;
+}
+
+static inline int64_t deque_size(ACTOR_DEQUE *deque) {
+    int64_t size = load_acquire(&deque->bottom) - load_acquire(&deque->top);
+
+    return size > 0 ? size : 0;
+}
+
+// Reallocate from the owner thread so first touch puts the array on its node, only while nobody can push
+static void deque_local(ACTOR_DEQUE *deque) {
+    ACTOR_NODE * volatile *elems = deque->elems;
+
+    deque->elems = (ACTOR_NODE * volatile *)anmalloc(sizeof(ACTOR_NODE *) * deque->size);
+    memset((void *)deque->elems, 0, sizeof(ACTOR_NODE *) * deque->size);
+
+    anfree((void *)elems);
+}
+
+static void deque_clean(ACTOR_DEQUE *deque) {
+    anfree((void *)deque->elems);
+}
+
+// Actor model section
+static __thread ACTOR_WORKER *actor_current = NULL;
+
+static inline void root_callback(ACTOR_ROOT *root, void *data) { actor_broadcast(root, data); }
+
+// Only issue a wake syscall when some worker has really gone to sleep on its futex word
+static inline void actor_wake(ACTOR_ROOT *root) {
+    size_t i = 0; uint32_t parked = 1;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (load_relaxed(&root->idlecnt) == 0) return;
+
+    for (i = 0; i < root->maxworker; ++i, parked = 1) {
+        ACTOR_WORKER *worker = root->workers + i;
+
+        if (load_relaxed(&worker->parked) && __atomic_compare_exchange_n(&worker->parked, &parked, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            futex_wake(&worker->parked, 1);
+            break;
+        }
+    }
+}
+
+static void actor_grow(ACTOR_ROOT *root, int late);
+
+#define actor_elastic_on(root) ((root)->minworker < (root)->maxworker)
+
+static inline void actor_schedule(ACTOR_ROOT *root, ACTOR_NODE *node) {
+    ACTOR_WORKER *worker = actor_current; int priority = load_relaxed(&node->priority);
+
+    if (worker != NULL && worker->root == root)
+        deque_push(&worker->deque[priority], node);
+    else {
+        store_relaxed(&node->queued, actor_now());
+
+        while (!buffer_write(root->task[priority], node));
+
+        // Nobody idle and the backlog keeps building, more hands are needed
+        if (actor_elastic_on(root) && load_relaxed(&root->idlecnt) == 0 && buffer_size(root->task[priority]) > root->growdepth)
+            actor_grow(root, 0);
+    }
+
+    actor_wake(root);
+}
+
+// Status and generation are checked again under the inbox lock that node_close takes, so a message either
+// lands before the actor is closed and goes down with it, or the sender sees the actor gone. RUNTASK is raised
+// under the same lock, a close never finds the slot idle while a sender is still about to queue it
+static inline int post_mail(ACTOR_ROOT *root, ACTOR_NODE *node, uint32_t generation, void *data, int mark, uint64_t size) {
+    MAILBOX *inbox = node->inbox; uint64_t old = load_acquire(&node->status); int ret = 0;
+
+    if (!(old & ACTOR_DEFAULT && old & ACTOR_RUNNABLE)) return 0;
+
+    pthread_spin_lock(&inbox->lock);
+
+    old = load_acquire(&node->status);
+
+    if (old & ACTOR_DEFAULT && old & ACTOR_RUNNABLE && load_relaxed(&node->generation) == generation && mailbox_push(inbox, data, mark, size)) {
+        old = __sync_fetch_and_or(&node->status, ACTOR_RUNTASK);
+        ret = 1;
+    }
+
+    pthread_spin_unlock(&inbox->lock);
+
+    if (ret && !(old & ACTOR_RUNTASK)) actor_schedule(root, node);
+
+    return ret;
+}
+
+// Senders only pay for the counter when the inbox turns them away, once per give up rather than per retry
+static inline int send_drop(ACTOR_NODE *node) {
+    __atomic_add_fetch(&node->dropped, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+static inline int send_marked(ACTOR_ROOT *root, ACTOR_NODE *node, uint32_t generation, void *data, int mark) {
+    if (post_mail(root, node, generation, data, mark, node->inbox->size)) return 1;
+
+    return node->status & ACTOR_RUNNABLE && load_relaxed(&node->generation) == generation ? send_drop(node) : 0;
+}
+
+// Senders holding a handle pass its generation, a raw node pointer stands for whatever actor holds the slot now
+#define handle_generation(handle) ((uint32_t)((handle) >> 32))
+#define send_mail(root, node, data) send_marked(root, node, load_acquire(&(node)->generation), data, 0)
+#define send_handle(root, node, handle, data) send_marked(root, node, handle_generation(handle), data, 0)
+
+// Future section, a fixed pool per root recycled through a tagged free list like the actor slots
+static ACTOR_FUTURE *future_alloc(ACTOR_ROOT *root) {
+    uint64_t head = load_acquire(&root->futurelist), next = 0;
+    uint32_t index = 0;
+
+    do {
+        index = (uint32_t)head;
+
+        if (index == ACTOR_NOSLOT) return NULL;
+
+        next = ((head >> 32) + 1) << 32 | load_relaxed(&root->futures[index].next);
+    } while (!__atomic_compare_exchange_n(&root->futurelist, &head, next, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    return root->futures + index;
+}
+
+static void future_drop(ACTOR_ROOT *root, ACTOR_FUTURE *future) {
+    uint64_t head = load_relaxed(&root->futurelist), next = 0;
+    uint32_t index = (uint32_t)(future - root->futures);
+
+    if (__atomic_sub_fetch(&future->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+
+    do {
+        store_relaxed(&future->next, (uint32_t)head);
+        next = ((head >> 32) + 1) << 32 | index;
+    } while (!__atomic_compare_exchange_n(&root->futurelist, &head, next, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// The one transition out of pending, whoever wins it owns delivering the outcome
+static inline int future_settle(ACTOR_FUTURE *future, uint32_t state) {
+    uint32_t pending = ACTOR_ASKPENDING;
+
+    return __atomic_compare_exchange_n(&future->state, &pending, state, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static void future_deliver(ACTOR_ROOT *root, ACTOR_FUTURE *future) {
+    if (future->cb != NULL) {
+        future->cb(root, future->state == ACTOR_ASKDONE ? future->reply : NULL, future->state, future->ctx);
+        future_drop(root, future);
+    } else if (__atomic_load_n(&future->waiting, __ATOMIC_SEQ_CST))
+        futex_wake(&future->state, 1);
+}
+
+// Timer wheel section, serviced by whichever worker finds it due, parked workers sleep until the next deadline
+static ACTOR_WHEEL *wheel_init(void) {
+    ACTOR_WHEEL *wheel = (ACTOR_WHEEL *)analign(sizeof(ACTOR_WHEEL));
+    size_t i = 0;
+
+    memset(wheel, 0, sizeof(ACTOR_WHEEL));
+    pthread_spin_init(&wheel->lock, PTHREAD_PROCESS_PRIVATE);
+
+    wheel->start = actor_now();
+    wheel->next = UINT64_MAX;
+
+    wheel->timers = (ACTOR_TIMER *)anmalloc(sizeof(ACTOR_TIMER) * ACTOR_MAXTIMER);
+    memset(wheel->timers, 0, sizeof(ACTOR_TIMER) * ACTOR_MAXTIMER);
+
+    for (i = 0; i < ACTOR_MAXTIMER; ++i) {
+        wheel->timers[i].generation = 1;
+        wheel->timers[i].next = i + 1 < ACTOR_MAXTIMER ? wheel->timers + i + 1 : NULL;
+    }
+
+    wheel->free = wheel->timers;
+
+    return wheel;
+}
+
+static void wheel_clean(ACTOR_WHEEL *wheel) {
+    pthread_spin_destroy(&wheel->lock);
+    anfree(wheel->timers);
+    anfree(wheel);
+}
+
+static void wheel_link(ACTOR_WHEEL *wheel, ACTOR_TIMER *timer) {
+    uint64_t delta = timer->expire - wheel->current, expire = timer->expire;
+    int level = 0;
+
+    // Anything past the top level waits in its farthest slot and cascades down from there
+    if (delta >= 1ULL << (ACTOR_WHEELBITS * ACTOR_WHEELLEVELS))
+        expire = wheel->current + (1ULL << (ACTOR_WHEELBITS * ACTOR_WHEELLEVELS)) - 1;
+
+    while (level < ACTOR_WHEELLEVELS - 1 && delta >= 1ULL << (ACTOR_WHEELBITS * (level + 1))) ++level;
+
+    timer->level = level;
+    timer->slot = (expire >> (ACTOR_WHEELBITS * level)) & (ACTOR_WHEELSIZE - 1);
+
+    ACTOR_TIMER **head = &wheel->slots[level][timer->slot];
+
+    if ((timer->next = *head) != NULL) timer->next->pprev = &timer->next;
+    timer->pprev = head;
+    *head = timer;
+
+    wheel->bitmap[level] |= 1ULL << timer->slot;
+}
+
+static void wheel_unlink(ACTOR_WHEEL *wheel, ACTOR_TIMER *timer) {
+    if ((*timer->pprev = timer->next) != NULL) timer->next->pprev = timer->pprev;
+
+    if (wheel->slots[timer->level][timer->slot] == NULL)
+        wheel->bitmap[timer->level] &= ~(1ULL << timer->slot);
+
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+static void wheel_release(ACTOR_WHEEL *wheel, ACTOR_TIMER *timer) {
+    if (++timer->generation == 0) timer->generation = 1;
+
+    timer->next = wheel->free;
+    wheel->free = timer;
+    --wheel->count;
+}
+
+// Exact within the lowest level, otherwise wake up when the lowest level wraps and cascades
+static void wheel_schedule(ACTOR_WHEEL *wheel) {
+    uint64_t index = wheel->current & (ACTOR_WHEELSIZE - 1), mask = 0, tick = 0;
+
+    if (wheel->count == 0) {
+        store_relaxed(&wheel->next, UINT64_MAX);
+        return;
+    }
+
+    mask = index + 1 < ACTOR_WHEELSIZE ? wheel->bitmap[0] & ~((2ULL << index) - 1) : 0;
+
+    if (mask)
+        tick = (wheel->current & ~(uint64_t)(ACTOR_WHEELSIZE - 1)) + __builtin_ctzll(mask);
+    else
+        tick = (wheel->current | (ACTOR_WHEELSIZE - 1)) + 1;
+
+    store_release(&wheel->next, wheel->start + tick * ACTOR_TICK);
+}
+
+static void wheel_cascade(ACTOR_WHEEL *wheel, int level) {
+    uint64_t slot = (wheel->current >> (ACTOR_WHEELBITS * level)) & (ACTOR_WHEELSIZE - 1);
+    ACTOR_TIMER *timer = wheel->slots[level][slot], *next = NULL;
+
+    wheel->slots[level][slot] = NULL;
+    wheel->bitmap[level] &= ~(1ULL << slot);
+
+    for (; timer != NULL; timer = next) {
+        next = timer->next;
+        wheel_link(wheel, timer);
+    }
+}
+
+// A timer without target expires a future, settled here under the lock so a replier's cancel is exact,
+// delivered by the caller once the lock is dropped
+static inline void wheel_repeat(ACTOR_WHEEL *wheel, ACTOR_TIMER *timer) {
+    timer->expire += timer->period;
+    if (timer->expire <= wheel->current) timer->expire = wheel->current + timer->period;
+    wheel_link(wheel, timer);
+}
+
+static void wheel_fire(ACTOR_ROOT *root, ACTOR_WHEEL *wheel, ACTOR_FUTURE **expired) {
+    uint64_t slot = wheel->current & (ACTOR_WHEELSIZE - 1);
+    ACTOR_TIMER *timer = wheel->slots[0][slot], *next = NULL;
+    ACTOR_FUTURE *future = NULL; ACTOR_NODE *node = NULL;
+
+    wheel->slots[0][slot] = NULL;
+    wheel->bitmap[0] &= ~(1ULL << slot);
+
+    for (; timer != NULL; timer = next) {
+        next = timer->next;
+
+        if (timer->target == 0) {
+            if (future_settle(future = (ACTOR_FUTURE *)timer->data, ACTOR_ASKTIMEOUT)) {
+                future->expired = *expired;
+                *expired = future;
+            }
+
+            wheel_release(wheel, timer);
+        } else if ((node = actorh_node(root, timer->target)) == NULL) {
+            wheel_release(wheel, timer);
+        } else if (post_mail(root, node, handle_generation(timer->target), timer->data, 0, node->inbox->size)) {
+            if (timer->period) wheel_repeat(wheel, timer);
+            else wheel_release(wheel, timer);
+        } else if (timer->period) {
+            // A stopped or full target only misses this round, counted once per period rather than per tick
+            if (load_acquire(&node->status) & ACTOR_RUNNABLE) send_drop(node);
+            wheel_repeat(wheel, timer);
+        } else if (load_acquire(&node->status) & ACTOR_RUNNABLE) {
+            // Full mailbox, try again on the next tick rather than losing a one shot timer
+            timer->expire = wheel->current + 1;
+            wheel_link(wheel, timer);
+        } else
+            wheel_release(wheel, timer);
+    }
+}
+
+static void wheel_run(ACTOR_ROOT *root) {
+    ACTOR_WHEEL *wheel = root->wheel; int level = 0;
+    ACTOR_FUTURE *expired = NULL, *future = NULL;
+    uint64_t now = 0;
+
+    if (pthread_spin_trylock(&wheel->lock) != 0) return;
+
+    now = (actor_now() - wheel->start) / ACTOR_TICK;
+
+    while (wheel->current < now && wheel->count) {
+        ++wheel->current;
+
+        for (level = 1; level < ACTOR_WHEELLEVELS; ++level) {
+            if (wheel->current & ((1ULL << (ACTOR_WHEELBITS * level)) - 1)) break;
+            wheel_cascade(wheel, level);
+        }
+
+        wheel_fire(root, wheel, &expired);
+    }
+
+    if (wheel->current < now) wheel->current = now;
+
+    wheel_schedule(wheel);
+
+    pthread_spin_unlock(&wheel->lock);
+
+    while ((future = expired) != NULL) {
+        expired = future->expired;
+        future_deliver(root, future);
+    }
+}
+
+static inline int wheel_due(ACTOR_ROOT *root) {
+    return load_relaxed(&root->wheel->count) && actor_now() >= load_acquire(&root->wheel->next);
+}
+
+static ACTOR_TIMERID wheel_add(ACTOR_ROOT *root, ACTOR_HANDLE target, void *data, uint64_t delay, uint64_t period) {
+    ACTOR_WHEEL *wheel = NULL; ACTOR_TIMER *timer = NULL;
+    uint64_t expire = 0, next = 0, now = 0;
+
+    if (root == NULL) return 0;
+
+    wheel = root->wheel;
+
+    pthread_spin_lock(&wheel->lock);
+
+    if ((timer = wheel->free) == NULL) {
+        pthread_spin_unlock(&wheel->lock);
+        return 0;
+    }
+
+    wheel->free = timer->next;
+
+    now = (actor_now() - wheel->start) / ACTOR_TICK;
+    expire = (actor_now() - wheel->start + delay + ACTOR_TICK - 1) / ACTOR_TICK;
+
+    // An empty wheel is not advanced, catch it up instead of stepping through idle ticks later
+    if (wheel->count++ == 0 && wheel->current < now) wheel->current = now;
+
+    timer->expire = expire > wheel->current ? expire : wheel->current + 1;
+    timer->period = period ? (period + ACTOR_TICK - 1) / ACTOR_TICK : 0;
+    timer->target = target;
+    timer->data = data;
+
+    wheel_link(wheel, timer);
+
+    next = load_relaxed(&wheel->next);
+    wheel_schedule(wheel);
+
+    pthread_spin_unlock(&wheel->lock);
+
+    // A parked worker may be sleeping toward a later deadline
+    if (load_relaxed(&wheel->next) < next) actor_wake(root);
+
+    return (ACTOR_TIMERID)timer->generation << 32 | (uint64_t)(timer - wheel->timers);
+}
+
+ACTOR_TIMERID actor_send_after(ACTOR_ROOT *root, ACTOR_HANDLE target, void *data, uint64_t delay) {
+    if (actorh_node(root, target) == NULL) return 0;
+
+    return wheel_add(root, target, data, delay, 0);
+}
+
+ACTOR_TIMERID actor_send_every(ACTOR_ROOT *root, ACTOR_HANDLE target, void *data, uint64_t period) {
+    if (period == 0 || actorh_node(root, target) == NULL) return 0;
+
+    return wheel_add(root, target, data, period, period);
+}
+
+int actor_cancel(ACTOR_ROOT *root, ACTOR_TIMERID id) {
+    ACTOR_WHEEL *wheel = NULL; ACTOR_TIMER *timer = NULL;
+    uint32_t index = (uint32_t)id; int ret = 0;
+
+    if (root == NULL || index >= ACTOR_MAXTIMER) return 0;
+
+    wheel = root->wheel;
+    timer = wheel->timers + index;
+
+    pthread_spin_lock(&wheel->lock);
+
+    if (timer->generation == (uint32_t)(id >> 32) && timer->pprev != NULL) {
+        wheel_unlink(wheel, timer);
+        wheel_release(wheel, timer);
+        ret = 1;
+    }
+
+    pthread_spin_unlock(&wheel->lock);
+
+    return ret;
+}
+
+// Treiber stack of free slots, the high half of the head is a tag bumped on every change against ABA
+static inline ACTOR_NODE *node_alloc(ACTOR_ROOT *root) {
+    uint64_t head = load_acquire(&root->freelist), next = 0;
+    uint32_t index = 0;
+
+    do {
+        index = (uint32_t)head;
+
+        if (index == ACTOR_NOSLOT) return NULL;
+
+        next = ((head >> 32) + 1) << 32 | load_relaxed(&root->nodes[index].next);
+    } while (!__atomic_compare_exchange_n(&root->freelist, &head, next, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    return root->nodes + index;
+}
+
+static inline void node_free(ACTOR_ROOT *root, ACTOR_NODE *node) {
+    uint64_t head = load_relaxed(&root->freelist), next = 0;
+    uint32_t index = (uint32_t)(node - root->nodes);
+
+    node->dropped = node->processed = node->cputime = 0;
+    node->priority = ACTOR_PRIONORMAL;
+
+    // Bump the generation first so every outstanding handle to this slot goes stale
+    if (++node->generation == 0) node->generation = 1;
+
+    do {
+        store_relaxed(&node->next, (uint32_t)head);
+        next = ((head >> 32) + 1) << 32 | index;
+    } while (!__atomic_compare_exchange_n(&root->freelist, &head, next, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Only an actor that is stopped and not queued closes, under its inbox lock so no post_mail is halfway through.
+// A retiring replica closes from its own dispatch with RUNTASK still set, it only has to have run dry
+static int node_close(ACTOR_NODE *node, int retiring) {
+    MAILBOX *inbox = node->inbox; uint64_t status = 0; int closed = 0;
+
+    if (inbox == NULL) return 0;
+
+    pthread_spin_lock(&inbox->lock);
+
+    status = load_acquire(&node->status);
+
+    if (retiring ? status & ACTOR_RETIRING && inbox->write == load_acquire(&inbox->read) : status == ACTOR_DEFAULT) {
+        sync_value(uint64_t, node->status, 0);
+        closed = 1;
+    }
+
+    pthread_spin_unlock(&inbox->lock);
+
+    return closed;
+}
+
+static inline int node_valid(ACTOR_ROOT *root, ACTOR_NODE *node) {
+    if (node < root->nodes || node >= root->nodes + root->maxnode) return 0;
+
+    return ((char *)node - (char *)root->nodes) % sizeof(ACTOR_NODE) == 0;
+}
+
+ACTOR_ROOT *actor_init(const char *name, size_t maxnode, size_t maxworker, size_t maxinbox) {
+    if (name == NULL || maxnode == 0 || maxworker == 0 || maxinbox == 0) return NULL;
+
+    if (maxnode >= ACTOR_NOSLOT) return NULL;
+
+    size_t i = 0; int j = 0;
+
+    ACTOR_ROOT *root = (ACTOR_ROOT *)anmalloc(sizeof(ACTOR_ROOT));
+    memset(root, 0 , sizeof(ACTOR_ROOT));
+
+    root->nodestable = hash_init(maxnode + 1);
+    if (hash_table(root->nodestable, name, root, HTABLE_CREATE) == NULL) {
+        hash_clean(root->nodestable);
+        anfree(root);
+        return NULL;
+    }
+
+    root->topicstable = hash_init(16);
+    root->topics = NULL;
+    root->poolstable = hash_init(16);
+    root->pools = NULL;
+
+    root->status = ACTOR_DEFAULT | ACTOR_RUNNABLE;
+    root->cb = root_callback;
+    root->pool = mailbox_pool(maxnode * 2);
+    root->inbox = mailbox_init(root->pool, maxinbox);
+
+    root->breakout = 0;
+
+    root->nodes = (ACTOR_NODE *)anmalloc(sizeof(ACTOR_NODE) * maxnode);
+    memset(root->nodes, 0, sizeof(ACTOR_NODE) * maxnode);
+
+    for (i = 0; i < maxnode; ++i) {
+        root->nodes[i].generation = 1;
+        root->nodes[i].priority = ACTOR_PRIONORMAL;
+        root->nodes[i].next = i + 1 < maxnode ? (uint32_t)(i + 1) : ACTOR_NOSLOT;
+    }
+
+    root->freelist = 0;
+
+    root->maxnode = maxnode;
+    root->maxworker = maxworker;
+    root->maxinbox = maxinbox;
+    root->budget = ACTOR_BUDGET;
+    root->wheel = wheel_init();
+
+    root->futures = (ACTOR_FUTURE *)analign(sizeof(ACTOR_FUTURE) * ACTOR_MAXFUTURE);
+    memset(root->futures, 0, sizeof(ACTOR_FUTURE) * ACTOR_MAXFUTURE);
+
+    for (i = 0; i < ACTOR_MAXFUTURE; ++i)
+        root->futures[i].next = i + 1 < ACTOR_MAXFUTURE ? (uint32_t)(i + 1) : ACTOR_NOSLOT;
+
+    root->futurelist = 0;
+    root->weights[ACTOR_PRIOHIGH] = ACTOR_WEIGHTHIGH;
+    root->weights[ACTOR_PRIONORMAL] = ACTOR_WEIGHTNORMAL;
+    root->weights[ACTOR_PRIOLOW] = ACTOR_WEIGHTLOW;
+
+    for (j = 0; j < ACTOR_PRIOCLASSES; ++j)
+        root->task[j] = buffer_init(maxnode + 1);
+
+    root->workers = (ACTOR_WORKER *)analign(sizeof(ACTOR_WORKER) * maxworker);
+    memset(root->workers, 0, sizeof(ACTOR_WORKER) * maxworker);
+
+    for (i = 0; i < maxworker; ++i) {
+        for (j = 0; j < ACTOR_PRIOCLASSES; ++j) {
+            deque_init(&root->workers[i].deque[j], maxnode + 1);
+            root->workers[i].credits[j] = root->weights[j];
+        }
+
+        root->workers[i].root = root;
+        root->workers[i].index = i;
+        root->workers[i].seed = i * 0x9E3779B97F4A7C15ULL + 1;
+        root->workers[i].cpu = -1;
+        root->workers[i].numa = 0;
+        root->workers[i].state = ACTORW_STOPPED;
+    }
+
+    root->running = 0;
+    root->idlecnt = 0;
+
+    root->minworker = maxworker;
+    root->workercnt = 0;
+    root->growdepth = ACTOR_GROWDEPTH;
+    root->growlatency = ACTOR_GROWLATENCY;
+    root->cooldown = ACTOR_COOLDOWN;
+    pthread_spin_init(&root->scalelock, PTHREAD_PROCESS_PRIVATE);
+
+    return root;
+}
+
+int actor_cpunode(int cpu) {
+#ifdef __linux__
+    char path[64]; int node = 0;
+
+    // Every cpu directory links the node it belongs to, no libnuma needed for that
+    for (node = 0; node < 64 && cpu >= 0; ++node) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+        if (access(path, F_OK) == 0) return node;
+    }
+#endif
+
+    return 0;
+}
+
+int actor_affinity(ACTOR_ROOT *root, const int *cpus, size_t count) {
+    size_t i = 0;
+
+    if (root == NULL || cpus == NULL || count == 0 || root->running) return 0;
+
+#ifdef __linux__
+    for (i = 0; i < count; ++i)
+        if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE) return 0;
+
+    for (i = 0; i < root->maxworker; ++i) {
+        root->workers[i].cpu = cpus[i % count];
+        root->workers[i].numa = actor_cpunode(root->workers[i].cpu);
+    }
+
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+static inline int worker_pending(ACTOR_ROOT *root) {
+    size_t i = 0; int priority = 0;
+
+    for (priority = 0; priority < ACTOR_PRIOCLASSES; ++priority) {
+        if (buffer_size(root->task[priority])) return 1;
+
+        for (i = 0; i < root->maxworker; ++i)
+            if (deque_size(&root->workers[i].deque[priority])) return 1;
+    }
+
+    return 0;
+}
+
+// Own deque first, then the shared queue of the class
+static inline ACTOR_NODE *worker_take(ACTOR_WORKER *worker, int priority) {
+    ACTOR_ROOT *root = worker->root; ACTOR_NODE *node = deque_pop(&worker->deque[priority]);
+    void *data = NULL;
+
+    if (node == NULL && buffer_read(root->task[priority], &data)) {
+        uint64_t wait = actor_now() - load_relaxed(&(node = (ACTOR_NODE *)data)->queued);
+
+        store_relaxed(&worker->waits, worker->waits + 1);
+        store_relaxed(&worker->waittime, worker->waittime + wait);
+
+        if (actor_elastic_on(root) && load_relaxed(&root->idlecnt) == 0 && wait > root->growlatency)
+            actor_grow(root, 1);
+    }
+
+    return node;
+}
+
+// Weighted round robin, a class that spent its credits waits until no class with work has any left
+static inline ACTOR_NODE *worker_next(ACTOR_WORKER *worker) {
+    ACTOR_NODE *node = NULL; int priority = 0, round = 0;
+
+    for (round = 0; round < 2; ++round) {
+        for (priority = 0; priority < ACTOR_PRIOCLASSES; ++priority) {
+            if (worker->credits[priority] == 0 || (node = worker_take(worker, priority)) == NULL) continue;
+
+            --worker->credits[priority];
+
+            return node;
+        }
+
+        for (priority = 0; priority < ACTOR_PRIOCLASSES; ++priority)
+            worker->credits[priority] = load_relaxed(&worker->root->weights[priority]);
+    }
+
+    return NULL;
+}
+
+static inline ACTOR_NODE *worker_steal(ACTOR_WORKER *worker, int priority) {
+    ACTOR_ROOT *root = worker->root; ACTOR_NODE *node = NULL;
+    size_t i = 0, victim = 0, start = 0; int remote = 0;
+
+    worker->seed ^= worker->seed << 13;
+    worker->seed ^= worker->seed >> 7;
+    worker->seed ^= worker->seed << 17;
+
+    start = worker->seed % root->maxworker;
+
+    // Victims on the same node first, crossing the interconnect only when the whole node is dry
+    for (remote = 0; remote < 2; ++remote) {
+        for (i = 0, victim = start; i < root->maxworker; ++i, victim = (victim + 1) % root->maxworker) {
+            if (victim == worker->index || (root->workers[victim].numa != worker->numa) != remote) continue;
+
+            if ((node = deque_steal(&root->workers[victim].deque[priority])) != NULL)
+                return node;
+        }
+    }
+
+    return NULL;
+}
+
+// Returns 1 when the worker should retire, it stayed idle for the whole cooldown with the pool above minworker
+static inline int worker_park(ACTOR_WORKER *worker) {
+    ACTOR_ROOT *root = worker->root; uint32_t parked = 1; int retire = 0;
+    uint64_t retireat = actor_elastic_on(root) ? actor_now() + root->cooldown : UINT64_MAX;
+
+    store_relaxed(&worker->parks, worker->parks + 1);
+
+    __atomic_store_n(&worker->parked, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&root->idlecnt, 1, __ATOMIC_SEQ_CST);
+
+    // Recheck after publishing the parked state, a sender either sees it or we see its task
+    while (!load_acquire(&root->breakout) && !worker_pending(root) && load_acquire(&worker->parked)) {
+        uint64_t next = load_acquire(&root->wheel->next), now = 0;
+
+        if (next > retireat) next = retireat;
+
+        if (next == UINT64_MAX) {
+            futex_wait(&worker->parked, 1);
+            continue;
+        }
+
+        if ((now = actor_now()) >= next) break;
+
+        struct timespec ts = {(next - now) / 1000000000ULL, (next - now) % 1000000000ULL};
+        futex_waitfor(&worker->parked, 1, &ts);
+    }
+
+    if (!load_acquire(&worker->parked)) store_relaxed(&worker->unparks, worker->unparks + 1);
+
+    // Only retire if no waker picked this worker, a consumed wake would otherwise be lost with it
+    if (retireat != UINT64_MAX && actor_now() >= retireat && !load_acquire(&root->breakout) && !worker_pending(root) &&
+        __atomic_compare_exchange_n(&worker->parked, &parked, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        size_t count = load_relaxed(&root->workercnt);
+
+        while (count > root->minworker && !(retire = __atomic_compare_exchange_n(&root->workercnt, &count, count - 1, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)));
+    }
+
+    __atomic_store_n(&worker->parked, 0, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&root->idlecnt, 1, __ATOMIC_SEQ_CST);
+
+    if (retire) __atomic_add_fetch(&root->retires, 1, __ATOMIC_RELAXED);
+
+    return retire;
+}
+
+static inline void envelope_release(ACTOR_ENVELOPE *envelope) {
+    if (__atomic_sub_fetch(&envelope->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+
+    if (envelope->release != NULL) envelope->release(envelope->data);
+
+    message_free((MESSAGE *)((char *)envelope - offsetof(MESSAGE, payload)));
+}
+
+// Unwrap shared envelopes so callbacks only ever see the payload, the envelope is returned for release
+static inline void *envelope_open(void *data, int mark, ACTOR_ENVELOPE **envelope) {
+    if (!mark) {
+        *envelope = NULL;
+        return data;
+    }
+
+    *envelope = (ACTOR_ENVELOPE *)data;
+
+    return (*envelope)->data;
+}
+
+// Throw away pending mail of a deleted actor, shared envelopes and asks still have to drop their reference
+// Hand undelivered messages back to the actors that were told to wait for room, a message
+// that cannot go back, or is dropped along with its target, goes to the release hook instead
+static void node_notify(ACTOR_ROOT *root, ACTOR_NODE *node, int deliver) {
+    MAILBOX_NOTIFY *notify = mailbox_notified(node->inbox), *next = NULL;
+    ACTOR_RELEASE release = load_relaxed(&root->release); ACTOR_NODE *waiter = NULL;
+
+    for (next = notify; next != NULL; next = next->next) {
+        waiter = deliver ? actorh_node(root, next->waiter) : NULL;
+
+        // Allowed past the depth limit, there is at most one pending notification per blocked send
+        if ((waiter == NULL || !post_mail(root, waiter, handle_generation(next->waiter), next->token, 0, UINT64_MAX)) && release != NULL)
+            release(next->token);
+    }
+
+    mailbox_unnotify(node->inbox, notify);
+}
+
+static void node_drop(ACTOR_ROOT *root, ACTOR_NODE *node) {
+    ACTOR_FUTURE *future = NULL; void *data = NULL; int mark = 0;
+
+    while (mailbox_take(node->inbox, &data, &mark)) {
+        if (mark) {
+            envelope_release((ACTOR_ENVELOPE *)data);
+            continue;
+        }
+
+        // An ask nobody will answer fails right here, otherwise its slot in the fixed pool is gone for good
+        if ((future = (ACTOR_FUTURE *)data) >= root->futures && future < root->futures + ACTOR_MAXFUTURE) {
+            if (future_settle(future, ACTOR_ASKFAILED)) {
+                if (future->timer) actor_cancel(root, future->timer);
+                future_deliver(root, future);
+            }
+
+            future_drop(root, future);
+        }
+    }
+
+    node_notify(root, node, 0);
+    mailbox_reset(node->inbox);
+}
+
+// After node_close no sender gets in any more, what is still queued is dropped and the slot goes back
+static void node_remove(ACTOR_ROOT *root, ACTOR_NODE *node) {
+    sync_value(ACTOR_CB, node->cb, NULL);
+    sync_value(ACTOR_BATCH_CB, node->batch, NULL);
+    node_drop(root, node);
+    node_free(root, node);
+}
+
+// Run at most one budget of messages, a busy actor goes to the back of the shared queue afterwards
+static inline void worker_dispatch(ACTOR_WORKER *worker, ACTOR_NODE *node) {
+    ACTOR_ROOT *root = worker->root; MAILBOX *inbox = node->inbox; ACTOR_BATCH_CB batch = node->batch;
+    uint64_t status = node->status; size_t budget = root->budget, count = 0, i = 0;
+    void *data = NULL, *messages[ACTOR_MAXBUDGET]; int mark = 0;
+    ACTOR_ENVELOPE *envelope = NULL, *envelopes[ACTOR_MAXBUDGET];
+    uint64_t start = actor_now();
+
+    worker->running = node;
+
+    if (status & ACTOR_RUNNABLE && status & ACTOR_RUNTASK) {
+        if (batch != NULL) {
+            for (; count < budget && mailbox_take(inbox, &data, &mark); ++count)
+                messages[count] = envelope_open(data, mark, envelopes + count);
+
+            if (count) batch(root, messages, count);
+
+            for (i = 0; i < count; ++i)
+                if (envelopes[i] != NULL) envelope_release(envelopes[i]);
+
+            if (load_relaxed(&inbox->notify) != NULL && mailbox_size(inbox) <= inbox->size / 2)
+                node_notify(root, node, 1);
+        } else {
+            for (; count < budget && mailbox_take(inbox, &data, &mark); ++count) {
+                data = envelope_open(data, mark, &envelope);
+
+                if (node->cb != NULL) node->cb(root, data);
+
+                if (envelope != NULL) envelope_release(envelope);
+
+                if (load_relaxed(&inbox->notify) != NULL && mailbox_size(inbox) <= inbox->size / 2)
+                    node_notify(root, node, 1);
+            }
+        }
+    }
+
+    // One clock read per dispatch, not per message
+    store_relaxed(&node->processed, node->processed + count);
+    store_relaxed(&node->cputime, node->cputime + actor_now() - start);
+    store_relaxed(&worker->dispatches, worker->dispatches + 1);
+
+    worker->running = NULL;
+
+    message_flush();
+
+    if (count == budget && mailbox_size(inbox) && node->status & ACTOR_RUNNABLE) {
+        store_relaxed(&node->queued, actor_now());
+        while (!buffer_write(root->task[load_relaxed(&node->priority)], node)) cpu_pause();
+        actor_wake(root);
+        return;
+    }
+
+    // A replica cut from its pool deletes itself once it has run dry, a message that got in first keeps it alive
+    if (node->status & ACTOR_RETIRING && node_close(node, 1)) {
+        node_remove(root, node);
+        return;
+    }
+
+    __sync_fetch_and_and(&node->status, ~(uint64_t)ACTOR_RUNTASK);
+
+    // A message may have arrived after the inbox was drained but before the flag was cleared,
+    // or the replica was retired while this dispatch ran
+    if ((mailbox_size(node->inbox) || node->status & ACTOR_RETIRING) && node->status & ACTOR_RUNNABLE)
+        if (!(__sync_fetch_and_or(&node->status, ACTOR_RUNTASK) & ACTOR_RUNTASK))
+            actor_schedule(root, node);
+}
+
+static void *thread_worker(void *data) {
+    ACTOR_WORKER *worker = (ACTOR_WORKER *)data;
+    ACTOR_ROOT *root = worker->root; ACTOR_NODE *node = NULL;
+    size_t spin = 0; int priority = 0;
+
+    actor_current = worker;
+
+    for (priority = 0; priority < ACTOR_PRIOCLASSES; ++priority)
+        if (worker->cpu >= 0 && deque_size(&worker->deque[priority]) == 0)
+            deque_local(&worker->deque[priority]);
+
+    while (!root->breakout) {
+        if (wheel_due(root)) wheel_run(root);
+
+        node = worker_next(worker);
+
+        // Thieves only come by when everything local and shared is dry, so they simply go top class first
+        for (priority = 0; node == NULL && priority < ACTOR_PRIOCLASSES; ++priority)
+            if ((node = worker_steal(worker, priority)) != NULL)
+                store_relaxed(&worker->steals, worker->steals + 1);
+
+        if (node == NULL) {
+            if (++spin < ACTOR_MAXSPIN)
+                cpu_pause();
+            else if (worker_park(worker)) {
+                // The slot is joined and reused by the next grow, or by actor_wait
+                store_release(&worker->state, ACTORW_RETIRED);
+                break;
+            } else
+                spin = 0;
+
+            continue;
+        }
+
+        spin = 0;
+        worker_dispatch(worker, node);
+    }
+
+    message_detach();
+    actor_current = NULL;
+
+    pthread_exit(NULL);
+}
+
+static int worker_start(ACTOR_WORKER *worker) {
+    pthread_attr_t attr; int ret = 1;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+#ifdef __linux__
+    // Pinned from the start so stack, thread locals and message slabs are first touched on the right node
+    if (worker->cpu >= 0) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(worker->cpu, &set);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &set);
+    }
+#endif
+
+    worker->state = ACTORW_RUNNING;
+
+    if (pthread_create(&worker->thread, &attr, thread_worker, worker) != 0) {
+        worker->thread = 0;
+        worker->state = ACTORW_STOPPED;
+        ret = 0;
+    }
+
+    pthread_attr_destroy(&attr);
+
+    return ret;
+}
+
+// At most one grow per ACTOR_SCALEGAP, so a burst does not spawn the whole pool at once
+static void actor_grow(ACTOR_ROOT *root, int late) {
+    uint64_t now = actor_now(), last = load_relaxed(&root->lastscale);
+    size_t i = 0;
+
+    if (load_relaxed(&root->workercnt) >= root->maxworker || load_relaxed(&root->breakout)) return;
+
+    if (now - last < ACTOR_SCALEGAP || !__atomic_compare_exchange_n(&root->lastscale, &last, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return;
+
+    if (pthread_spin_trylock(&root->scalelock) != 0) return;
+
+    for (i = 0; i < root->maxworker && load_relaxed(&root->workercnt) < root->maxworker; ++i) {
+        ACTOR_WORKER *worker = root->workers + i;
+
+        if (load_acquire(&worker->state) == ACTORW_RUNNING) continue;
+
+        if (worker->state == ACTORW_RETIRED) {
+            pthread_join(worker->thread, NULL);
+            worker->thread = 0;
+            worker->state = ACTORW_STOPPED;
+        }
+
+        if (worker_start(worker)) {
+            __atomic_add_fetch(&root->workercnt, 1, __ATOMIC_SEQ_CST);
+            __atomic_add_fetch(late ? &root->lategrows : &root->deepgrows, 1, __ATOMIC_RELAXED);
+        }
+
+        break;
+    }
+
+    pthread_spin_unlock(&root->scalelock);
+}
+
+void actor_run(ACTOR_ROOT *root) {
+    size_t i = 0; if (root == NULL) return;
+
+    if (root->running) return;
+
+    root->breakout = 0;
+    root->running = 1;
+
+    for (i = 0; i < root->minworker; ++i) {
+        if (!worker_start(root->workers + i)) {
+            root->breakout = 1;
+            break;
+        }
+
+        __atomic_add_fetch(&root->workercnt, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+int actor_elastic(ACTOR_ROOT *root, size_t minworker, size_t depth, uint64_t latency, uint64_t cooldown) {
+    if (root == NULL || root->running || minworker == 0 || minworker > root->maxworker) return 0;
+
+    root->minworker = minworker;
+    root->growdepth = depth ? depth : ACTOR_GROWDEPTH;
+    root->growlatency = latency ? latency : ACTOR_GROWLATENCY;
+    root->cooldown = cooldown ? cooldown : ACTOR_COOLDOWN;
+
+    return 1;
+}
+
+void actor_stats(ACTOR_ROOT *root, ACTOR_STATS *stats) {
+    size_t i = 0;
+
+    if (root == NULL || stats == NULL) return;
+
+    memset(stats, 0, sizeof(ACTOR_STATS));
+
+    for (i = 0; i < ACTOR_PRIOCLASSES; ++i) {
+        stats->classdepth[i] = buffer_size(root->task[i]);
+        stats->taskdepth += stats->classdepth[i];
+    }
+
+    for (i = 0; i < root->maxworker; ++i) {
+        ACTOR_WORKER *worker = root->workers + i;
+
+        stats->dispatches += load_relaxed(&worker->dispatches);
+        stats->steals += load_relaxed(&worker->steals);
+        stats->parks += load_relaxed(&worker->parks);
+        stats->unparks += load_relaxed(&worker->unparks);
+        stats->waits += load_relaxed(&worker->waits);
+        stats->waittime += load_relaxed(&worker->waittime);
+    }
+}
+
+// Insertion into a short sorted array, count is expected to be a handful
+size_t actor_top(ACTOR_ROOT *root, ACTOR_STAT *top, size_t count) {
+    size_t i = 0, j = 0, filled = 0;
+
+    if (root == NULL || top == NULL || count == 0) return 0;
+
+    for (i = 0; i < root->maxnode; ++i) {
+        ACTOR_NODE *node = root->nodes + i; ACTOR_STAT stat;
+
+        if (!(load_relaxed(&node->status) & ACTOR_DEFAULT) || node->inbox == NULL) continue;
+
+        stat.handle = actorh_handle(root, node);
+        stat.depth = mailbox_size(node->inbox);
+        stat.dropped = load_relaxed(&node->dropped);
+        stat.processed = load_relaxed(&node->processed);
+        stat.cputime = load_relaxed(&node->cputime);
+        stat.received = stat.processed + stat.depth;
+
+        if (filled == count && stat.depth <= top[count - 1].depth) continue;
+
+        for (j = filled < count ? filled++ : count - 1; j > 0 && top[j - 1].depth < stat.depth; --j)
+            top[j] = top[j - 1];
+
+        top[j] = stat;
+    }
+
+    return filled;
+}
+
+void actor_scaling(ACTOR_ROOT *root, ACTOR_SCALING *scaling) {
+    if (root == NULL || scaling == NULL) return;
+
+    scaling->workers = load_relaxed(&root->workercnt);
+    scaling->minworker = root->minworker;
+    scaling->maxworker = root->maxworker;
+    scaling->deepgrows = load_relaxed(&root->deepgrows);
+    scaling->lategrows = load_relaxed(&root->lategrows);
+    scaling->retires = load_relaxed(&root->retires);
+}
+
+// A worker about to block hands its queued actors to the others, one of them may be the one it waits on
+static void worker_share(ACTOR_WORKER *worker) {
+    ACTOR_NODE *node = NULL; int shared = 0, priority = 0;
+
+    for (priority = 0; priority < ACTOR_PRIOCLASSES; ++priority) {
+        while ((node = deque_pop(&worker->deque[priority])) != NULL) {
+            while (!buffer_write(worker->root->task[priority], node)) cpu_pause();
+            shared = 1;
+        }
+    }
+
+    if (shared) actor_wake(worker->root);
+}
+
+static int send_wait(ACTOR_ROOT *root, ACTOR_NODE *node, uint32_t generation, void *data, int mode, uint64_t timeout) {
+    uint64_t deadline = mode == ACTOR_SENDTIMED ? actor_now() + timeout : 0, now = 0;
+    ACTOR_WORKER *worker = actor_current;
+
+    while (!post_mail(root, node, generation, data, 0, node->inbox->size)) {
+        if (!(node->status & ACTOR_DEFAULT && node->status & ACTOR_RUNNABLE) || load_acquire(&node->generation) != generation) return 0;
+
+        if (mode == ACTOR_SENDNOTIFY) {
+            if (worker == NULL || worker->root != root || worker->running == NULL) return send_drop(node);
+
+            if (mailbox_notify(node->inbox, actorh_handle(root, worker->running), data)) return -1;
+
+            continue;
+        } else if (mode == ACTOR_SENDBLOCK || mode == ACTOR_SENDTIMED) {
+            if (worker != NULL && worker->root == root) worker_share(worker);
+
+            if (mode == ACTOR_SENDTIMED && (now = actor_now()) >= deadline) return send_drop(node);
+
+            if (!mailbox_wait(node->inbox, mode == ACTOR_SENDTIMED ? deadline - now : 0)) return send_drop(node);
+        } else
+            return send_drop(node);
+    }
+
+    return 1;
+}
+
+ACTOR_FUTURE *actor_ask(ACTOR_ROOT *root, ACTOR_HANDLE target, void *request, uint64_t timeout, ACTOR_REPLY cb, void *ctx) {
+    ACTOR_NODE *node = actorh_node(root, target); ACTOR_FUTURE *future = NULL;
+
+    if (node == NULL || (future = future_alloc(root)) == NULL) return NULL;
+
+    future->state = ACTOR_ASKPENDING;
+    future->waiting = 0;
+    future->refs = 2;
+    future->request = request;
+    future->reply = NULL;
+    future->cb = cb;
+    future->ctx = ctx;
+    future->deadline = timeout ? actor_now() + timeout : 0;
+    future->timer = 0;
+    future->expired = NULL;
+
+    // Armed before the send so a reply always finds the timer to cancel
+    if (cb != NULL && timeout)
+        future->timer = wheel_add(root, 0, future, timeout, 0);
+
+    if (!send_handle(root, node, target, future)) {
+        // Withdrawn before anyone saw it, so both references go here and the cb never runs,
+        // unless a timeout shorter than the send already delivered
+        if (future_settle(future, ACTOR_ASKFAILED)) {
+            if (future->timer) actor_cancel(root, future->timer);
+            future_drop(root, future);
+        }
+
+        future_drop(root, future);
+
+        return NULL;
+    }
+
+    return future;
+}
+
+int actor_reply(ACTOR_ROOT *root, ACTOR_FUTURE *future, void *reply) {
+    int ret = 0;
+
+    if (root == NULL || future == NULL) return 0;
+
+    future->reply = reply;
+
+    if ((ret = future_settle(future, ACTOR_ASKDONE))) {
+        if (future->timer) actor_cancel(root, future->timer);
+        future_deliver(root, future);
+    }
+
+    future_drop(root, future);
+
+    return ret;
+}
+
+int actor_get(ACTOR_ROOT *root, ACTOR_FUTURE *future, void **reply) {
+    ACTOR_WORKER *worker = actor_current; uint64_t now = 0;
+    int state = ACTOR_ASKPENDING;
+
+    if (root == NULL || future == NULL || future->cb != NULL) return ACTOR_ASKFAILED;
+
+    // A worker blocking here first hands its queued actors away, the replier may be among them
+    if (worker != NULL && worker->root == root) worker_share(worker);
+
+    while ((state = load_acquire(&future->state)) == ACTOR_ASKPENDING) {
+        if (future->deadline && (now = actor_now()) >= future->deadline) {
+            if (future_settle(future, ACTOR_ASKTIMEOUT)) state = ACTOR_ASKTIMEOUT;
+            continue;
+        }
+
+        __atomic_store_n(&future->waiting, 1, __ATOMIC_SEQ_CST);
+
+        if (load_acquire(&future->state) != ACTOR_ASKPENDING) continue;
+
+        if (future->deadline) {
+            struct timespec ts = {(future->deadline - now) / 1000000000ULL, (future->deadline - now) % 1000000000ULL};
+            futex_waitfor(&future->state, ACTOR_ASKPENDING, &ts);
+        } else
+            futex_wait(&future->state, ACTOR_ASKPENDING);
+    }
+
+    if (state == ACTOR_ASKDONE && reply != NULL) *reply = future->reply;
+
+    future_drop(root, future);
+
+    return state;
+}
+
+void actor_budget(ACTOR_ROOT *root, size_t budget) {
+    if (root == NULL) return;
+
+    root->budget = budget == 0 ? 1 : budget > ACTOR_MAXBUDGET ? ACTOR_MAXBUDGET : budget;
+}
+
+void actor_release(ACTOR_ROOT *root, ACTOR_RELEASE release) {
+    if (root == NULL) return;
+
+    store_relaxed(&root->release, release);
+}
+
+// A zero weight would starve its class for good, so every class keeps at least one dispatch per round
+int actor_weights(ACTOR_ROOT *root, uint32_t high, uint32_t normal, uint32_t low) {
+    if (root == NULL) return 0;
+
+    store_relaxed(&root->weights[ACTOR_PRIOHIGH], high ? high : 1);
+    store_relaxed(&root->weights[ACTOR_PRIONORMAL], normal ? normal : 1);
+    store_relaxed(&root->weights[ACTOR_PRIOLOW], low ? low : 1);
+
+    return 1;
+}
+
+ACTOR_NODE *actorn_manage(ACTOR_ROOT *root, ACTOR_NODE *node, ACTOR_CB cb, int action) {
+    if (root == NULL) return NULL;
+
+    if (action == ACTORN_FIND) {
+        if (!node_valid(root, node)) return NULL;
+    } else if (action == ACTORN_SET) {
+        if (node == NULL || node->status & ACTOR_RUNNABLE) return NULL;
+
+        sync_value(ACTOR_CB, node->cb, cb);
+    } else if (action == ACTORN_CREATE) {
+        if ((node = node_alloc(root)) == NULL) return NULL;
+
+        sync_value(uint64_t, node->status, ACTOR_DEFAULT);
+        sync_value(ACTOR_CB, node->cb, cb);
+        if (node->inbox == NULL) node->inbox = mailbox_init(root->pool, root->maxinbox);
+    } else if (action == ACTORN_START) {
+        if (node == NULL || node->status & ACTOR_RUNNABLE) return node;
+
+        sync_or(uint64_t, node->status, ACTOR_RUNNABLE);
+
+        if (mailbox_size(node->inbox) && !(__sync_fetch_and_or(&node->status, ACTOR_RUNTASK) & ACTOR_RUNTASK))
+            actor_schedule(root, node);
+    } else if (action == ACTORN_STOP) {
+        if (node == NULL || !(node->status & ACTOR_RUNNABLE)) return node;
+
+        sync_xor(uint64_t, node->status, ACTOR_RUNNABLE);
+    } else if (action == ACTORN_DELETE) {
+        if (node == NULL || !node_close(node, 0)) return NULL;
+
+        node_remove(root, node);
+    } else
+        return NULL;
+
+    return node;
+}
+
+int actorn_batch(ACTOR_ROOT *root, ACTOR_NODE *node, ACTOR_BATCH_CB batch) {
+    if (root == NULL || !node_valid(root, node)) return 0;
+
+    if (node->status == 0 || node->status & ACTOR_RUNNABLE) return 0;
+
+    sync_value(ACTOR_BATCH_CB, node->batch, batch);
+
+    return 1;
+}
+
+int actorn_priority(ACTOR_ROOT *root, ACTOR_NODE *node, int priority) {
+    if (root == NULL || !node_valid(root, node) || node->status == 0) return 0;
+
+    if (priority < ACTOR_PRIOHIGH || priority >= ACTOR_PRIOCLASSES) return 0;
+
+    store_relaxed(&node->priority, priority);
+
+    return 1;
+}
+
+int actorn_send(ACTOR_ROOT *root, ACTOR_NODE *node, void *data) {
+    if (root == NULL || node == NULL) return 0;
+
+    return send_mail(root, node, data);
+}
+
+int actorn_sendmode(ACTOR_ROOT *root, ACTOR_NODE *node, void *data, int mode, uint64_t timeout) {
+    if (root == NULL || node == NULL) return 0;
+
+    return send_wait(root, node, load_acquire(&node->generation), data, mode, timeout);
+}
+
+ACTOR_NODE *actorh_node(ACTOR_ROOT *root, ACTOR_HANDLE handle) {
+    uint32_t index = (uint32_t)handle; ACTOR_NODE *node = NULL;
+
+    if (root == NULL || index >= root->maxnode) return NULL;
+
+    node = root->nodes + index;
+
+    if (load_acquire(&node->generation) != (uint32_t)(handle >> 32) || load_acquire(&node->status) == 0) return NULL;
+
+    return node;
+}
+
+ACTOR_HANDLE actorh_handle(ACTOR_ROOT *root, ACTOR_NODE *node) {
+    if (root == NULL || !node_valid(root, node) || node->status == 0) return 0;
+
+    return (ACTOR_HANDLE)node->generation << 32 | (uint64_t)(node - root->nodes);
+}
+
+ACTOR_HANDLE actorh_manage(ACTOR_ROOT *root, ACTOR_HANDLE handle, ACTOR_CB cb, int action) {
+    ACTOR_NODE *node = NULL;
+
+    if (action == ACTORN_CREATE)
+        return actorh_handle(root, actorn_manage(root, NULL, cb, action));
+
+    if ((node = actorh_node(root, handle)) == NULL) return 0;
+
+    return actorn_manage(root, node, cb, action) != NULL ? handle : 0;
+}
+
+int actorh_priority(ACTOR_ROOT *root, ACTOR_HANDLE handle, int priority) {
+    return actorn_priority(root, actorh_node(root, handle), priority);
+}
+
+int actorh_send(ACTOR_ROOT *root, ACTOR_HANDLE handle, void *data) {
+    ACTOR_NODE *node = actorh_node(root, handle);
+
+    if (node == NULL) return 0;
+
+    return send_handle(root, node, handle, data);
+}
+
+int actorh_sendmode(ACTOR_ROOT *root, ACTOR_HANDLE handle, void *data, int mode, uint64_t timeout) {
+    ACTOR_NODE *node = actorh_node(root, handle);
+
+    if (node == NULL) return 0;
+
+    return send_wait(root, node, handle_generation(handle), data, mode, timeout);
+}
+
+// Jump consistent hash, going from n to n + 1 buckets moves only a 1 / (n + 1) share of the keys
+static uint32_t pool_jump(uint64_t key, uint32_t buckets) {
+    int64_t bucket = -1, next = 0;
+
+    while (next < buckets) {
+        bucket = next;
+        key = key * 2862933555777941757ULL + 1;
+        next = (int64_t)((bucket + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1)));
+    }
+
+    return (uint32_t)bucket;
+}
+
+static ACTOR_HANDLE pool_pick(ACTOR_ROOT *root, ACTOR_POOL *pool, uint64_t key, int keyed) {
+    ACTOR_HANDLE handle = 0; ACTOR_NODE *node = NULL;
+    uint64_t depth = 0, least = UINT64_MAX; uint32_t i = 0, j = 0;
+
+    pthread_spin_lock(&pool->lock);
+
+    if (pool->count > 0) {
+        if (pool->policy == ACTOR_POOLHASH && keyed) {
+            handle = pool->replicas[pool_jump(key, pool->count)];
+        } else if (pool->policy == ACTOR_POOLLEAST) {
+            // Start at the cursor so replicas that are equally idle still take turns
+            for (i = 0, j = pool->cursor++ % pool->count; i < pool->count; ++i, j = (j + 1) % pool->count) {
+                if ((node = actorh_node(root, pool->replicas[j])) == NULL) continue;
+
+                if ((depth = mailbox_size(node->inbox)) < least) {
+                    least = depth;
+                    handle = pool->replicas[j];
+                }
+
+                if (depth == 0) break;
+            }
+        } else
+            handle = pool->replicas[pool->cursor++ % pool->count];
+    }
+
+    pthread_spin_unlock(&pool->lock);
+
+    return handle;
+}
+
+static int pool_send(ACTOR_ROOT *root, const char *name, uint64_t key, int keyed, void *data, int mode, uint64_t timeout) {
+    ACTOR_POOL *pool = hash_table(root->poolstable, name, NULL, HTABLE_FIND);
+    ACTOR_NODE *node = NULL; ACTOR_HANDLE handle = 0; int ret = 0, tries = 0;
+
+    if (pool == NULL) return 0;
+
+    // A replica retired between the pick and the post refuses, the second pick no longer sees it
+    for (tries = 0; tries < 2; ++tries) {
+        if ((node = actorh_node(root, handle = pool_pick(root, pool, key, keyed))) == NULL) continue;
+
+        ret = mode == ACTOR_SENDTRY ? send_handle(root, node, handle, data) : send_wait(root, node, handle_generation(handle), data, mode, timeout);
+
+        if (ret || actorh_node(root, handle) != NULL) break;
+    }
+
+    return ret;
+}
+
+int actors_manage(ACTOR_ROOT *root, const char *name, ACTOR_CB cb, int action) {
+    if (root == NULL || name == NULL) return 0;
+
+    ACTOR_NODE *node = NULL;
+
+    if (action == ACTORS_FIND) {
+        node = hash_table(root->nodestable, name, NULL, HTABLE_FIND);
+
+        if (node == NULL) return 0;
+    } else if (action == ACTORS_SET) {
+        node = hash_table(root->nodestable, name, NULL, HTABLE_FIND);
+
+        if (node == NULL) return 0;
+
+        if (node->status & ACTOR_RUNNABLE) return 0;
+
+        sync_value(ACTOR_CB, node->cb, cb);
+    } else if (action == ACTORS_CREATE) {
+        if (hash_table(root->poolstable, name, NULL, HTABLE_FIND) != NULL) return 0;
+
+        if ((node = node_alloc(root)) == NULL) return 0;
+
+        if (hash_table(root->nodestable, name, node, HTABLE_CREATE) == NULL) {
+            node_free(root, node);
+            return 0;
+        }
+
+        sync_value(uint64_t, node->status, ACTOR_DEFAULT);
+        sync_value(ACTOR_CB, node->cb, cb);
+        if (node->inbox == NULL) node->inbox = mailbox_init(root->pool, root->maxinbox);
+    } else if (action == ACTORS_START) {
+        node = hash_table(root->nodestable, name, NULL, HTABLE_FIND);
+
+        if (node == NULL) return 0;
+
+        if (node->status & ACTOR_RUNNABLE) return 1;
+
+        sync_or(uint64_t, node->status, ACTOR_RUNNABLE);
+
+        if (mailbox_size(node->inbox) && !(__sync_fetch_and_or(&node->status, ACTOR_RUNTASK) & ACTOR_RUNTASK))
+            actor_schedule(root, node);
+    } else if (action == ACTORS_STOP) {
+        node = hash_table(root->nodestable, name, NULL, HTABLE_FIND);
+
+        if (node == NULL) return 0;
+
+        if (!(node->status & ACTOR_RUNNABLE)) return 1;
+
+        sync_xor(uint64_t, node->status, ACTOR_RUNNABLE);
+    } else if (action == ACTORS_DELETE) {
+        node = hash_table(root->nodestable, name, NULL, HTABLE_DELETE);
+
+        if (node == NULL || !node_close(node, 0)) return 0;
+
+        node_remove(root, node);
+    } else
+        return 0;
+
+    return 1;
+}
+
+int actors_batch(ACTOR_ROOT *root, const char *name, ACTOR_BATCH_CB batch) {
+    if (root == NULL || name == NULL) return 0;
+
+    return actorn_batch(root, hash_table(root->nodestable, name, NULL, HTABLE_FIND), batch);
+}
+
+int actors_priority(ACTOR_ROOT *root, const char *name, int priority) {
+    if (root == NULL || name == NULL) return 0;
+
+    return actorn_priority(root, hash_table(root->nodestable, name, NULL, HTABLE_FIND), priority);
+}
+
+int actors_send(ACTOR_ROOT *root, const char *name, void *data) {
+    if (root == NULL || name == NULL) return 0;
+
+    ACTOR_NODE *node = hash_table(root->nodestable, name, NULL, HTABLE_FIND);
+
+    if (node == NULL) return pool_send(root, name, 0, 0, data, ACTOR_SENDTRY, 0);
+
+    return send_mail(root, node, data);
+}
+
+int actors_sendmode(ACTOR_ROOT *root, const char *name, void *data, int mode, uint64_t timeout) {
+    if (root == NULL || name == NULL) return 0;
+
+    ACTOR_NODE *node = hash_table(root->nodestable, name, NULL, HTABLE_FIND);
+
+    if (node == NULL) return pool_send(root, name, 0, 0, data, mode, timeout);
+
+    return send_wait(root, node, load_acquire(&node->generation), data, mode, timeout);
+}
+
+int actors_sendkey(ACTOR_ROOT *root, const char *name, uint64_t key, void *data, int mode, uint64_t timeout) {
+    if (root == NULL || name == NULL) return 0;
+
+    ACTOR_NODE *node = hash_table(root->nodestable, name, NULL, HTABLE_FIND);
+
+    if (node == NULL) return pool_send(root, name, key, 1, data, mode, timeout);
+
+    return mode == ACTOR_SENDTRY ? send_mail(root, node, data) : send_wait(root, node, load_acquire(&node->generation), data, mode, timeout);
+}
+
+// Every live actor gets a try, one full mailbox no longer cuts the rest off
+int actor_broadcast(ACTOR_ROOT *root, void *data) {
+    uint64_t i = 0; int ret = 1; if (root == NULL) return 0;
+
+    for (i = 0; i < root->maxnode; ++i)
+        if (root->nodes[i].status != 0 && !send_mail(root, &root->nodes[i], data)) ret = 0;
+
+    return ret;
+}
+
+static ACTOR_TOPIC *topic_find(ACTOR_ROOT *root, const char *name, int create) {
+    ACTOR_TOPIC *topic = hash_table(root->topicstable, name, NULL, HTABLE_FIND);
+
+    if (topic != NULL || !create) return topic;
+
+    topic = (ACTOR_TOPIC *)analign(sizeof(ACTOR_TOPIC));
+    memset(topic, 0, sizeof(ACTOR_TOPIC));
+    pthread_spin_init(&topic->lock, PTHREAD_PROCESS_PRIVATE);
+
+    // Lost the race to another subscriber, use the topic it created
+    if (hash_table(root->topicstable, name, topic, HTABLE_CREATE) == NULL) {
+        pthread_spin_destroy(&topic->lock);
+        anfree(topic);
+
+        return hash_table(root->topicstable, name, NULL, HTABLE_FIND);
+    }
+
+    do topic->next = root->topics; while (!bool_cas(&root->topics, topic->next, topic));
+
+    return topic;
+}
+
+int actor_subscribe(ACTOR_ROOT *root, const char *name, ACTOR_HANDLE handle) {
+    ACTOR_TOPIC *topic = NULL; uint32_t i = 0;
+
+    if (root == NULL || name == NULL || actorh_node(root, handle) == NULL) return 0;
+
+    if ((topic = topic_find(root, name, 1)) == NULL) return 0;
+
+    pthread_spin_lock(&topic->lock);
+
+    for (i = 0; i < topic->count; ++i)
+        if (topic->subscribers[i] == handle) break;
+
+    if (i == topic->count) {
+        if (topic->count == topic->size) {
+            topic->size = topic->size ? topic->size * 2 : 8;
+            topic->subscribers = (uint64_t *)realloc(topic->subscribers, sizeof(uint64_t) * topic->size);
+            if (topic->subscribers == NULL) abort();
+        }
+
+        topic->subscribers[topic->count++] = handle;
+    }
+
+    pthread_spin_unlock(&topic->lock);
+
+    return 1;
+}
+
+int actor_unsubscribe(ACTOR_ROOT *root, const char *name, ACTOR_HANDLE handle) {
+    ACTOR_TOPIC *topic = NULL; uint32_t i = 0; int ret = 0;
+
+    if (root == NULL || name == NULL) return 0;
+
+    if ((topic = topic_find(root, name, 0)) == NULL) return 0;
+
+    pthread_spin_lock(&topic->lock);
+
+    for (i = 0; i < topic->count; ++i) {
+        if (topic->subscribers[i] == handle) {
+            topic->subscribers[i] = topic->subscribers[--topic->count];
+            ret = 1;
+            break;
+        }
+    }
+
+    pthread_spin_unlock(&topic->lock);
+
+    return ret;
+}
+
+// Returns how many subscribers took the message, stale subscribers are dropped on the way
+int actor_publish(ACTOR_ROOT *root, const char *name, void *data, ACTOR_RELEASE release) {
+    ACTOR_TOPIC *topic = NULL; ACTOR_ENVELOPE *envelope = NULL; ACTOR_NODE *node = NULL;
+    uint32_t i = 0; int sent = 0;
+
+    if (root == NULL || name == NULL) return 0;
+
+    if ((topic = topic_find(root, name, 0)) == NULL) {
+        if (release != NULL) release(data);
+        return 0;
+    }
+
+    // The envelope rides inline in a pooled message, so publishing does not hit malloc either
+    envelope = (ACTOR_ENVELOPE *)message_data(message_alloc(0, NULL, sizeof(ACTOR_ENVELOPE)));
+    envelope->data = data;
+    envelope->release = release;
+
+    // Hold one reference for the publisher so early subscribers cannot free it mid fan-out
+    envelope->refs = 1;
+
+    pthread_spin_lock(&topic->lock);
+
+    for (i = 0; i < topic->count;) {
+        if ((node = actorh_node(root, topic->subscribers[i])) == NULL) {
+            topic->subscribers[i] = topic->subscribers[--topic->count];
+            continue;
+        }
+
+        __atomic_add_fetch(&envelope->refs, 1, __ATOMIC_RELAXED);
+
+        if (send_marked(root, node, handle_generation(topic->subscribers[i]), envelope, 1))
+            ++sent;
+        else
+            __atomic_sub_fetch(&envelope->refs, 1, __ATOMIC_RELAXED);
+
+        ++i;
+    }
+
+    pthread_spin_unlock(&topic->lock);
+
+    envelope_release(envelope);
+
+    return sent;
+}
+
+// The replica is kicked once so a worker sees the mark even when its inbox is already empty
+static void pool_retire(ACTOR_ROOT *root, ACTOR_HANDLE handle) {
+    ACTOR_NODE *node = actorh_node(root, handle);
+
+    if (node == NULL) return;
+
+    sync_or(uint64_t, node->status, ACTOR_RETIRING);
+
+    if (!(__sync_fetch_and_or(&node->status, ACTOR_RUNTASK) & ACTOR_RUNTASK))
+        actor_schedule(root, node);
+}
+
+int actor_pool(ACTOR_ROOT *root, const char *name, ACTOR_CB cb, size_t replicas, int policy) {
+    ACTOR_POOL *pool = NULL;
+
+    if (root == NULL || name == NULL || cb == NULL || policy < ACTOR_POOLROUND || policy > ACTOR_POOLHASH) return 0;
+
+    if (hash_table(root->nodestable, name, NULL, HTABLE_FIND) != NULL) return 0;
+
+    pool = (ACTOR_POOL *)analign(sizeof(ACTOR_POOL));
+    memset(pool, 0, sizeof(ACTOR_POOL));
+    pthread_spin_init(&pool->lock, PTHREAD_PROCESS_PRIVATE);
+    pool->cb = cb;
+    pool->policy = policy;
+
+    if (hash_table(root->poolstable, name, pool, HTABLE_CREATE) == NULL) {
+        pthread_spin_destroy(&pool->lock);
+        anfree(pool);
+
+        return 0;
+    }
+
+    do pool->next = root->pools; while (!bool_cas(&root->pools, pool->next, pool));
+
+    return actor_pool_resize(root, name, replicas);
+}
+
+int actor_pool_resize(ACTOR_ROOT *root, const char *name, size_t replicas) {
+    ACTOR_POOL *pool = NULL; ACTOR_HANDLE handle = 0; int ret = 1;
+
+    if (root == NULL || name == NULL) return 0;
+
+    if ((pool = hash_table(root->poolstable, name, NULL, HTABLE_FIND)) == NULL) return 0;
+
+    pthread_spin_lock(&pool->lock);
+
+    while (pool->count < replicas) {
+        if ((handle = actorh_create(root, pool->cb)) == 0) {
+            ret = 0;
+            break;
+        }
+
+        if (pool->count == pool->size) {
+            pool->size = pool->size ? pool->size * 2 : 8;
+            pool->replicas = (uint64_t *)realloc(pool->replicas, sizeof(uint64_t) * pool->size);
+            if (pool->replicas == NULL) abort();
+        }
+
+        pool->replicas[pool->count++] = handle;
+        actorh_start(root, handle);
+    }
+
+    // Removed replicas stop getting mail right away but keep draining what they already hold
+    while (pool->count > replicas)
+        pool_retire(root, pool->replicas[--pool->count]);
+
+    pthread_spin_unlock(&pool->lock);
+
+    return ret;
+}
+
+void actor_wait(ACTOR_ROOT *root) {
+    size_t i = 0; if (root == NULL) return;
+
+    if (!root->running) return;
+
+    // Grows stop at breakout, the scale lock waits out one already starting a thread
+    pthread_spin_lock(&root->scalelock);
+
+    for (i = 0; i < root->maxworker; ++i) {
+        if (root->workers[i].thread != 0)
+            pthread_join(root->workers[i].thread, NULL);
+
+        root->workers[i].thread = 0;
+        root->workers[i].state = ACTORW_STOPPED;
+    }
+
+    root->workercnt = 0;
+    root->running = 0;
+
+    pthread_spin_unlock(&root->scalelock);
+}
+
+void actor_break(ACTOR_ROOT *root) {
+    size_t i = 0; if (root == NULL) return;
+
+    __atomic_store_n(&root->breakout, 1, __ATOMIC_SEQ_CST);
+
+    for (i = 0; i < root->maxworker; ++i) {
+        __atomic_store_n(&root->workers[i].parked, 0, __ATOMIC_SEQ_CST);
+        futex_wake(&root->workers[i].parked, 1);
+    }
+}
+
+void actor_clean(ACTOR_ROOT *root) {
+    int i = 0, j = 0; if (root == NULL) return;
+
+    ACTOR_TOPIC *topic = NULL, *next = NULL;
+    ACTOR_POOL *pool = NULL, *after = NULL;
+
+    mailbox_clean(root->inbox);
+    hash_clean(root->nodestable);
+    hash_clean(root->topicstable);
+    hash_clean(root->poolstable);
+
+    for (topic = root->topics; topic != NULL; topic = next) {
+        next = topic->next;
+        pthread_spin_destroy(&topic->lock);
+        free(topic->subscribers);
+        anfree(topic);
+    }
+
+    for (pool = root->pools; pool != NULL; pool = after) {
+        after = pool->next;
+        pthread_spin_destroy(&pool->lock);
+        free(pool->replicas);
+        anfree(pool);
+    }
+
+    for (i = 0; i < root->maxnode; ++i) {
+        if (root->nodes[i].inbox != NULL) {
+            node_drop(root, root->nodes + i);
+            mailbox_clean(root->nodes[i].inbox);
+        }
+    }
+
+    for (j = 0; j < ACTOR_PRIOCLASSES; ++j)
+        buffer_clean(root->task[j]);
+
+    for (i = 0; i < root->maxworker; ++i)
+        for (j = 0; j < ACTOR_PRIOCLASSES; ++j)
+            deque_clean(&root->workers[i].deque[j]);
+
+    mailbox_release(root->pool);
+    wheel_clean(root->wheel);
+    anfree(root->futures);
+
+    pthread_spin_destroy(&root->scalelock);
+    anfree(root->workers);
+    anfree(root->nodes);
+    anfree(root);
+}
+
+
+
+
+
+
+#ifdef ACTOR_TEST
+// Stress and demo program, build with -DACTOR_TEST to run it
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+
+typedef struct buffer_test {
+    RING_BUFFER *buffer;
+    uint64_t id;
+    uint64_t count;
+    uint64_t producers;
+    uint64_t volatile *seen;
+    uint64_t volatile *consumed;
+    int check;
+    int volatile failed;
+} BUFFER_TEST;
+
+static inline double test_time(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void *buffer_producer(void *data) {
+    BUFFER_TEST *test = (BUFFER_TEST *)data; uint64_t i = 0;
+
+    for (i = 0; i < test->count; ++i)
+        while (!buffer_write(test->buffer, (void *)(uintptr_t)((test->id << 32 | i) + 1))) sched_yield();
+
+    return NULL;
+}
+
+void *buffer_consumer(void *data) {
+    BUFFER_TEST *test = (BUFFER_TEST *)data; void *value = NULL;
+    uint64_t total = test->count * test->producers, *last = NULL, i = 0;
+
+    last = (uint64_t *)anmalloc(sizeof(uint64_t) * test->producers);
+    for (i = 0; i < test->producers; ++i) last[i] = 0;
+
+    while (load_relaxed(test->consumed) < total) {
+        if (!buffer_read(test->buffer, &value)) { sched_yield(); continue; }
+
+        if (test->check) {
+            uint64_t id = ((uintptr_t)value - 1) >> 32, seq = ((uintptr_t)value - 1) & 0xFFFFFFFF;
+
+            if (id >= test->producers || seq >= test->count || seq + 1 <= last[id]) test->failed = 1;
+            else {
+                last[id] = seq + 1;
+                __atomic_fetch_add(test->seen + id * test->count + seq, 1, __ATOMIC_RELAXED);
+            }
+        }
+
+        __atomic_fetch_add(test->consumed, 1, __ATOMIC_RELAXED);
+    }
+
+    anfree(last);
+
+    return NULL;
+}
+
+int buffer_test(uint64_t producers, uint64_t consumers, uint64_t count, int check) {
+    RING_BUFFER *buffer = buffer_init(1024);
+    BUFFER_TEST tests[producers + consumers];
+    pthread_t threads[producers + consumers];
+    uint64_t volatile consumed = 0, *seen = NULL, i = 0;
+    int failed = 0; double start = 0.0, cost = 0.0;
+
+    if (check) {
+        seen = (uint64_t *)anmalloc(sizeof(uint64_t) * producers * count);
+        memset((void *)seen, 0, sizeof(uint64_t) * producers * count);
+    }
+
+    start = test_time();
+
+    for (i = 0; i < producers + consumers; ++i) {
+        tests[i].buffer = buffer;
+        tests[i].id = i;
+        tests[i].count = count;
+        tests[i].producers = producers;
+        tests[i].seen = seen;
+        tests[i].consumed = &consumed;
+        tests[i].check = check;
+        tests[i].failed = 0;
+
+        pthread_create(threads + i, NULL, i < producers ? buffer_producer : buffer_consumer, tests + i);
+    }
+
+    for (i = 0; i < producers + consumers; ++i) {
+        pthread_join(threads[i], NULL);
+        failed |= tests[i].failed;
+    }
+
+    cost = test_time() - start;
+
+    if (check) {
+        for (i = 0; i < producers * count; ++i)
+            if (seen[i] != 1) failed = 1;
+
+        anfree((void *)seen);
+    }
+
+    if (buffer_size(buffer) != 0) failed = 1;
+
+    printf("buffer %s %luP%luC: %lu items, %.3fs, %.2f Mops/s, %s\n", check ? "stress" : "bench", producers, consumers,
+        producers * count, cost, producers * count / cost * 1e-6, failed ? "failed" : "ok");
+
+    buffer_clean(buffer);
+
+    return !failed;
+}
+
+typedef struct producer {
+    int *count;
+    int sent;
+    int total;
+} PRODUCER;
+
+void count_cb(ACTOR_ROOT *root, void *data) {
+    PRODUCER *producer = (PRODUCER *)data;
+
+    ++(*producer->count);
+}
+
+void count_batch(ACTOR_ROOT *root, void **data, size_t count) {
+    size_t i = 0;
+
+    for (i = 0; i < count; ++i)
+        ++(*((PRODUCER *)data[i])->count);
+}
+
+// The same message comes back through the notification when count was full, so just carry on
+void producer_cb(ACTOR_ROOT *root, void *data) {
+    PRODUCER *producer = (PRODUCER *)data; int ret = 0;
+
+    while (producer->sent < producer->total) {
+        if ((ret = actors_sendnotify(root, "count", data)) < 0) return;
+
+        if (ret > 0) ++producer->sent;
+    }
+}
+
+typedef struct hash_check {
+    HASH_TABLE *htable;
+    uint64_t volatile published;
+    int volatile done;
+    int volatile failed;
+} HASH_CHECK;
+
+// Every key published by the writer must stay visible while the table grows underneath
+static void *hash_reader(void *data) {
+    HASH_CHECK *check = (HASH_CHECK *)data; uint64_t i = 0, published = 0;
+
+    while (!check->done) {
+        published = __atomic_load_n(&check->published, __ATOMIC_ACQUIRE);
+
+        for (i = 0; i < published; i += 7)
+            if (hash_findk(check->htable, &i, sizeof(i)) != (void *)(uintptr_t)(i + 1)) check->failed = 1;
+
+        sched_yield();
+    }
+
+    pthread_exit(NULL);
+}
+
+int hash_test(uint64_t size, uint64_t count) {
+    HASH_TABLE *htable = hash_init(16); char key[32];
+    HASH_CHECK check = {htable, 0, 0, 0}; pthread_t reader;
+    uint64_t i = 0, found = 0, hash = 0, slot = 0; int failed = 0;
+    double start = 0, cost = 0;
+
+    pthread_create(&reader, NULL, hash_reader, &check);
+
+    for (i = 0; i < size * 4; ++i) {
+        if (hash_createk(htable, &i, sizeof(i), (void *)(uintptr_t)(i + 1)) == NULL) failed = 1;
+        __atomic_store_n(&check.published, i + 1, __ATOMIC_RELEASE);
+    }
+
+    check.done = 1;
+    pthread_join(reader, NULL);
+
+    if (check.failed || hash_count(htable) != size * 4) failed = 1;
+
+    for (i = 0; i < size * 4; ++i)
+        if (hash_deletek(htable, &i, sizeof(i)) != (void *)(uintptr_t)(i + 1)) failed = 1;
+
+    // Churn leaves tombstones behind, the table has to rebuild instead of filling up
+    for (i = 0; i < size * 64; ++i) {
+        snprintf(key, sizeof(key), "conn.%llu", (unsigned long long)i);
+        if (hash_create(htable, key, (void *)(uintptr_t)(i + 1)) == NULL || hash_delete(htable, key) == NULL) failed = 1;
+    }
+
+    // A slot holding the same hash under another key must not answer for it
+    hash = hash_bytes(htable, "alpha", 5);
+    hash_probe(htable->current, hash, "beta", 4, NULL, &slot);
+    hash_insert(htable->current, slot, hash, hash_key(htable, "beta", 4), &check);
+
+    if (hash_find(htable, "alpha") != NULL || hash_create(htable, "alpha", &found) != &found) failed = 1;
+    if (hash_find(htable, "alpha") != &found || hash_delete(htable, "alpha") != &found) failed = 1;
+
+    for (i = 0; i < size; ++i) {
+        snprintf(key, sizeof(key), "actor.%llu", (unsigned long long)i);
+        if (hash_create(htable, key, (void *)(uintptr_t)(i + 1)) == NULL) failed = 1;
+    }
+
+    for (i = 0; i < size; i += 2) {
+        snprintf(key, sizeof(key), "actor.%llu", (unsigned long long)i);
+        if (hash_delete(htable, key) != (void *)(uintptr_t)(i + 1)) failed = 1;
+    }
+
+    start = test_time();
+
+    for (i = 0; i < count; ++i) {
+        snprintf(key, sizeof(key), "actor.%llu", (unsigned long long)(i % size));
+        void *data = hash_find(htable, key);
+
+        if (data != NULL) ++found;
+        if ((i % size) % 2 ? data != (void *)(uintptr_t)(i % size + 1) : data != NULL) failed = 1;
+    }
+
+    cost = test_time() - start;
+
+    printf("hash find: %llu lookups, %llu hits, %llu slots, %.3fs, %.2f Mops/s, %s\n", (unsigned long long)count,
+        (unsigned long long)found, (unsigned long long)htable->current->size, cost, count / cost * 1e-6, failed ? "failed" : "ok");
+
+    hash_clean(htable);
+
+    return !failed;
+}
+
+int handle_test(ACTOR_ROOT *root, uint64_t count) {
+    ACTOR_HANDLE handle = 0, stale = 0; uint64_t i = 0; int failed = 0;
+    double start = test_time(), cost = 0;
+
+    for (i = 0; i < count; ++i) {
+        if ((handle = actorh_create(root, count_cb)) == 0) { failed = 1; break; }
+
+        if (actorh_find(root, handle) != handle || actorh_delete(root, handle) != handle) failed = 1;
+
+        // The slot is reused right away, the old handle must not reach the new actor
+        if (stale != 0 && (actorh_find(root, stale) != 0 || actorh_send(root, stale, NULL))) failed = 1;
+
+        stale = handle;
+    }
+
+    cost = test_time() - start;
+
+    printf("handle churn: %llu create/delete, %.3fs, %.2f Mops/s, %s\n", (unsigned long long)count, cost, count / cost * 1e-6, failed ? "failed" : "ok");
+
+    return !failed;
+}
+
+typedef struct stale_check {
+    ACTOR_ROOT *root;
+    ACTOR_HANDLE volatile current;
+    uint64_t volatile accepted;
+    int volatile done;
+} STALE_CHECK;
+
+static uint64_t volatile stale_handled = 0, stale_misdelivered = 0;
+
+// Every message carries the handle it was sent to, it must only ever reach that actor
+void stale_cb(ACTOR_ROOT *root, void *data) {
+    if ((ACTOR_HANDLE)(uintptr_t)data != actorh_handle(root, actor_current->running))
+        __atomic_add_fetch(&stale_misdelivered, 1, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&stale_handled, 1, __ATOMIC_RELAXED);
+}
+
+static void *stale_sender(void *data) {
+    STALE_CHECK *check = (STALE_CHECK *)data; ACTOR_HANDLE handle = 0;
+
+    while (!check->done) {
+        handle = __atomic_load_n(&check->current, __ATOMIC_ACQUIRE);
+
+        if (handle && actorh_send(check->root, handle, (void *)(uintptr_t)handle))
+            __atomic_add_fetch(&check->accepted, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+// Senders keep using a handle while its actor is stopped, deleted and the slot handed to the next one
+int stale_test(uint64_t rounds) {
+    STALE_CHECK check = {actor_init("stale", 4, 2, 64), 0, 0, 0}; pthread_t senders[3];
+    ACTOR_HANDLE handle = 0; uint64_t i = 0; int failed = 0, j = 0;
+
+    actor_run(check.root);
+
+    for (j = 0; j < 3; ++j) pthread_create(senders + j, NULL, stale_sender, &check);
+
+    for (i = 0; i < rounds && !failed; ++i) {
+        if ((handle = actorh_create(check.root, stale_cb)) == 0 || !actorh_start(check.root, handle)) failed = 1;
+
+        __atomic_store_n(&check.current, handle, __ATOMIC_RELEASE);
+        usleep(50);
+
+        actorh_stop(check.root, handle);
+
+        // Delete refuses while the actor is still queued or running
+        while (!actorh_delete(check.root, handle)) usleep(10);
+    }
+
+    check.done = 1;
+    for (j = 0; j < 3; ++j) pthread_join(senders[j], NULL);
+
+    if (stale_misdelivered != 0 || stale_handled > check.accepted || stale_handled == 0) failed = 1;
+
+    printf("stale handles: %llu rounds, %llu accepted, %llu handled, %llu misdelivered, %s\n", (unsigned long long)rounds,
+        (unsigned long long)check.accepted, (unsigned long long)stale_handled, (unsigned long long)stale_misdelivered, failed ? "failed" : "ok");
+
+    actor_break(check.root);
+    actor_wait(check.root);
+    actor_clean(check.root);
+
+    return !failed;
+}
+
+static int volatile listened = 0, released = 0;
+
+void listen_cb(ACTOR_ROOT *root, void *data) {
+    __atomic_add_fetch(&listened, *(int *)data, __ATOMIC_RELAXED);
+}
+
+void release_cb(void *data) {
+    __atomic_add_fetch(&released, 1, __ATOMIC_RELAXED);
+}
+
+static void * volatile echoed = NULL;
+
+void echo_cb(ACTOR_ROOT *root, void *data) {
+    __atomic_store_n(&echoed, data, __ATOMIC_RELEASE);
+}
+
+// Plain messages are opaque, an odd pointer into a byte buffer has to arrive untouched
+int odd_test(ACTOR_ROOT *root) {
+    static char text[] = "odd pointer";
+    ACTOR_HANDLE echo = actorh_create(root, echo_cb); int failed = 0;
+
+    actorh_start(root, echo);
+
+    if (!actorh_send(root, echo, text + 1)) failed = 1;
+
+    while (!failed && __atomic_load_n(&echoed, __ATOMIC_ACQUIRE) == NULL)
+        usleep(1000);
+
+    if (echoed != text + 1) failed = 1;
+
+    printf("odd pointer: %p sent, %p received, %s\n", (void *)(text + 1), echoed, failed ? "failed" : "ok");
+
+    actorh_stop(root, echo);
+    actorh_delete(root, echo);
+
+    return !failed;
+}
+
+enum {
+    TEST_PING = 1,
+    TEST_PONG
+};
+
+static double volatile pingpong_stop = 0;
+static int volatile pingpong_count = 0;
+
+// Every hop is a fresh message from the sender's cache and is freed by the receiver
+void ping_cb(ACTOR_ROOT *root, void *data) {
+    MESSAGE *message = (MESSAGE *)data; int count = 0;
+
+    memcpy(&count, message_data(message), sizeof(count));
+    message_free(message);
+
+    count += 2;
+
+    actors_sendblock(root, "pong", message_alloc(TEST_PONG, &count, sizeof(count)));
 }
 
 void pong_cb(ACTOR_ROOT *root, void *data) {
-    int *count = (int *)data;
+    MESSAGE *message = (MESSAGE *)data; int count = 0;
 
-    --(*count);
+    memcpy(&count, message_data(message), sizeof(count));
+    message_free(message);
 
-    printf("count: %d\n", *count);
-    if (*count != 10000)
-        while (!actors_send(root, "ping", data));
-    else
-        actor_break(root);
+    if (--count != 10000)
+        actors_sendblock(root, "ping", message_alloc(TEST_PING, &count, sizeof(count)));
+    else {
+        pingpong_count = count;
+        pingpong_stop = test_time();
+    }
+}
+
+void tick_cb(ACTOR_ROOT *root, void *data) {
+    __atomic_add_fetch((int *)data, 1, __ATOMIC_RELAXED);
+}
+
+int timer_test(ACTOR_ROOT *root, ACTOR_HANDLE target) {
+    int volatile once = 0, every = 0, never = 0; int failed = 0;
+    double start = test_time(), cost = 0;
+
+    ACTOR_TIMERID after = actor_send_after(root, target, (void *)&once, 100000000ULL);
+    ACTOR_TIMERID period = actor_send_every(root, target, (void *)&every, 5000000ULL);
+    ACTOR_TIMERID cancel = actor_send_after(root, target, (void *)&never, 10000000ULL);
+
+    if (!after || !period || !actor_cancel(root, cancel) || actor_cancel(root, cancel)) failed = 1;
+
+    while (__atomic_load_n(&every, __ATOMIC_ACQUIRE) < 10 || __atomic_load_n(&once, __ATOMIC_ACQUIRE) == 0)
+        usleep(1000);
+
+    cost = test_time() - start;
+
+    // A fired one shot timer is gone, the periodic one keeps its id until cancelled
+    if (actor_cancel(root, after) || !actor_cancel(root, period)) failed = 1;
+
+    usleep(30000);
+
+    if (once != 1 || never != 0 || every > 30) failed = 1;
+
+    printf("timers: %d periodic ticks in %.3fs, one shot %d, cancelled %d, %s\n", every, cost, once, never, failed ? "failed" : "ok");
+
+    return !failed;
+}
+
+// Timers aimed at a stopped actor must neither keep a one shot alive nor wake a worker every tick
+int idle_timer_test(void) {
+    ACTOR_ROOT *root = actor_init("idle", 16, 1, 16);
+    ACTOR_HANDLE target = actorh_create(root, tick_cb); ACTOR_NODE *node = actorh_node(root, target);
+    ACTOR_TIMERID after = 0, period = 0; ACTOR_STATS before, later;
+    int volatile once = 0, every = 0; int failed = 0;
+
+    actorh_start(root, target);
+    actor_run(root);
+    actorh_stop(root, target);
+
+    after = actor_send_after(root, target, (void *)&once, 5000000ULL);
+    period = actor_send_every(root, target, (void *)&every, 1000000000ULL);
+
+    usleep(50000);
+    actor_stats(root, &before);
+    usleep(200000);
+    actor_stats(root, &later);
+
+    if (once != 0 || every != 0 || root->wheel->count != 1 || node->dropped != 0) failed = 1;
+    if (later.parks - before.parks > 20 || actor_cancel(root, after) || !actor_cancel(root, period)) failed = 1;
+
+    printf("idle timers: %llu parks in 0.2s with a stopped target, %s\n", (unsigned long long)(later.parks - before.parks), failed ? "failed" : "ok");
+
+    actor_break(root);
+    actor_wait(root);
+    actor_clean(root);
+
+    return !failed;
+}
+
+void busy_cb(ACTOR_ROOT *root, void *data) {
+    double stop = test_time() + 0.00005;
+
+    while (test_time() < stop);
+
+    // Touch the message cache so every grown worker attaches one
+    message_free(message_alloc(0, NULL, 0));
+
+    __atomic_add_fetch((int *)data, 1, __ATOMIC_RELAXED);
+}
+
+static size_t message_cachecnt(void) {
+    MESSAGE_CACHE *cache = NULL; size_t count = 0;
+
+    for (cache = message_caches; cache != NULL; cache = cache->next) ++count;
+
+    return count;
+}
+
+int scale_test(size_t actors, int count) {
+    ACTOR_ROOT *root = actor_init("elastic", actors, 4, 1024);
+    ACTOR_HANDLE handles[actors]; ACTOR_SCALING scaling;
+    int volatile done = 0; int failed = 0, i = 0, round = 0;
+    size_t peak = 0, caches[2] = {0, 0}; double start = 0;
+
+    actor_elastic(root, 1, 8, 200000ULL, 50000000ULL);
+
+    for (i = 0; i < actors; ++i)
+        actorh_start(root, handles[i] = actorh_create(root, busy_cb));
+
+    actor_run(root);
+
+    // Two grow and retire cycles, the second one has to run on the caches the first left behind
+    for (round = 0; round < 2; ++round) {
+        for (i = 0; i < count; ++i)
+            if (!actorh_sendblock(root, handles[i % actors], (void *)&done)) failed = 1;
+
+        while (__atomic_load_n(&done, __ATOMIC_ACQUIRE) != count * (round + 1)) {
+            if (load_relaxed(&root->workercnt) > peak) peak = load_relaxed(&root->workercnt);
+            usleep(100);
+        }
+
+        // Everything is idle now, the pool has to shrink back to its floor
+        for (start = test_time(); load_relaxed(&root->workercnt) > 1 && test_time() - start < 2.0;)
+            usleep(1000);
+
+        caches[round] = message_cachecnt();
+    }
+
+    actor_scaling(root, &scaling);
+
+    if (scaling.workers != 1 || scaling.deepgrows + scaling.lategrows == 0 || scaling.retires == 0 || caches[1] > caches[0]) failed = 1;
+
+    printf("scaling: peak %lu workers, %llu depth grows, %llu latency grows, %llu retires, now %lu, %lu then %lu message caches, %s\n", (unsigned long)peak,
+        (unsigned long long)scaling.deepgrows, (unsigned long long)scaling.lategrows, (unsigned long long)scaling.retires,
+        (unsigned long)scaling.workers, (unsigned long)caches[0], (unsigned long)caches[1], failed ? "failed" : "ok");
+
+    actor_break(root);
+    actor_wait(root);
+    actor_clean(root);
+
+    return !failed;
+}
+
+// Answers with the request doubled, the slow variant outlives the asker's timeout first
+void double_cb(ACTOR_ROOT *root, void *data) {
+    ACTOR_FUTURE *future = (ACTOR_FUTURE *)data;
+
+    actor_reply(root, future, (void *)((uintptr_t)actor_request(future) * 2));
+}
+
+void slow_cb(ACTOR_ROOT *root, void *data) {
+    usleep(20000);
+
+    double_cb(root, data);
+}
+
+static int volatile answered = 0, expired = 0, refused = 0;
+
+void answer_cb(ACTOR_ROOT *root, void *reply, int status, void *ctx) {
+    if (status == ACTOR_ASKDONE && (uintptr_t)reply == (uintptr_t)ctx * 2)
+        __atomic_add_fetch(&answered, 1, __ATOMIC_RELAXED);
+    else if (status == ACTOR_ASKTIMEOUT)
+        __atomic_add_fetch(&expired, 1, __ATOMIC_RELAXED);
+    else if (status == ACTOR_ASKFAILED)
+        __atomic_add_fetch(&refused, 1, __ATOMIC_RELAXED);
+}
+
+static size_t future_count(ACTOR_ROOT *root) {
+    uint32_t index = (uint32_t)root->futurelist; size_t count = 0;
+
+    for (; index != ACTOR_NOSLOT; index = root->futures[index].next) ++count;
+
+    return count;
+}
+
+int ask_test(ACTOR_ROOT *root, uintptr_t count) {
+    ACTOR_HANDLE doubler = actorh_create(root, double_cb), slow = actorh_create(root, slow_cb);
+    uintptr_t i = 0; void *reply = NULL; int failed = 0;
+    double start = test_time(), cost = 0;
+
+    actorh_start(root, doubler);
+    actorh_start(root, slow);
+
+    for (i = 1; i <= count; ++i)
+        if (actor_get(root, actor_ask(root, doubler, (void *)i, 0, NULL, NULL), &reply) != ACTOR_ASKDONE || (uintptr_t)reply != i * 2) failed = 1;
+
+    cost = test_time() - start;
+
+    for (i = 1; i <= 1000; ++i)
+        if (actor_ask(root, doubler, (void *)i, 1000000000ULL, answer_cb, (void *)i) == NULL) failed = 1;
+
+    // Both the blocking and the callback form give up before the slow actor answers
+    if (actor_get(root, actor_ask(root, slow, (void *)1, 5000000ULL, NULL, NULL), &reply) != ACTOR_ASKTIMEOUT) failed = 1;
+    if (actor_ask(root, slow, (void *)1, 5000000ULL, answer_cb, (void *)1) == NULL) failed = 1;
+
+    while (answered != 1000 || expired != 1 || future_count(root) != ACTOR_MAXFUTURE)
+        usleep(1000);
+
+    // A stopped target refuses the ask outright, nothing is handed out and no slot is lost
+    actorh_stop(root, slow);
+
+    if (actor_ask(root, slow, (void *)1, 5000000ULL, answer_cb, (void *)1) != NULL || future_count(root) != ACTOR_MAXFUTURE) failed = 1;
+
+    printf("ask: %lu blocking round trips in %.3fs, %d callbacks, %d expired, %s\n", (unsigned long)count, cost, answered, expired, failed ? "failed" : "ok");
+
+    actorh_stop(root, doubler);
+    actorh_delete(root, doubler);
+    actorh_delete(root, slow);
+
+    return !failed;
+}
+
+static int volatile gate_open = 0;
+
+void gate_cb(ACTOR_ROOT *root, void *data) {
+    while (!__atomic_load_n(&gate_open, __ATOMIC_ACQUIRE)) usleep(100);
+
+    actor_reply(root, (ACTOR_FUTURE *)data, NULL);
+}
+
+// The second ask is still queued when its target is deleted, it has to fail and give its slot back
+int drop_test(void) {
+    ACTOR_ROOT *root = actor_init("drop", 16, 1, 16);
+    ACTOR_HANDLE gate = actorh_create(root, gate_cb); ACTOR_NODE *node = actorh_node(root, gate);
+    int failed = 0, before = answered;
+
+    actor_budget(root, 1);
+    actorh_start(root, gate);
+    actor_run(root);
+
+    if (actor_ask(root, gate, NULL, 0, answer_cb, NULL) == NULL || actor_ask(root, gate, NULL, 0, answer_cb, NULL) == NULL) failed = 1;
+
+    while (mailbox_size(node->inbox) != 1) usleep(100);
+
+    actorh_stop(root, gate);
+    __atomic_store_n(&gate_open, 1, __ATOMIC_RELEASE);
+
+    while (load_acquire(&node->status) & ACTOR_RUNTASK) usleep(100);
+
+    if (!actorh_delete(root, gate) || refused != 1 || answered != before + 1 || future_count(root) != ACTOR_MAXFUTURE) failed = 1;
+
+    printf("ask drop: %d answered, %d failed with the deleted target, %s\n", answered - before, refused, failed ? "failed" : "ok");
+
+    actor_break(root);
+    actor_wait(root);
+    actor_clean(root);
+
+    return !failed;
+}
+
+static int volatile sink_busy = 0, sink_open = 0, dropped_tokens = 0;
+static ACTOR_HANDLE sink = 0;
+
+void sink_cb(ACTOR_ROOT *root, void *data) {
+    __atomic_store_n(&sink_busy, 1, __ATOMIC_RELEASE);
+
+    while (!__atomic_load_n(&sink_open, __ATOMIC_ACQUIRE)) usleep(100);
+}
+
+void flood_cb(ACTOR_ROOT *root, void *data) {
+    while (actorh_sendnotify(root, sink, data) > 0);
+}
+
+void token_release(void *data) {
+    __atomic_add_fetch(&dropped_tokens, 1, __ATOMIC_RELAXED);
+}
+
+// The sender is parked on a full sink that gets deleted, its message must reach the release hook
+int notify_test(void) {
+    ACTOR_ROOT *root = actor_init("notify", 16, 2, 2);
+    ACTOR_HANDLE flood = actorh_create(root, flood_cb); ACTOR_NODE *node = NULL;
+    int failed = 0, token = 0;
+
+    sink = actorh_create(root, sink_cb);
+    node = actorh_node(root, sink);
+
+    actor_budget(root, 1);
+    actor_release(root, token_release);
+    actorh_start(root, sink);
+    actorh_start(root, flood);
+    actor_run(root);
+
+    // Hold the sink in its first message so the flood fills the inbox up behind it
+    actorh_send(root, sink, &token);
+
+    while (!__atomic_load_n(&sink_busy, __ATOMIC_ACQUIRE)) usleep(100);
+
+    actorh_send(root, flood, &token);
+
+    while (load_acquire(&node->inbox->notify) == NULL) usleep(100);
+
+    actorh_stop(root, sink);
+    __atomic_store_n(&sink_open, 1, __ATOMIC_RELEASE);
+
+    while (load_acquire(&node->status) & ACTOR_RUNTASK) usleep(100);
+
+    if (!actorh_delete(root, sink) || dropped_tokens != 1 || root->pool->notifies == NULL) failed = 1;
+
+    printf("notify drop: %d message released with the deleted target, %s\n", dropped_tokens, failed ? "failed" : "ok");
+
+    actor_break(root);
+    actor_wait(root);
+    actor_clean(root);
+
+    return !failed;
+}
+
+typedef struct prio_load {
+    ACTOR_HANDLE self;
+    uint64_t volatile count;
+} PRIO_LOAD;
+
+static int volatile prio_stop = 0;
+
+// Keeps its class busy for good by mailing itself after every short burn
+void prio_cb(ACTOR_ROOT *root, void *data) {
+    PRIO_LOAD *load = (PRIO_LOAD *)data; double stop = test_time() + 0.00001;
+
+    while (test_time() < stop);
+
+    store_relaxed(&load->count, load->count + 1);
+
+    if (!load_acquire(&prio_stop)) actorh_send(root, load->self, load);
+}
+
+int prio_test(void) {
+    ACTOR_ROOT *root = actor_init("prio", 64, 1, 16);
+    PRIO_LOAD high[4], low = {0, 0}; uint64_t highs = 0;
+    int failed = 0, i = 0;
+
+    actor_budget(root, 1);
+
+    for (i = 0; i < 4; ++i) {
+        high[i].self = actorh_create(root, prio_cb);
+        high[i].count = 0;
+        if (!actorh_priority(root, high[i].self, ACTOR_PRIOHIGH)) failed = 1;
+        actorh_start(root, high[i].self);
+    }
+
+    low.self = actorh_create(root, prio_cb);
+    if (!actorh_priority(root, low.self, ACTOR_PRIOLOW) || actorh_priority(root, low.self, ACTOR_PRIOCLASSES)) failed = 1;
+    actorh_start(root, low.self);
+
+    actor_run(root);
+
+    for (i = 0; i < 4; ++i) actorh_send(root, high[i].self, high + i);
+    actorh_send(root, low.self, &low);
+
+    usleep(200000);
+    __atomic_store_n(&prio_stop, 1, __ATOMIC_RELEASE);
+
+    actor_break(root);
+    actor_wait(root);
+
+    for (i = 0; i < 4; ++i) highs += high[i].count;
+
+    // One worker and a high class that never runs dry, the low actor still gets about one dispatch in nine
+    if (low.count == 0 || low.count * ACTOR_WEIGHTHIGH > highs * 2 || low.count * ACTOR_WEIGHTHIGH * 2 < highs) failed = 1;
+
+    printf("priority: %llu high and %llu low dispatches on one worker, %s\n", (unsigned long long)highs, (unsigned long long)low.count, failed ? "failed" : "ok");
+
+    actor_clean(root);
+
+    return !failed;
+}
+
+typedef struct pool_job {
+    uint32_t key;
+    uint32_t seq;
+} POOL_JOB;
+
+static uint32_t pool_last[64];
+static int volatile pool_done = 0, pool_unordered = 0;
+
+// Jobs of one key always reach the same replica, so they have to come in the order they were sent
+void pool_cb(ACTOR_ROOT *root, void *data) {
+    POOL_JOB *job = (POOL_JOB *)data;
+
+    if (job->seq != 0 && pool_last[job->key] + 1 != job->seq) __atomic_store_n(&pool_unordered, 1, __ATOMIC_RELAXED);
+    pool_last[job->key] = job->seq;
+
+    __atomic_add_fetch(&pool_done, 1, __ATOMIC_RELEASE);
+}
+
+int pool_test(ACTOR_ROOT *root, uint32_t count) {
+    POOL_JOB *jobs = (POOL_JOB *)malloc(sizeof(POOL_JOB) * count);
+    ACTOR_POOL *pool = NULL; ACTOR_HANDLE retired[6]; uint32_t i = 0, wait = 0; int failed = 0, sent = 0;
+
+    if (!actor_pool(root, "workers", pool_cb, 4, ACTOR_POOLHASH) || actor_pool(root, "workers", pool_cb, 4, ACTOR_POOLROUND)) failed = 1;
+    if (actors_create(root, "workers", pool_cb)) failed = 1;
+
+    pool = hash_table(root->poolstable, "workers", NULL, HTABLE_FIND);
+
+    for (i = 0; i < count; ++i) {
+        jobs[i].key = i % 64;
+        jobs[i].seq = i / 64;
+        if (!actors_sendkey(root, "workers", jobs[i].key, jobs + i, ACTOR_SENDBLOCK, 0)) failed = 1;
+    }
+
+    while (__atomic_load_n(&pool_done, __ATOMIC_ACQUIRE) != count)
+        usleep(1000);
+
+    // Unkeyed sends still spread over the replicas, removed ones drain first and then delete themselves
+    if (!actor_pool_resize(root, "workers", 8) || pool->count != 8) failed = 1;
+
+    for (i = 0; i < count; ++i) {
+        jobs[i].seq = 0;
+        sent += actors_sendblock(root, "workers", jobs + i);
+    }
+
+    memcpy(retired, pool->replicas + 2, sizeof(retired));
+
+    if (!actor_pool_resize(root, "workers", 2) || pool->count != 2) failed = 1;
+
+    while (__atomic_load_n(&pool_done, __ATOMIC_ACQUIRE) != count + sent)
+        usleep(1000);
+
+    // No further resize or send is needed for the drained replicas to go away
+    for (i = 0, wait = 0; i < 6 && wait < 1000; ++wait) {
+        while (i < 6 && actorh_node(root, retired[i]) == NULL) ++i;
+        if (i < 6) usleep(1000);
+    }
+
+    if (sent != count || i != 6 || pool_unordered) failed = 1;
+
+    printf("pool: %u keyed and %d spread messages over 4, 8 and 2 replicas, %s\n", count, sent, failed ? "failed" : "ok");
+
+    actor_pool_resize(root, "workers", 0);
+    free(jobs);
+
+    return !failed;
+}
+
+typedef struct churn_check {
+    ACTOR_ROOT *root;
+    uint64_t volatile accepted;
+    int volatile done;
+} CHURN_CHECK;
+
+static uint64_t volatile churn_handled = 0;
+
+void churn_cb(ACTOR_ROOT *root, void *data) {
+    __atomic_add_fetch(&churn_handled, 1, __ATOMIC_RELAXED);
+}
+
+static void *churn_sender(void *data) {
+    CHURN_CHECK *check = (CHURN_CHECK *)data; uint64_t key = 0;
+
+    while (!check->done)
+        if (actors_sendkey(check->root, "churn", key++, check, ACTOR_SENDTRY, 0))
+            __atomic_add_fetch(&check->accepted, 1, __ATOMIC_RELAXED);
+
+    return NULL;
+}
+
+// Replicas retire and delete themselves while senders keep hitting the pool, every accepted message still runs
+int churn_test(ACTOR_ROOT *root, uint32_t rounds) {
+    CHURN_CHECK check = {root, 0, 0}; pthread_t senders[3];
+    uint32_t i = 0; int failed = 0, j = 0, wait = 0;
+
+    if (!actor_pool(root, "churn", churn_cb, 1, ACTOR_POOLHASH)) failed = 1;
+
+    for (j = 0; j < 3; ++j) pthread_create(senders + j, NULL, churn_sender, &check);
+
+    for (i = 0; i < rounds; ++i) {
+        if (!actor_pool_resize(root, "churn", i % 2 ? 8 : 1)) failed = 1;
+        usleep(500);
+    }
+
+    check.done = 1;
+    for (j = 0; j < 3; ++j) pthread_join(senders[j], NULL);
+
+    for (wait = 0; wait < 5000 && __atomic_load_n(&churn_handled, __ATOMIC_ACQUIRE) != check.accepted; ++wait)
+        usleep(1000);
+
+    if (churn_handled != check.accepted || check.accepted == 0) failed = 1;
+
+    printf("pool churn: %u resizes between 1 and 8, %llu accepted, %llu handled, %s\n", rounds,
+        (unsigned long long)check.accepted, (unsigned long long)churn_handled, failed ? "failed" : "ok");
+
+    actor_pool_resize(root, "churn", 0);
+
+    return !failed;
+}
+
+static size_t message_slabs(void) {
+    MESSAGE_CACHE *cache = NULL; MESSAGE_SLAB *slab = NULL; size_t count = 0;
+
+    for (cache = message_caches; cache != NULL; cache = cache->next)
+        for (slab = cache->slabs; slab != NULL; slab = slab->next)
+            ++count;
+
+    return count;
 }
 
 int main(int argc, char **argv) {
-    ACTOR_ROOT *root = actor_init("root", 1024, 4, 60000);
+    int failed = 0;
+
+    failed |= !buffer_test(1, 1, 200000, 1);
+    failed |= !buffer_test(4, 1, 200000, 1);
+    failed |= !buffer_test(4, 4, 200000, 1);
+
+    failed |= !buffer_test(1, 1, 2000000, 0);
+    failed |= !buffer_test(4, 1, 1000000, 0);
+    failed |= !buffer_test(4, 4, 1000000, 0);
+
+    ACTOR_ROOT *root = actor_init("root", 1024, 4, 1024);
+
+    failed |= !hash_test(1024, 2000000);
+    failed |= !handle_test(root, 100000);
+    failed |= !stale_test(2000);
+    failed |= !scale_test(32, 4000);
+    failed |= !prio_test();
+
+    int i = 0;
 
     actors_create(root, "count", count_cb);
+    actors_batch(root, "count", count_batch);
     actors_create(root, "producer", producer_cb);
     actors_create(root, "producer2", producer_cb);
-    actors_create(root, "consumer", consumer_cb);
-    actors_create(root, "consumer2", consumer_cb);
+    actors_create(root, "consumer", producer_cb);
+    actors_create(root, "consumer2", producer_cb);
     actors_create(root, "ping", ping_cb);
     actors_create(root, "pong", pong_cb);
 
+    ACTOR_HANDLE ticker = actorh_create(root, tick_cb);
+    ACTOR_HANDLE listeners[3] = {actorh_create(root, listen_cb), actorh_create(root, listen_cb), actorh_create(root, listen_cb)};
+
     actor_run(root);
 
     actors_start(root, "count");
@@ -680,27 +3711,69 @@ int main(int argc, char **argv) {
     actors_start(root, "ping");
     actors_start(root, "pong");
 
-    int data = 0, count = 0;
-    actors_send(root, "producer", &data);
-    actors_send(root, "producer2", &data);
-    actors_send(root, "consumer", &data);
-    actors_send(root, "consumer2", &data);
-    actors_send(root, "ping", &count);
+    actorh_start(root, ticker);
+
+    for (i = 0; i < 3; ++i) {
+        actorh_start(root, listeners[i]);
+        actor_subscribe(root, "news", listeners[i]);
+    }
+
+    int data = 0, count = 0, one = 1, published = 0;
+    PRODUCER producers[5] = {{&data, 0, 10000}, {&data, 0, 10000}, {&data, 0, 20000}, {&data, 0, 20000}, {&data, 0, 20000}};
+    double start = test_time();
+    actors_send(root, "producer", producers + 0);
+    actors_send(root, "producer2", producers + 1);
+    actors_send(root, "consumer", producers + 2);
+    actors_send(root, "consumer2", producers + 3);
+    actors_send(root, "ping", message_alloc(TEST_PING, &count, sizeof(count)));
+
+    // The main thread is a plain producer too and simply blocks while count is full
+    for (i = 0; i < producers[4].total; ++i)
+        producers[4].sent += actors_sendblock(root, "count", producers + 4);
+
+    for (i = 0; i < 1000; ++i)
+        published += actor_publish(root, "news", &one, release_cb);
+
+    failed |= !timer_test(root, ticker);
+    failed |= !idle_timer_test();
+
+    while (__atomic_load_n(&data, __ATOMIC_ACQUIRE) != 80000 || pingpong_stop == 0 || released != 1000)
+        usleep(1000);
+
+    failed |= !odd_test(root);
+    failed |= !ask_test(root, 20000);
+    failed |= !drop_test();
+    failed |= !notify_test();
+    failed |= !pool_test(root, 64000);
+    failed |= !churn_test(root, 400);
+
+    printf("publish: 1000 messages, %d deliveries, %d handled, %d released\n", published, listened, released);
+
+    printf("count: %d messages in %.6fs\n", data, test_time() - start);
+
+    actor_break(root);
 
-    sleep(1);
     printf("data: %p, %d, breakout: %d\n", &data, data, root->breakout);
-    printf("node[0] size: %lu\n", buffer_size(root->nodes[0].inbox));
-    printf("node[1] size: %lu\n", buffer_size(root->nodes[1].inbox));
-    printf("node[2] size: %lu\n", buffer_size(root->nodes[2].inbox));
-    printf("node[3] size: %lu\n", buffer_size(root->nodes[3].inbox));
-    printf("node[4] size: %lu\n", buffer_size(root->nodes[4].inbox));
-    printf("node[5] size: %lu\n", buffer_size(root->nodes[5].inbox));
-    printf("node[6] size: %lu\n", buffer_size(root->nodes[6].inbox));
-    printf("task size: %lu\n", buffer_size(root->task));
+    ACTOR_STATS stats; ACTOR_STAT top[4]; size_t n = 0, k = 0;
+
+    actor_stats(root, &stats);
+    n = actor_top(root, top, 4);
+
+    printf("scheduler: task depth %llu, %llu dispatches, %llu steals, %llu parks, %llu unparks, %.3fus mean queue wait\n",
+        (unsigned long long)stats.taskdepth, (unsigned long long)stats.dispatches, (unsigned long long)stats.steals,
+        (unsigned long long)stats.parks, (unsigned long long)stats.unparks, stats.waits ? stats.waittime * 1e-3 / stats.waits : 0.0);
+
+    for (k = 0; k < n; ++k)
+        printf("actor %llx: depth %llu, received %llu, processed %llu, dropped %llu, %.6fs in callbacks\n", (unsigned long long)top[k].handle,
+            (unsigned long long)top[k].depth, (unsigned long long)top[k].received, (unsigned long long)top[k].processed,
+            (unsigned long long)top[k].dropped, top[k].cputime * 1e-9);
 
     actor_wait(root);
+    printf("ping pong: %d round trips in %.6fs, %lu message slabs\n", pingpong_count, pingpong_stop - start, (unsigned long)message_slabs());
 
     actor_clean(root);
+    message_clean();
 
-    return 0;
+    return failed ? 1 : 0;
 }
+#endif
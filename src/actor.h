@@ -2,27 +2,54 @@
 #define _ACTOR_H 1
 
 #include <stdint.h>
+#include <string.h>
 #include <pthread.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define loop_delay(cnt) do { size_t count = (cnt); while (count) --count; } while (0)
+#define HASH_GROUP 16
+#define HASH_MIGRATE 32
+#define HASH_KEYCLASSES 64
+
+enum {
+    HASH_EMPTY   = 0x00,
+    HASH_DELETED = 0x01
+};
+
+// A copy of the key, records are recycled per size class and only freed with the table,
+// so a lock-free reader holding a stale one still reads valid memory
+typedef struct hash_key {
+    struct hash_key *next;
+    size_t len;
+    char data[];
+} HASH_KEY;
 
 typedef struct hash_elem {
-    uint64_t volatile exist;
-    uint32_t volatile hash1;
-    uint32_t volatile hash2;
+    uint64_t volatile seq;
+    uint64_t volatile hash;
     void * volatile data;
-    pthread_spinlock_t lock;
-    uint64_t p1, p2, p3, p4;
-} __attribute__ ((aligned(8))) HASH_ELEM;
+    HASH_KEY * volatile key;
+} __attribute__ ((aligned(32))) HASH_ELEM;
 
-typedef struct hash_table {
-    uint32_t table[1280];
+typedef struct hash_array {
+    uint8_t volatile *tags;
     HASH_ELEM *elems;
     uint64_t size;
+    uint64_t count;
+    uint64_t used;
+    struct hash_array *next;
+} __attribute__ ((aligned(8))) HASH_ARRAY;
+
+typedef struct hash_table {
+    HASH_ARRAY * volatile current;
+    HASH_ARRAY * volatile previous;
+    HASH_ARRAY *retired;
+    HASH_KEY *keys[HASH_KEYCLASSES];
+    uint64_t migrate;
+    uint64_t seed;
+    pthread_spinlock_t lock;
 } __attribute__ ((aligned(8))) HASH_TABLE;
 
 enum {
@@ -34,30 +61,45 @@ enum {
 
 HASH_TABLE *hash_init(uint64_t size);
 
-uint32_t hash_string(const HASH_TABLE *htable, const char *str, uint32_t type);
+uint64_t hash_bytes(const HASH_TABLE *htable, const void *key, size_t len);
 
-void *hash_table(const HASH_TABLE *htable, const char *key, void *data, int action);
+#define hash_string(htable, str) hash_bytes(htable, str, strlen(str))
+
+void *hash_tablek(HASH_TABLE *htable, const void *key, size_t len, void *data, int action);
+
+#define hash_table(htable, key, data, action) hash_tablek(htable, key, strlen(key), data, action)
 
 #define hash_find(htable, key) hash_table(htable, key, NULL, HTABLE_FIND)
 #define hash_set(htable, key, data) hash_table(htable, key, data, HTABLE_SET)
 #define hash_create(htable, key, data) hash_table(htable, key, data, HTABLE_CREATE)
 #define hash_delete(htable, key) hash_table(htable, key, NULL, HTABLE_DELETE)
 
+#define hash_findk(htable, key, len) hash_tablek(htable, key, len, NULL, HTABLE_FIND)
+#define hash_setk(htable, key, len, data) hash_tablek(htable, key, len, data, HTABLE_SET)
+#define hash_createk(htable, key, len, data) hash_tablek(htable, key, len, data, HTABLE_CREATE)
+#define hash_deletek(htable, key, len) hash_tablek(htable, key, len, NULL, HTABLE_DELETE)
+
+uint64_t hash_count(HASH_TABLE *htable);
+
 void hash_clean(HASH_TABLE *htable);
 
 typedef struct ring_elem {
+    uint64_t volatile seq;
     void * volatile data;
-    uint64_t p1, p2, p3, p4, p5, p6, p7;
-} __attribute__ ((aligned(8))) RING_ELEM;
+    uint64_t p1, p2, p3, p4, p5, p6;
+} __attribute__ ((aligned(64))) RING_ELEM;
 
 typedef struct ring_buffer {
     uint64_t size;
     RING_ELEM *elems;
-    uint64_t volatile read;
+    uint64_t p1, p2, p3, p4, p5, p6;
+
     uint64_t volatile write;
-    uint64_t volatile valid;
-    uint64_t p1, p2, p3;
-} __attribute__ ((aligned(8))) RING_BUFFER;
+    uint64_t p7, p8, p9, p10, p11, p12, p13;
+
+    uint64_t volatile read;
+    uint64_t p14, p15, p16, p17, p18, p19, p20;
+} __attribute__ ((aligned(64))) RING_BUFFER;
 
 RING_BUFFER *buffer_init(uint64_t size);
 
@@ -66,51 +108,369 @@ int buffer_write(RING_BUFFER *buffer, void *data);
 int buffer_read(RING_BUFFER *buffer, void **data);
 
 static inline uint64_t buffer_size(RING_BUFFER *buffer) {
-    return buffer->valid - buffer->read;
+    uint64_t read = __atomic_load_n(&buffer->read, __ATOMIC_ACQUIRE);
+    uint64_t write = __atomic_load_n(&buffer->write, __ATOMIC_ACQUIRE);
+
+    return write > read ? write - read : 0;
 }
 
 void buffer_clean(RING_BUFFER *buffer);
 
+#define MAILBOX_SLOTS 62
+
+// Bit i of marks flags slot i as a runtime envelope instead of user data, any pointer value stays legal
+typedef struct mailbox_segment {
+    struct mailbox_segment * volatile next;
+    uint64_t volatile marks;
+    void * volatile slots[MAILBOX_SLOTS];
+} __attribute__ ((aligned(64))) MAILBOX_SEGMENT;
+
+typedef struct mailbox_notify {
+    struct mailbox_notify *next;
+    uint64_t waiter;
+    void *token;
+} MAILBOX_NOTIFY;
+
+// Notify records are recycled here too, there is at most one per blocked send so that list needs no cap
+typedef struct mailbox_pool {
+    pthread_spinlock_t lock;
+    MAILBOX_SEGMENT *free;
+    uint64_t count;
+    uint64_t max;
+    MAILBOX_NOTIFY *notifies;
+} __attribute__ ((aligned(64))) MAILBOX_POOL;
+
+typedef struct mailbox {
+    MAILBOX_POOL *pool;
+    uint64_t size;
+    uint64_t p1, p2, p3, p4, p5, p6;
+
+    pthread_spinlock_t lock;
+    MAILBOX_SEGMENT *tail;
+    uint64_t tailpos;
+    uint64_t volatile write;
+    uint64_t p7, p8, p9, p10;
+
+    MAILBOX_SEGMENT *head;
+    uint64_t headpos;
+    uint64_t volatile read;
+    uint64_t p11, p12, p13, p14, p15;
+
+    uint32_t volatile space;
+    uint32_t volatile waiters;
+    MAILBOX_NOTIFY * volatile notify;
+    uint64_t p16, p17, p18, p19, p20, p21;
+} __attribute__ ((aligned(64))) MAILBOX;
+
+MAILBOX_POOL *mailbox_pool(uint64_t max);
+
+void mailbox_release(MAILBOX_POOL *pool);
+
+MAILBOX *mailbox_init(MAILBOX_POOL *pool, uint64_t size);
+
+int mailbox_write(MAILBOX *mailbox, void *data);
+
+int mailbox_read(MAILBOX *mailbox, void **data);
+
+int mailbox_wait(MAILBOX *mailbox, uint64_t timeout);
+
+int mailbox_notify(MAILBOX *mailbox, uint64_t waiter, void *token);
+
+MAILBOX_NOTIFY *mailbox_notified(MAILBOX *mailbox);
+
+// Give a list taken with mailbox_notified back to the pool once it has been handled
+void mailbox_unnotify(MAILBOX *mailbox, MAILBOX_NOTIFY *notify);
+
+static inline uint64_t mailbox_size(MAILBOX *mailbox) {
+    uint64_t read = __atomic_load_n(&mailbox->read, __ATOMIC_ACQUIRE);
+    uint64_t write = __atomic_load_n(&mailbox->write, __ATOMIC_ACQUIRE);
+
+    return write > read ? write - read : 0;
+}
+
+void mailbox_reset(MAILBOX *mailbox);
+
+void mailbox_clean(MAILBOX *mailbox);
+
+#define MESSAGE_INLINE 32
+#define MESSAGE_PERSLAB 64
+#define MESSAGE_BATCH 32
+
+typedef struct message_blob {
+    uint64_t volatile refs;
+    size_t size;
+    char data[];
+} MESSAGE_BLOB;
+
+typedef struct message {
+    struct message *next;
+    struct message_cache *owner;
+    uint32_t type;
+    uint32_t size;
+    MESSAGE_BLOB *blob;
+    char payload[MESSAGE_INLINE];
+} __attribute__ ((aligned(64))) MESSAGE;
+
+// Every thread allocates from its own cache, frees from other threads come back in batches on remote
+typedef struct message_cache {
+    MESSAGE *free;
+    struct message_slab *slabs;
+    struct message_cache *next;
+    struct message_cache *spare;
+    uint64_t p2, p3, p4, p5;
+
+    MESSAGE * volatile remote;
+    uint64_t p6, p7, p8, p9, p10, p11, p12;
+} __attribute__ ((aligned(64))) MESSAGE_CACHE;
+
+MESSAGE_BLOB *blob_alloc(size_t size);
+
+MESSAGE_BLOB *blob_ref(MESSAGE_BLOB *blob);
+
+void blob_free(MESSAGE_BLOB *blob);
+
+MESSAGE *message_alloc(uint32_t type, const void *payload, size_t size);
+
+MESSAGE *message_blob(uint32_t type, MESSAGE_BLOB *blob);
+
+#define message_data(message) ((message)->blob != NULL ? (void *)(message)->blob->data : (void *)(message)->payload)
+
+void message_free(MESSAGE *message);
+
+void message_flush(void);
+
+// A thread about to exit leaves its cache to the next thread that attaches, slabs and frees included
+void message_detach(void);
+
+void message_clean(void);
+
 typedef struct actor_root ACTOR_ROOT;
 
 typedef void (*ACTOR_CB)(struct actor_root *root, void *data);
 
+typedef void (*ACTOR_BATCH_CB)(struct actor_root *root, void **data, size_t count);
+
+typedef void (*ACTOR_RELEASE)(void *data);
+
+// One envelope is shared by every subscriber of a publish, its mailbox slot is marked so the worker unwraps it
+typedef struct actor_envelope {
+    uint64_t volatile refs;
+    void *data;
+    ACTOR_RELEASE release;
+} ACTOR_ENVELOPE;
+
+typedef struct actor_topic {
+    struct actor_topic *next;
+    pthread_spinlock_t lock;
+    uint64_t *subscribers;
+    uint32_t count;
+    uint32_t size;
+} __attribute__ ((aligned(64))) ACTOR_TOPIC;
+
+enum {
+    ACTOR_POOLROUND,
+    ACTOR_POOLLEAST,
+    ACTOR_POOLHASH
+};
+
+// Replicas of a pool share one cb and hold no state of their own, each still drains its mailbox serially.
+// Removed replicas are marked retiring and delete themselves once their backlog has run out
+typedef struct actor_pool {
+    struct actor_pool *next;
+    pthread_spinlock_t lock;
+    ACTOR_CB cb;
+    int policy;
+    uint64_t *replicas;
+    uint32_t count;
+    uint32_t size;
+    uint64_t cursor;
+} __attribute__ ((aligned(64))) ACTOR_POOL;
+
+// Generation in the high half, slot index in the low half, zero is never a valid handle
+typedef uint64_t ACTOR_HANDLE;
+
+// Each class has its own run queues, a lower value is served first
+enum {
+    ACTOR_PRIOHIGH,
+    ACTOR_PRIONORMAL,
+    ACTOR_PRIOLOW,
+    ACTOR_PRIOCLASSES
+};
+
+#define ACTOR_NOSLOT 0xffffffffU
+
 typedef struct actor_node {
     uint64_t volatile status;
     ACTOR_CB volatile cb;
-    RING_BUFFER *inbox;
-    uint64_t p1, p2, p3, p4, p5;
+    MAILBOX *inbox;
+    uint32_t volatile generation;
+    uint32_t volatile next;
+    ACTOR_BATCH_CB volatile batch;
+    uint64_t volatile queued;
+    int volatile priority;
+
+    // Only the running worker writes processed and cputime, received is processed plus the backlog
+    uint64_t volatile dropped;
+    uint64_t volatile processed;
+    uint64_t volatile cputime;
 } __attribute__ ((aligned(8))) ACTOR_NODE;
 
+typedef struct actor_deque {
+    int64_t volatile top;
+    uint64_t p1, p2, p3, p4, p5, p6, p7;
+
+    int64_t volatile bottom;
+    uint64_t p8, p9, p10, p11, p12, p13, p14;
+
+    uint64_t size;
+    struct actor_node * volatile *elems;
+} __attribute__ ((aligned(64))) ACTOR_DEQUE;
+
+typedef struct actor_worker {
+    ACTOR_DEQUE deque[ACTOR_PRIOCLASSES];
+
+    struct actor_root *root;
+    pthread_t thread;
+    size_t index;
+    uint64_t seed;
+
+    uint32_t volatile parked;
+    int volatile state;
+    struct actor_node *running;
+
+    // Dispatches each class may still take this round, refilled from the root weights
+    uint32_t credits[ACTOR_PRIOCLASSES];
+
+    int cpu;
+    int numa;
+
+    // Owner written with relaxed stores, summed by actor_stats
+    uint64_t volatile dispatches;
+    uint64_t volatile steals;
+    uint64_t volatile parks;
+    uint64_t volatile unparks;
+    uint64_t volatile waits;
+    uint64_t volatile waittime;
+} __attribute__ ((aligned(64))) ACTOR_WORKER;
+
+#define ACTOR_TICK 1000000ULL
+#define ACTOR_WHEELBITS 6
+#define ACTOR_WHEELSIZE (1 << ACTOR_WHEELBITS)
+#define ACTOR_WHEELLEVELS 4
+#define ACTOR_MAXTIMER 4096
+
+// Generation in the high half, timer index in the low half, same scheme as actor handles
+typedef uint64_t ACTOR_TIMERID;
+
+typedef struct actor_timer {
+    struct actor_timer *next;
+    struct actor_timer **pprev;
+    uint64_t expire;
+    uint64_t period;
+    uint64_t target;
+    void *data;
+    uint32_t generation;
+    uint16_t level;
+    uint16_t slot;
+} ACTOR_TIMER;
+
+// Hierarchical wheel of ACTOR_WHEELLEVELS levels, each slot one tick of the level below it wide
+typedef struct actor_wheel {
+    pthread_spinlock_t lock;
+    uint64_t start;
+    uint64_t current;
+    uint64_t volatile count;
+    uint64_t volatile next;
+    uint64_t bitmap[ACTOR_WHEELLEVELS];
+    ACTOR_TIMER *slots[ACTOR_WHEELLEVELS][ACTOR_WHEELSIZE];
+    ACTOR_TIMER *timers;
+    ACTOR_TIMER *free;
+} ACTOR_WHEEL;
+
+enum {
+    ACTOR_ASKPENDING,
+    ACTOR_ASKDONE,
+    ACTOR_ASKTIMEOUT,
+    ACTOR_ASKFAILED
+};
+
+#define ACTOR_MAXFUTURE 4096
+
+// Status is ACTOR_ASKDONE with the reply, or ACTOR_ASKTIMEOUT / ACTOR_ASKFAILED with a NULL reply
+typedef void (*ACTOR_REPLY)(struct actor_root *root, void *reply, int status, void *ctx);
+
+// Pooled per root, one reference for the replier and one for whoever delivers the outcome
+typedef struct actor_future {
+    uint32_t volatile state;
+    uint32_t volatile waiting;
+    uint32_t volatile refs;
+    uint32_t volatile next;
+    void *request;
+    void *reply;
+    ACTOR_REPLY cb;
+    void *ctx;
+    uint64_t deadline;
+    ACTOR_TIMERID timer;
+    struct actor_future *expired;
+} __attribute__ ((aligned(64))) ACTOR_FUTURE;
+
 typedef struct actor_root {
     uint64_t volatile status;
     ACTOR_CB volatile cb;
-    RING_BUFFER *inbox;
+    MAILBOX *inbox;
     uint64_t p1, p2, p3, p4, p5;
 
     int volatile breakout;
 
     HASH_TABLE *nodestable;
+    HASH_TABLE *topicstable;
+    ACTOR_TOPIC * volatile topics;
+    HASH_TABLE *poolstable;
+    ACTOR_POOL * volatile pools;
     ACTOR_NODE *nodes;
+    uint64_t volatile freelist;
 
     size_t maxnode;
     size_t maxworker;
     size_t maxinbox;
-    RING_BUFFER *task;
-
-    pthread_t master;
-    pthread_mutex_t masterlock;
-    pthread_cond_t mastercond;
-
-    pthread_t *workers;
-    pthread_mutex_t workerlock;
-    pthread_cond_t workercond;
+    size_t budget;
+    MAILBOX_POOL *pool;
+    ACTOR_WHEEL *wheel;
+    RING_BUFFER *task[ACTOR_PRIOCLASSES];
+    uint32_t volatile weights[ACTOR_PRIOCLASSES];
+
+    ACTOR_FUTURE *futures;
+    uint64_t volatile futurelist;
+    ACTOR_RELEASE volatile release;
+
+    ACTOR_WORKER *workers;
+    int volatile running;
+    size_t volatile idlecnt;
+
+    // Elastic pool, only scales while minworker is below maxworker
+    size_t minworker;
+    size_t volatile workercnt;
+    size_t growdepth;
+    uint64_t growlatency;
+    uint64_t cooldown;
+    uint64_t volatile lastscale;
+    pthread_spinlock_t scalelock;
+    uint64_t volatile deepgrows;
+    uint64_t volatile lategrows;
+    uint64_t volatile retires;
 } __attribute__ ((aligned(8))) ACTOR_ROOT;
 
 enum {
     ACTOR_DEFAULT  = 0x01,
     ACTOR_RUNNABLE = 0x02,
-    ACTOR_RUNTASK  = 0x04
+    ACTOR_RUNTASK  = 0x04,
+    ACTOR_RETIRING = 0x08
+};
+
+enum {
+    ACTORW_STOPPED,
+    ACTORW_RUNNING,
+    ACTORW_RETIRED
 };
 
 enum {
@@ -131,17 +491,89 @@ enum {
     ACTORS_DELETE
 };
 
+enum {
+    ACTOR_SENDTRY,
+    ACTOR_SENDBLOCK,
+    ACTOR_SENDTIMED,
+    ACTOR_SENDNOTIFY
+};
+
 #define ACTOR_ROOTNAME "root"
 #define ACTOR_MAXNODE 1024
 #define ACTOR_MAXWORKER 4
 #define ACTOR_MAXINBOX 1024
+#define ACTOR_MAXSPIN 256
+#define ACTOR_BUDGET 64
+#define ACTOR_MAXBUDGET 1024
+#define ACTOR_GROWDEPTH 64
+#define ACTOR_GROWLATENCY 1000000ULL
+#define ACTOR_COOLDOWN 30000000000ULL
+#define ACTOR_SCALEGAP 1000000ULL
+#define ACTOR_WEIGHTHIGH 8
+#define ACTOR_WEIGHTNORMAL 4
+#define ACTOR_WEIGHTLOW 1
+
+typedef struct actor_scaling {
+    size_t workers;
+    size_t minworker;
+    size_t maxworker;
+    uint64_t deepgrows;
+    uint64_t lategrows;
+    uint64_t retires;
+} ACTOR_SCALING;
 
 ACTOR_ROOT *actor_init(const char *name, size_t maxnode, size_t maxworker, size_t maxinbox);
 
+// Pin worker i to cpus[i % count], only before actor_run, returns 0 when pinning is not supported
+int actor_affinity(ACTOR_ROOT *root, const int *cpus, size_t count);
+
+// NUMA node of a cpu, 0 when unknown
+int actor_cpunode(int cpu);
+
 #define actor_default() actor_init(ACTOR_ROOTNAME, ACTOR_MAXNODE, ACTOR_MAXWORKER, ACTOR_MAXINBOX)
 
 void actor_run(ACTOR_ROOT *root);
 
+// Run between minworker and maxworker threads, growing when the shared queue is deeper than depth or an
+// actor waited longer than latency ns for a worker, retiring a worker idle for cooldown ns, zero keeps defaults
+int actor_elastic(ACTOR_ROOT *root, size_t minworker, size_t depth, uint64_t latency, uint64_t cooldown);
+
+void actor_scaling(ACTOR_ROOT *root, ACTOR_SCALING *scaling);
+
+typedef struct actor_stat {
+    ACTOR_HANDLE handle;
+    uint64_t received;
+    uint64_t dropped;
+    uint64_t processed;
+    uint64_t depth;
+    uint64_t cputime;
+} ACTOR_STAT;
+
+typedef struct actor_stats {
+    uint64_t taskdepth;
+    uint64_t classdepth[ACTOR_PRIOCLASSES];
+    uint64_t dispatches;
+    uint64_t steals;
+    uint64_t parks;
+    uint64_t unparks;
+    uint64_t waits;
+    uint64_t waittime;
+} ACTOR_STATS;
+
+void actor_stats(ACTOR_ROOT *root, ACTOR_STATS *stats);
+
+// Fill top with up to count live actors ordered by backlog, deepest first, returns how many were filled
+size_t actor_top(ACTOR_ROOT *root, ACTOR_STAT *top, size_t count);
+
+void actor_budget(ACTOR_ROOT *root, size_t budget);
+
+// Under load every class gets weight dispatches per round, so low priority work slows down but never starves
+int actor_weights(ACTOR_ROOT *root, uint32_t high, uint32_t normal, uint32_t low);
+
+// Called with a notify mode message that can no longer be handed back, because its sender is gone or its
+// target was deleted first, so the caller can free it. NULL leaves such messages to the application
+void actor_release(ACTOR_ROOT *root, ACTOR_RELEASE release);
+
 ACTOR_NODE *actorn_manage(ACTOR_ROOT *root, ACTOR_NODE *node, ACTOR_CB cb, int action);
 
 #define actorn_find(root, node) actorn_manage(root, node, NULL, ACTORN_FIND)
@@ -151,8 +583,45 @@ ACTOR_NODE *actorn_manage(ACTOR_ROOT *root, ACTOR_NODE *node, ACTOR_CB cb, int a
 #define actorn_stop(root, node) actorn_manage(root, node, NULL, ACTORN_STOP)
 #define actorn_delete(root, node) actorn_manage(root, node, NULL, ACTORN_DELETE)
 
+int actorn_batch(ACTOR_ROOT *root, ACTOR_NODE *node, ACTOR_BATCH_CB batch);
+
+// Can change at any time, an actor already queued keeps its place and moves class on its next schedule
+int actorn_priority(ACTOR_ROOT *root, ACTOR_NODE *node, int priority);
+
 int actorn_send(ACTOR_ROOT *root, ACTOR_NODE *node, void *data);
 
+// Returns 1 once delivered and 0 on failure or timeout, in notify mode a full mailbox returns -1 and
+// the message is handed back to the calling actor as soon as there is room, ready to be sent again
+int actorn_sendmode(ACTOR_ROOT *root, ACTOR_NODE *node, void *data, int mode, uint64_t timeout);
+
+#define actorn_sendblock(root, node, data) actorn_sendmode(root, node, data, ACTOR_SENDBLOCK, 0)
+#define actorn_sendtimed(root, node, data, timeout) actorn_sendmode(root, node, data, ACTOR_SENDTIMED, timeout)
+#define actorn_sendnotify(root, node, data) actorn_sendmode(root, node, data, ACTOR_SENDNOTIFY, 0)
+
+ACTOR_HANDLE actorh_manage(ACTOR_ROOT *root, ACTOR_HANDLE handle, ACTOR_CB cb, int action);
+
+#define actorh_find(root, handle) actorh_manage(root, handle, NULL, ACTORN_FIND)
+#define actorh_set(root, handle, cb) actorh_manage(root, handle, cb, ACTORN_SET)
+#define actorh_create(root, cb) actorh_manage(root, 0, cb, ACTORN_CREATE)
+#define actorh_start(root, handle) actorh_manage(root, handle, NULL, ACTORN_START)
+#define actorh_stop(root, handle) actorh_manage(root, handle, NULL, ACTORN_STOP)
+#define actorh_delete(root, handle) actorh_manage(root, handle, NULL, ACTORN_DELETE)
+
+ACTOR_NODE *actorh_node(ACTOR_ROOT *root, ACTOR_HANDLE handle);
+
+ACTOR_HANDLE actorh_handle(ACTOR_ROOT *root, ACTOR_NODE *node);
+
+int actorh_priority(ACTOR_ROOT *root, ACTOR_HANDLE handle, int priority);
+
+// The generation is checked again under the inbox lock, a handle whose actor is deleted mid-send just fails
+int actorh_send(ACTOR_ROOT *root, ACTOR_HANDLE handle, void *data);
+
+int actorh_sendmode(ACTOR_ROOT *root, ACTOR_HANDLE handle, void *data, int mode, uint64_t timeout);
+
+#define actorh_sendblock(root, handle, data) actorh_sendmode(root, handle, data, ACTOR_SENDBLOCK, 0)
+#define actorh_sendtimed(root, handle, data, timeout) actorh_sendmode(root, handle, data, ACTOR_SENDTIMED, timeout)
+#define actorh_sendnotify(root, handle, data) actorh_sendmode(root, handle, data, ACTOR_SENDNOTIFY, 0)
+
 int actors_manage(ACTOR_ROOT *root, const char *name, ACTOR_CB cb, int action);
 
 #define actors_find(root, name) actors_manage(root, name, NULL, ACTORS_FIND)
@@ -162,10 +631,56 @@ int actors_manage(ACTOR_ROOT *root, const char *name, ACTOR_CB cb, int action);
 #define actors_stop(root, name) actors_manage(root, name, NULL, ACTORS_STOP)
 #define actors_delete(root, name) actors_manage(root, name, NULL, ACTORS_DELETE)
 
+int actors_batch(ACTOR_ROOT *root, const char *name, ACTOR_BATCH_CB batch);
+
+int actors_priority(ACTOR_ROOT *root, const char *name, int priority);
+
 int actors_send(ACTOR_ROOT *root, const char *name, void *data);
 
+int actors_sendmode(ACTOR_ROOT *root, const char *name, void *data, int mode, uint64_t timeout);
+
+#define actors_sendblock(root, name, data) actors_sendmode(root, name, data, ACTOR_SENDBLOCK, 0)
+#define actors_sendtimed(root, name, data, timeout) actors_sendmode(root, name, data, ACTOR_SENDTIMED, timeout)
+#define actors_sendnotify(root, name, data) actors_sendmode(root, name, data, ACTOR_SENDNOTIFY, 0)
+
+// Keyed sends to a hash pool keep one key on one replica, any other target ignores the key
+int actors_sendkey(ACTOR_ROOT *root, const char *name, uint64_t key, void *data, int mode, uint64_t timeout);
+
 int actor_broadcast(ACTOR_ROOT *root, void *data);
 
+// Delays and periods are in nanoseconds, rounded up to whole ACTOR_TICKs
+ACTOR_TIMERID actor_send_after(ACTOR_ROOT *root, ACTOR_HANDLE target, void *data, uint64_t delay);
+
+ACTOR_TIMERID actor_send_every(ACTOR_ROOT *root, ACTOR_HANDLE target, void *data, uint64_t period);
+
+int actor_cancel(ACTOR_ROOT *root, ACTOR_TIMERID timer);
+
+// The target receives the future itself as its message, reads actor_request and answers with actor_reply.
+// With a cb the outcome is delivered to it, on the replying worker or the timer, so it should stay short;
+// without one the asker collects it with actor_get. Timeout is in nanoseconds, zero waits forever.
+// Returns NULL when the target does not take the ask, an ask left queued on a deleted target fails
+ACTOR_FUTURE *actor_ask(ACTOR_ROOT *root, ACTOR_HANDLE target, void *request, uint64_t timeout, ACTOR_REPLY cb, void *ctx);
+
+#define actor_request(future) ((future)->request)
+
+// Returns 1 when the reply made it in time, 0 when the asker already gave up
+int actor_reply(ACTOR_ROOT *root, ACTOR_FUTURE *future, void *reply);
+
+// Block for a future asked without cb, returns its final state and releases it
+int actor_get(ACTOR_ROOT *root, ACTOR_FUTURE *future, void **reply);
+
+int actor_subscribe(ACTOR_ROOT *root, const char *topic, ACTOR_HANDLE handle);
+
+int actor_unsubscribe(ACTOR_ROOT *root, const char *topic, ACTOR_HANDLE handle);
+
+int actor_publish(ACTOR_ROOT *root, const char *topic, void *data, ACTOR_RELEASE release);
+
+// The name is shared with plain actors, actors_send and actors_sendmode route to a replica by the policy
+int actor_pool(ACTOR_ROOT *root, const char *name, ACTOR_CB cb, size_t replicas, int policy);
+
+// Adds or removes replicas at the tail, so a hash pool only remaps the keys of the replicas that changed
+int actor_pool_resize(ACTOR_ROOT *root, const char *name, size_t replicas);
+
 void actor_wait(ACTOR_ROOT *root);
 
 void actor_break(ACTOR_ROOT *root);
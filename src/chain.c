@@ -0,0 +1,362 @@
+#include <stdlib.h>
+#include <string.h>
+#include "chain.h"
+
+static CHAIN_BLOCK *block_alloc(size_t size) {
+    CHAIN_BLOCK *block = (CHAIN_BLOCK *)malloc(sizeof(CHAIN_BLOCK) + size);
+    if (block == NULL) return NULL;
+
+    block->refs = 1;
+    block->size = size;
+    block->used = 0;
+
+    return block;
+}
+
+static void block_release(CHAIN_BLOCK *block) {
+    if (__atomic_sub_fetch(&block->refs, 1, __ATOMIC_ACQ_REL) == 0) free(block);
+}
+
+static CHAIN_SLICE *chain_push(CHAIN *chain, CHAIN_BLOCK *block, size_t offset, size_t length) {
+    CHAIN_SLICE *slice = NULL;
+
+    // Consumed slices at the front are reused before the array grows
+    if (chain->count == chain->size && chain->head > 0) {
+        memmove(chain->slices, chain->slices + chain->head, sizeof(CHAIN_SLICE) * (chain->count - chain->head));
+        chain->count -= chain->head;
+        chain->head = 0;
+    } else if (chain->count == chain->size) {
+        slice = (CHAIN_SLICE *)realloc(chain->slices, sizeof(CHAIN_SLICE) * (chain->size ? chain->size * 2 : 8));
+        if (slice == NULL) return NULL;
+
+        chain->slices = slice;
+        chain->size = chain->size ? chain->size * 2 : 8;
+    }
+
+    slice = chain->slices + chain->count++;
+    slice->block = block;
+    slice->offset = offset;
+    slice->length = length;
+
+    return slice;
+}
+
+// Only a block nobody else holds and whose written end is this chain's tail may take more bytes
+static CHAIN_SLICE *chain_tail(CHAIN *chain) {
+    CHAIN_SLICE *slice = NULL;
+
+    if (chain->count == chain->head) return NULL;
+
+    slice = chain->slices + chain->count - 1;
+
+    if (__atomic_load_n(&slice->block->refs, __ATOMIC_ACQUIRE) != 1 || slice->offset + slice->length != slice->block->used)
+        return NULL;
+
+    return slice;
+}
+
+CHAIN *chain_init(void) {
+    CHAIN *chain = (CHAIN *)malloc(sizeof(CHAIN));
+    if (chain == NULL) return NULL;
+
+    memset(chain, 0, sizeof(CHAIN));
+
+    return chain;
+}
+
+int chain_append(CHAIN *chain, const void *data, size_t len) {
+    size_t room = 0, size = 0; char *tail = NULL;
+
+    if (chain == NULL || (data == NULL && len > 0)) return 0;
+
+    while (len > 0) {
+        if ((tail = (char *)chain_reserve(chain, &room)) == NULL) return 0;
+
+        size = room < len ? room : len;
+        memcpy(tail, data, size);
+        chain_commit(chain, size);
+
+        data = (const char *)data + size;
+        len -= size;
+    }
+
+    return 1;
+}
+
+void *chain_reserve(CHAIN *chain, size_t *room) {
+    CHAIN_SLICE *slice = NULL; CHAIN_BLOCK *block = NULL;
+
+    if (chain == NULL) return NULL;
+
+    if ((slice = chain_tail(chain)) != NULL && slice->block->used < slice->block->size) {
+        block = slice->block;
+    } else {
+        if ((block = block_alloc(CHAIN_BLOCKSIZE)) == NULL) return NULL;
+
+        if (chain_push(chain, block, 0, 0) == NULL) {
+            free(block);
+            return NULL;
+        }
+    }
+
+    if (room != NULL) *room = block->size - block->used;
+
+    return block->data + block->used;
+}
+
+void chain_commit(CHAIN *chain, size_t len) {
+    CHAIN_SLICE *slice = NULL;
+
+    if (chain == NULL || len == 0 || chain->count == chain->head) return;
+
+    slice = chain->slices + chain->count - 1;
+    slice->length += len;
+    slice->block->used += len;
+    chain->length += len;
+}
+
+// dst is left as it was when a slice cannot be pushed, so a failed call never hands on half a range
+int chain_slice(CHAIN *dst, CHAIN *src, size_t offset, size_t len) {
+    CHAIN_SLICE *slice = NULL, *last = NULL; size_t size = 0, length = 0, widened = 0; uint32_t i = 0, added = 0;
+
+    if (dst == NULL || src == NULL || dst == src || offset + len > src->length) return 0;
+
+    length = dst->length;
+
+    for (i = src->head; i < src->count && len > 0; ++i) {
+        slice = src->slices + i;
+
+        if (offset >= slice->length) {
+            offset -= slice->length;
+            continue;
+        }
+
+        size = slice->length - offset < len ? slice->length - offset : len;
+        last = dst->count > dst->head ? dst->slices + dst->count - 1 : NULL;
+
+        // Ranges that continue the last slice in the same block just widen it
+        if (last != NULL && last->block == slice->block && last->offset + last->length == slice->offset + offset) {
+            last->length += size;
+            if (added == 0) widened += size;
+        } else {
+            if (chain_push(dst, slice->block, slice->offset + offset, size) == NULL) break;
+
+            __atomic_add_fetch(&slice->block->refs, 1, __ATOMIC_RELAXED);
+            ++added;
+        }
+
+        dst->length += size;
+        len -= size;
+        offset = 0;
+    }
+
+    if (len == 0) return 1;
+
+    // Compaction in chain_push may have moved dst, but what this call added is always at the end
+    for (; added > 0; --added)
+        block_release(dst->slices[--dst->count].block);
+
+    if (widened) dst->slices[dst->count - 1].length -= widened;
+
+    dst->length = length;
+
+    return 0;
+}
+
+size_t chain_consume(CHAIN *chain, size_t len) {
+    CHAIN_SLICE *slice = NULL; size_t done = 0, size = 0;
+
+    if (chain == NULL) return 0;
+
+    while (chain->head < chain->count && done < len) {
+        slice = chain->slices + chain->head;
+        size = slice->length < len - done ? slice->length : len - done;
+
+        slice->offset += size;
+        slice->length -= size;
+        done += size;
+
+        if (slice->length > 0) break;
+
+        // A drained tail we still own is rewound instead of freed, the next recv lands in the same block
+        if (chain->head + 1 == chain->count && chain_tail(chain) == slice) {
+            slice->block->used = 0;
+            slice->offset = 0;
+            break;
+        }
+
+        block_release(slice->block);
+        ++chain->head;
+    }
+
+    if (chain->head == chain->count) chain->head = chain->count = 0;
+
+    chain->length -= done;
+
+    return done;
+}
+
+int chain_iovec(CHAIN *chain, SOCKET_IOVEC *vec, int max) {
+    uint32_t i = 0; int count = 0;
+
+    if (chain == NULL || vec == NULL) return 0;
+
+    for (i = chain->head; i < chain->count && count < max; ++i)
+        if (chain->slices[i].length > 0) {
+            socket_iovec(vec + count, chain->slices[i].block->data + chain->slices[i].offset, chain->slices[i].length);
+            ++count;
+        }
+
+    return count;
+}
+
+ssize_t chain_recv(int fd, CHAIN *chain, int *ignore) {
+    size_t room = 0; ssize_t len = 0; void *tail = chain_reserve(chain, &room);
+
+    if (tail == NULL) return SOCKET_ERROR;
+
+    len = socket_recv(fd, tail, room, 0, ignore);
+    if (len > 0) chain_commit(chain, len);
+
+    return len;
+}
+
+ssize_t chain_send(int fd, CHAIN *chain, int *ignore) {
+    SOCKET_IOVEC vec[CHAIN_MAXIOV]; ssize_t len = 0; int count = chain_iovec(chain, vec, CHAIN_MAXIOV);
+
+    if (count == 0) return 0;
+
+    len = socket_sendv(fd, vec, count, 0, ignore);
+    if (len > 0) chain_consume(chain, len);
+
+    return len;
+}
+
+void chain_reset(CHAIN *chain) {
+    uint32_t i = 0; if (chain == NULL) return;
+
+    for (i = chain->head; i < chain->count; ++i)
+        block_release(chain->slices[i].block);
+
+    chain->head = chain->count = 0;
+    chain->length = 0;
+}
+
+void chain_clean(CHAIN *chain) {
+    if (chain == NULL) return;
+
+    chain_reset(chain);
+
+    free(chain->slices);
+    free(chain);
+}
+
+#ifdef CHAIN_TEST
+// Demo program, build with -DCHAIN_TEST socket.c to run it
+#include <stdio.h>
+#include <unistd.h>
+
+static int chain_equal(CHAIN *chain, const char *data, size_t len) {
+    uint32_t i = 0; size_t done = 0;
+
+    if (chain_length(chain) != len) return 0;
+
+    for (i = chain->head; i < chain->count; ++i) {
+        if (memcmp(chain->slices[i].block->data + chain->slices[i].offset, data + done, chain->slices[i].length) != 0) return 0;
+        done += chain->slices[i].length;
+    }
+
+    return done == len;
+}
+
+// Adjacent ranges of one block share a single slice, and the shared block stops taking appends
+int slice_test(void) {
+    CHAIN *src = chain_init(), *dst = chain_init(); int failed = 0;
+
+    chain_append(src, "hello world, hello chain", 24);
+
+    if (!chain_slice(dst, src, 0, 5) || !chain_slice(dst, src, 5, 6)) failed = 1;
+    if (dst->count - dst->head != 1 || !chain_equal(dst, "hello world", 11) || src->slices[0].block->refs != 2) failed = 1;
+    if (chain_slice(dst, src, 20, 5)) failed = 1;
+
+    chain_append(src, "!", 1);
+    chain_append(dst, "?", 1);
+
+    if (src->count != 2 || dst->count - dst->head != 2 || src->slices[0].block->used != 24) failed = 1;
+    if (!chain_equal(src, "hello world, hello chain!", 25) || !chain_equal(dst, "hello world?", 12)) failed = 1;
+
+    printf("slice: %u and %u slices over shared blocks, %s\n", src->count - src->head, dst->count - dst->head, failed ? "failed" : "ok");
+
+    chain_clean(src);
+    chain_clean(dst);
+
+    return !failed;
+}
+
+// A tail only this chain holds is rewound once drained, the next bytes land in the same block
+int rewind_test(void) {
+    CHAIN *chain = chain_init(); CHAIN_BLOCK *block = NULL; int failed = 0;
+
+    chain_append(chain, "drained", 7);
+    block = chain->slices[chain->head].block;
+
+    if (chain_consume(chain, 7) != 7 || chain_length(chain) != 0 || block->used != 0) failed = 1;
+
+    chain_append(chain, "again", 5);
+
+    if (chain->slices[chain->head].block != block || chain->count - chain->head != 1 || !chain_equal(chain, "again", 5)) failed = 1;
+
+    printf("rewind: tail block reused after drain, %s\n", failed ? "failed" : "ok");
+
+    chain_clean(chain);
+
+    return !failed;
+}
+
+// A socket that takes less than the whole chain leaves the rest queued, in order
+int send_test(size_t size) {
+    CHAIN *chain = chain_init(); char *data = (char *)malloc(size), *seen = (char *)malloc(size);
+    size_t i = 0, got = 0; ssize_t len = 0; int fds[2], ignore = 0, failed = 0, partial = 0;
+
+    for (i = 0; i < size; ++i) data[i] = (char)(i * 31 + 7);
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    socket_setasync(fds[0]);
+
+    chain_append(chain, data, size);
+
+    while (got < size && !failed) {
+        if (chain_length(chain) > 0) {
+            len = chain_send(fds[0], chain, &ignore);
+
+            if (len < 0 && !ignore) failed = 1;
+            if (len > 0 && chain_length(chain) > 0) ++partial;
+        }
+
+        if ((len = socket_recv(fds[1], seen + got, size - got, 0, &ignore)) > 0) got += len;
+        else failed = 1;
+    }
+
+    if (got != size || chain_length(chain) != 0 || partial == 0 || memcmp(data, seen, size) != 0) failed = 1;
+
+    printf("send: %zu bytes in %u byte blocks, %d partial sends, %s\n", size, CHAIN_BLOCKSIZE, partial, failed ? "failed" : "ok");
+
+    close(fds[0]);
+    close(fds[1]);
+    chain_clean(chain);
+    free(data);
+    free(seen);
+
+    return !failed;
+}
+
+int main(int argc, char **argv) {
+    int failed = 0;
+
+    failed |= !slice_test();
+    failed |= !rewind_test();
+    failed |= !send_test(4 << 20);
+
+    return failed ? 1 : 0;
+}
+#endif
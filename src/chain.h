@@ -0,0 +1,73 @@
+#ifndef _CHAIN_H
+#define _CHAIN_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+#include "socket.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHAIN_BLOCKSIZE (1024 << 4)
+#define CHAIN_MAXIOV 64
+
+// Bytes live in refcounted blocks, a block only takes appends while a single chain holds it
+typedef struct chain_block {
+    uint64_t volatile refs;
+    size_t size;
+    size_t used;
+    char data[];
+} CHAIN_BLOCK;
+
+typedef struct chain_slice {
+    CHAIN_BLOCK *block;
+    size_t offset;
+    size_t length;
+} CHAIN_SLICE;
+
+// A chain belongs to one thread at a time and travels as a plain pointer, through actor messages or
+// across loops. Slices share blocks with other chains, so handing bytes on never copies them
+typedef struct chain {
+    CHAIN_SLICE *slices;
+    uint32_t head;
+    uint32_t count;
+    uint32_t size;
+    size_t length;
+} CHAIN;
+
+CHAIN *chain_init(void);
+
+#define chain_length(chain) ((chain)->length)
+
+// Copies into the owned tail block, a new block is started when the tail is shared or full
+int chain_append(CHAIN *chain, const void *data, size_t len);
+
+// Hands out the writable room behind the tail so recv can fill it in place, chain_commit publishes it
+void *chain_reserve(CHAIN *chain, size_t *room);
+
+void chain_commit(CHAIN *chain, size_t len);
+
+// Appends a view of len bytes of src starting at offset to dst, both keep their own reference.
+// Returns 0 with dst unchanged when the range is out of bounds or the slice array cannot grow
+int chain_slice(CHAIN *dst, CHAIN *src, size_t offset, size_t len);
+
+// Drops len bytes from the front, blocks are released as soon as no slice points into them
+size_t chain_consume(CHAIN *chain, size_t len);
+
+int chain_iovec(CHAIN *chain, SOCKET_IOVEC *vec, int max);
+
+ssize_t chain_recv(int fd, CHAIN *chain, int *ignore);
+
+// Writes as much as the socket takes in one socket_sendv and consumes it
+ssize_t chain_send(int fd, CHAIN *chain, int *ignore);
+
+void chain_reset(CHAIN *chain);
+
+void chain_clean(CHAIN *chain);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,7 +1,15 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #include <stdlib.h>
+#include <errno.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include "socket.h"
 #include "event.h"
 
 static inline double now_time(void) {
@@ -12,6 +20,14 @@ static inline double now_time(void) {
     return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
+static inline uint64_t now_nsec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 #define MALLOC_PAGE 4096
 
 #define array_alloc(type, base, cur, cnt) do { if ((cnt) > (cur)) { int old = cur; (base) = (type *)array_realloc(sizeof(type), (base), &(cur), (cnt)); memset((base) + (old), 0, sizeof(type) * ((cur) - (old))); } } while(0)
@@ -127,6 +143,82 @@ static inline void timer_update(EVENT_LOOP *loop, double maxtime) {
     loop->hit_now = loop->run_now;
 }
 
+#if EVENT_TRACE_LEVEL > 0
+static inline void trace_write(EVENT_LOOP *loop, int type, int a, int b, int c) {
+    if (loop->traces == NULL) return;
+
+    EVENT_TRACE *trace = loop->traces + (loop->tracecnt & (EVENT_TRACE_SIZE - 1));
+
+    trace->time = now_nsec();
+    trace->type = type;
+    trace->a = a;
+    trace->b = b;
+    trace->c = c;
+
+    __atomic_store_n(&loop->tracecnt, loop->tracecnt + 1, __ATOMIC_RELEASE);
+}
+
+#define event_trace(loop, level, type, a, b, c) do { if ((level) <= EVENT_TRACE_LEVEL) trace_write((loop), (type), (a), (b), (c)); } while(0)
+#else
+#define event_trace(loop, level, type, a, b, c) do { } while(0)
+#endif
+
+#define profile_store(ptr, value) __atomic_store_n(ptr, value, __ATOMIC_RELAXED)
+#define profile_load(ptr) __atomic_load_n(ptr, __ATOMIC_RELAXED)
+
+static inline uint64_t profile_phase(EVENT_PROFILE *profile, int phase, uint64_t stamp) {
+    uint64_t now = now_nsec(), cost = now - stamp;
+
+    profile_store(&profile->total[phase], profile->total[phase] + cost);
+    profile_store(&profile->last[phase], cost);
+    if (cost > profile->max[phase]) profile_store(&profile->max[phase], cost);
+
+    return now;
+}
+
+static inline void profile_iteration(EVENT_PROFILE *profile, uint64_t busy, int ready, int pending) {
+    profile_store(&profile->total[EVENT_PHASE_BUSY], profile->total[EVENT_PHASE_BUSY] + busy);
+    profile_store(&profile->last[EVENT_PHASE_BUSY], busy);
+    if (busy > profile->max[EVENT_PHASE_BUSY]) profile_store(&profile->max[EVENT_PHASE_BUSY], busy);
+
+    profile_store(&profile->readys, profile->readys + ready);
+    profile_store(&profile->lastready, ready);
+    if (ready > profile->maxready) profile_store(&profile->maxready, ready);
+
+    profile_store(&profile->pendings, profile->pendings + pending);
+    profile_store(&profile->lastpending, pending);
+    if (pending > profile->maxpending) profile_store(&profile->maxpending, pending);
+
+    profile_store(&profile->iterations, profile->iterations + 1);
+}
+
+static inline void profile_callback(EVENT_PROFILE *profile, void *cb, uint64_t cost) {
+    uintptr_t key = (uintptr_t)cb;
+    int slot = (int)((key >> 4) ^ (key >> 12)) & (EVENT_PROFILE_SLOTS - 1), i = 0;
+    EVENT_CALLBACK *callback = NULL;
+
+    for (i = 0; i < EVENT_PROFILE_SLOTS; ++i) {
+        callback = profile->callbacks + ((slot + i) & (EVENT_PROFILE_SLOTS - 1));
+
+        if (callback->cb == cb) break;
+
+        if (callback->cb == NULL) {
+            profile_store(&callback->cb, cb);
+            break;
+        }
+    }
+
+    if (i == EVENT_PROFILE_SLOTS) return;
+
+    int bucket = cost ? 64 - __builtin_clzll(cost) : 0;
+    if (bucket >= EVENT_PROFILE_BUCKETS) bucket = EVENT_PROFILE_BUCKETS - 1;
+
+    profile_store(&callback->buckets[bucket], callback->buckets[bucket] + 1);
+    profile_store(&callback->total, callback->total + cost);
+    profile_store(&callback->count, callback->count + 1);
+    if (cost > callback->max) profile_store(&callback->max, cost);
+}
+
 static inline void pending_add(EVENT_LOOP *loop, int fd, int events) {
     ANFD *anfd = loop->anfds + fd;
 
@@ -134,7 +226,7 @@ static inline void pending_add(EVENT_LOOP *loop, int fd, int events) {
         EVENT_IO *watcher = NULL;
 
         for (watcher = anfd->head; watcher; watcher = watcher->next) {
-            printf("add: %d\n", watcher->fd);
+            event_trace(loop, 2, EVENT_TRACE_ADD, watcher->fd, watcher->events, events);
             if (watcher->events & events)
                 event_watcher_feed(loop, (EVENT_WATCHER *)watcher);
         }
@@ -144,42 +236,106 @@ static inline void pending_add(EVENT_LOOP *loop, int fd, int events) {
 static inline void pending_remove(EVENT_LOOP *loop, int pending) {
     if (pending) {
         loop->pendings[pending - 1] = loop->pendings[loop->pendingcnt - 1];
+        loop->pendings[pending - 1].watcher->pending = pending;
         --(loop->pendingcnt);
     }
 }
 
 static inline void pending_invoke(EVENT_LOOP *loop) {
+    EVENT_PROFILE *profile = loop->profiling ? loop->profile : NULL;
     int i = 0;
 
     for (i = 0; i < loop->pendingcnt; ++i) {
         if (loop->pendings[i].watcher->pending) {
             loop->pendings[i].watcher->pending = 0;
 
-            printf("invoke: %d\n", loop->pendingcnt);
-            if (loop->pendings[i].watcher->cb != NULL)
+            event_trace(loop, 2, EVENT_TRACE_INVOKE, i, loop->pendingcnt, 0);
+            if (loop->pendings[i].watcher->cb != NULL) {
+                void *cb = (void *)loop->pendings[i].watcher->cb;
+                uint64_t stamp = profile ? now_nsec() : 0;
+
                 loop->pendings[i].watcher->cb(loop, loop->pendings[i].watcher);
+
+                if (profile) profile_callback(profile, cb, now_nsec() - stamp);
+            }
         }
     }
 
     loop->pendingcnt = 0;
 }
 
+static int async_open(int *fds) {
+#if defined(__linux__) || defined(__unix__)
+    if (pipe(fds) != 0) return 0;
+#else
+    // No pipe works with select here, a udp socket connected to itself stands in for one
+    struct sockaddr_in addr; int len = sizeof(addr);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    fds[0] = fds[1] = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fds[0] == INVALID_SOCKET) return 0;
+
+    if (bind(fds[0], (struct sockaddr *)&addr, len) != 0 || getsockname(fds[0], (struct sockaddr *)&addr, &len) != 0 ||
+        connect(fds[0], (struct sockaddr *)&addr, len) != 0) {
+        socket_close(fds[0]);
+        return 0;
+    }
+#endif
+
+    socket_setasync(fds[0]);
+    socket_setasync(fds[1]);
+
+    return 1;
+}
+
+static void async_close(int *fds) {
+#if defined(__linux__) || defined(__unix__)
+    close(fds[0]);
+    close(fds[1]);
+#else
+    socket_close(fds[0]);
+#endif
+
+    fds[0] = fds[1] = -1;
+}
+
+static void async_cb(EVENT_LOOP *loop, EVENT_IO *watcher) {
+    EVENT_ASYNC *async = NULL; char buff[64];
+
+#if defined(__linux__) || defined(__unix__)
+    while (read(watcher->fd, buff, sizeof(buff)) > 0);
+#else
+    while (recv(watcher->fd, buff, sizeof(buff), 0) > 0);
+#endif
+
+    // Rearm before looking at the watchers, a send racing with the scan then writes the pipe again
+    __atomic_store_n(&loop->asyncpending, 0, __ATOMIC_SEQ_CST);
+
+    for (async = loop->asyncs; async; async = async->next)
+        if (__atomic_exchange_n(&async->sent, 0, __ATOMIC_SEQ_CST))
+            event_watcher_feed(loop, (EVENT_WATCHER *)async);
+}
+
 static void timer_reify(EVENT_LOOP *loop) {
     if (loop->timecnt && loop->antos[HEAP_ROOT].at < now_time()) {
         do {
             ANTO *anto = loop->antos + HEAP_ROOT;
-            printf("p: %d %d\n", loop->antos[1].watcher->active, loop->antos[2].watcher->active);
+            EVENT_TIMER *watcher = anto->watcher;
+            event_trace(loop, 1, EVENT_TRACE_TIMER, watcher->active, loop->timecnt, watcher->repeat > 0);
 
-            if (anto->watcher->repeat) {
-                anto->at += anto->watcher->repeat;
+            if (watcher->repeat) {
+                anto->at += watcher->repeat;
 
                 if (anto->at < now_time()) anto->at = now_time();
 
                 heap_down(loop->antos, loop->timecnt, HEAP_ROOT);
             } else
-                event_timer_stop(loop, anto->watcher);
+                event_timer_stop(loop, watcher);
 
-            event_watcher_feed(loop, (EVENT_WATCHER *)anto->watcher);
+            event_watcher_feed(loop, (EVENT_WATCHER *)watcher);
         } while (loop->timecnt && loop->antos[HEAP_ROOT].at < now_time());
     }
 }
@@ -272,11 +428,13 @@ static int select_poll(EVENT_LOOP *loop, double timeout) {
                 if (FD_ISSET(fd, &wfds)) events |= EVENT_IO_WRITE;
                 if (FD_ISSET(fd, &efds)) events |= EVENT_IO_EXCEPT;
 
-                printf("poll: %d %d\n", fd, events);
+                event_trace(loop, 2, EVENT_TRACE_POLL, fd, events, 0);
                 if (events) pending_add(loop, fd, events);
             }
         }
 
+        return 1;
+    } else if (errno == EINTR) {
         return 1;
     } else {
         for (fd = 0; fd < loop->anfdmax; ++fd) {
@@ -376,12 +534,27 @@ EVENT_LOOP *event_init(int flags) {
     loop->pendings = NULL;
     loop->pendingmax = 0;
     loop->pendingcnt = 0;
+    loop->asyncs = NULL;
+    loop->asyncfds[0] = loop->asyncfds[1] = -1;
+    loop->asyncpending = 0;
 
     if (loop->backend != EVENT_BACKEND_NONE && !loop->backend_init(loop))
         return NULL;
 
+#if EVENT_TRACE_LEVEL > 0
+    loop->traces = (EVENT_TRACE *)malloc(sizeof(EVENT_TRACE) * EVENT_TRACE_SIZE);
+#else
+    loop->traces = NULL;
+#endif
+    loop->tracecnt = 0;
+
+    loop->profiling = 0;
+    loop->profile = (EVENT_PROFILE *)malloc(sizeof(EVENT_PROFILE));
+    if (loop->profile != NULL) memset(loop->profile, 0, sizeof(EVENT_PROFILE));
+
     loop->activecnt = 0;
     loop->breakflag = EVENT_BREAK_NONE;
+    loop->cpu = -1;
 
     return loop;
 }
@@ -399,6 +572,11 @@ void event_run(EVENT_LOOP *loop, int flags) {
     pending_invoke(loop);
 
     do {
+        EVENT_PROFILE *profile = loop->profiling ? loop->profile : NULL;
+        uint64_t start = 0, stamp = 0; int ready = 0, pending = 0;
+
+        if (profile) start = stamp = now_nsec();
+
         fd_reify(loop);
 
         double waittime = 0.0;
@@ -416,15 +594,37 @@ void event_run(EVENT_LOOP *loop, int flags) {
 
         timer_update(loop, MAX_TIME);
 
+        if (profile) stamp = profile_phase(profile, EVENT_PHASE_FDS, stamp);
+
         if (!loop->backend_poll(loop, waittime))
             sleep(waittime);
 
+        event_trace(loop, 1, EVENT_TRACE_LOOP, (int)(waittime * 1e3), loop->pendingcnt, loop->activecnt);
+
+        if (profile) {
+            uint64_t now = profile_phase(profile, EVENT_PHASE_POLL, stamp);
+
+            start += now - stamp;
+            stamp = now;
+            ready = loop->pendingcnt;
+        }
+
         timer_update(loop, waittime);
 
         timer_reify(loop);
 
+        if (profile) {
+            stamp = profile_phase(profile, EVENT_PHASE_TIMERS, stamp);
+            pending = loop->pendingcnt;
+        }
+
         pending_invoke(loop);
 
+        if (profile) {
+            stamp = profile_phase(profile, EVENT_PHASE_PENDINGS, stamp);
+            profile_iteration(profile, stamp - start, ready, pending);
+        }
+
         if (loop->breakflag & ~(EVENT_BREAK_ONE | EVENT_BREAK_ALL))
             loop->breakflag = EVENT_BREAK_NONE;
     } while (loop->activecnt && !loop->breakflag && !(flags & (EVENT_RUN_ONCE | EVENT_RUN_NOWAIT)));
@@ -433,27 +633,52 @@ void event_run(EVENT_LOOP *loop, int flags) {
         loop->breakflag = EVENT_BREAK_NONE;
 }
 
+int event_affinity(EVENT_LOOP *loop, int cpu) {
+    if (loop == NULL || cpu < 0) return 0;
+
+#ifdef __linux__
+    cpu_set_t set;
+
+    if (cpu >= CPU_SETSIZE) return 0;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set) != 0) return 0;
+
+    loop->cpu = cpu;
+
+    return 1;
+#else
+    return 0;
+#endif
+}
+
 void event_clean(EVENT_LOOP *loop) {
     if (loop == NULL) return;
 
     if (loop->backend != EVENT_BACKEND_NONE)
         loop->backend_clean(loop);
 
+    if (loop->asyncfds[0] >= 0)
+        async_close(loop->asyncfds);
+
     array_free(loop->anfds, loop->anfdmax, loop->anfdmax);
     array_free(loop->fdchanges, loop->fdchangemax, loop->fdchangecnt);
     array_free(loop->antos, loop->antomax, loop->timecnt);
     array_free(loop->pendings, loop->pendingmax, loop->pendingcnt);
 
+    free(loop->traces);
+    free(loop->profile);
     free(loop);
 }
 
 void event_watcher_feed(EVENT_LOOP *loop, EVENT_WATCHER *watcher) {
     if (loop == NULL || watcher == NULL) return;
 
-    printf("feed: %d %d\n", watcher->pending, loop->pendingcnt);
+    event_trace(loop, 2, EVENT_TRACE_FEED, watcher->pending, loop->pendingcnt, watcher->active);
     if (!watcher->pending) {
         watcher->pending = ++(loop->pendingcnt);
-    printf("feed: %d %d\n", watcher->pending, loop->pendingcnt);
         array_alloc(PENDING, loop->pendings, loop->pendingmax, loop->pendingcnt);
         loop->pendings[loop->pendingcnt - 1].watcher = watcher;
     }
@@ -522,10 +747,9 @@ void event_timer_start(EVENT_LOOP *loop, EVENT_TIMER *watcher) {
 
 void event_timer_stop(EVENT_LOOP *loop, EVENT_TIMER *watcher) {
     if (loop == NULL || watcher == NULL) return;
-    printf("stop: %d %d\n", watcher->pending, loop->pendingcnt);
+    event_trace(loop, 1, EVENT_TRACE_STOP, watcher->pending, loop->pendingcnt, watcher->active);
     pending_remove(loop, watcher->pending);
     watcher->pending = 0;
-    printf("stop: %d %d\n", watcher->pending, loop->pendingcnt);
     if (watcher->active <= 0) return;
     if (watcher->timeout < 0 || watcher->repeat < 0 ) return;
 
@@ -533,12 +757,144 @@ void event_timer_stop(EVENT_LOOP *loop, EVENT_TIMER *watcher) {
     if (watcher->active < loop->timecnt + HEAP_ROOT) {
         loop->antos[watcher->active] = loop->antos[loop->timecnt + HEAP_ROOT];
         loop->antos[watcher->active].watcher->active = watcher->active;
-        //printf("timecnt + root: %d %d\n", loop->antos[loop->timecnt + HEAP_ROOT].watcher->active, loop->antos[watcher->active].watcher->active);
         heap_adjust(loop->antos, loop->timecnt, watcher->active);
     }
-    loop->antos[watcher->active].at = 0;
+    loop->antos[loop->timecnt + HEAP_ROOT].at = 0;
 
-    printf("stop: %d %d\n", watcher->pending, loop->pendingcnt);
     watcher->active = 0;
     --(loop->activecnt);
 }
+
+void event_async_start(EVENT_LOOP *loop, EVENT_ASYNC *watcher) {
+    if (loop == NULL || watcher == NULL) return;
+    if (watcher->active) return;
+
+    if (loop->asyncfds[0] < 0) {
+        if (!async_open(loop->asyncfds)) return;
+
+        event_io_init(&loop->asyncio, async_cb, loop->asyncfds[0], EVENT_IO_READ);
+    }
+
+    // All async watchers share the one pipe watcher, it alone keeps the loop active
+    if (loop->asyncs == NULL)
+        event_io_start(loop, &loop->asyncio);
+
+    watcher->active = 1;
+    watcher->next = loop->asyncs;
+    loop->asyncs = watcher;
+}
+
+void event_async_stop(EVENT_LOOP *loop, EVENT_ASYNC *watcher) {
+    if (loop == NULL || watcher == NULL) return;
+    pending_remove(loop, watcher->pending);
+    watcher->pending = 0;
+    if (!watcher->active) return;
+
+    EVENT_ASYNC **head = &loop->asyncs;
+
+    while (*head && *head != watcher) head = &(*head)->next;
+    if (*head) *head = watcher->next;
+
+    watcher->active = 0;
+    watcher->next = NULL;
+
+    if (loop->asyncs == NULL)
+        event_io_stop(loop, &loop->asyncio);
+}
+
+void event_async_send(EVENT_LOOP *loop, EVENT_ASYNC *watcher) {
+    char one = 1;
+
+    if (loop == NULL || watcher == NULL) return;
+
+    // Only the first send since the loop last looked pays for a write
+    if (__atomic_exchange_n(&watcher->sent, 1, __ATOMIC_SEQ_CST)) return;
+    if (__atomic_exchange_n(&loop->asyncpending, 1, __ATOMIC_SEQ_CST)) return;
+
+    if (loop->asyncfds[1] >= 0) {
+#if defined(__linux__) || defined(__unix__)
+        if (write(loop->asyncfds[1], &one, 1) < 0) return;
+#else
+        send(loop->asyncfds[1], &one, 1, 0);
+#endif
+    }
+}
+
+void event_profile_snapshot(EVENT_LOOP *loop, EVENT_PROFILE *profile) {
+    int i = 0, j = 0;
+
+    if (loop == NULL || profile == NULL) return;
+
+    memset(profile, 0, sizeof(EVENT_PROFILE));
+    if (loop->profile == NULL) return;
+
+    profile->iterations = profile_load(&loop->profile->iterations);
+
+    for (i = 0; i < EVENT_PHASE_MAX; ++i) {
+        profile->total[i] = profile_load(&loop->profile->total[i]);
+        profile->max[i] = profile_load(&loop->profile->max[i]);
+        profile->last[i] = profile_load(&loop->profile->last[i]);
+    }
+
+    profile->readys = profile_load(&loop->profile->readys);
+    profile->maxready = profile_load(&loop->profile->maxready);
+    profile->lastready = profile_load(&loop->profile->lastready);
+    profile->pendings = profile_load(&loop->profile->pendings);
+    profile->maxpending = profile_load(&loop->profile->maxpending);
+    profile->lastpending = profile_load(&loop->profile->lastpending);
+
+    for (i = 0; i < EVENT_PROFILE_SLOTS; ++i) {
+        EVENT_CALLBACK *from = loop->profile->callbacks + i, *to = profile->callbacks + i;
+
+        to->cb = profile_load(&from->cb);
+        to->count = profile_load(&from->count);
+        to->total = profile_load(&from->total);
+        to->max = profile_load(&from->max);
+
+        for (j = 0; j < EVENT_PROFILE_BUCKETS; ++j)
+            to->buckets[j] = profile_load(&from->buckets[j]);
+    }
+}
+
+// Signal safe formatting, the dump may run from a crash handler
+static inline int trace_number(char *buff, uint64_t value, int negative) {
+    char temp[24]; int len = 0, i = 0;
+
+    do temp[len++] = '0' + value % 10; while (value /= 10);
+
+    if (negative) buff[i++] = '-';
+    while (len) buff[i++] = temp[--len];
+    buff[i++] = ' ';
+
+    return i;
+}
+
+void event_trace_dump(EVENT_LOOP *loop, int fd) {
+    static const char *names[EVENT_TRACE_MAX] = {"loop ", "poll ", "add ", "feed ", "invoke ", "timer ", "stop "};
+    uint64_t i = 0, end = 0; char line[128];
+
+    if (loop == NULL || loop->traces == NULL) return;
+
+    end = __atomic_load_n(&loop->tracecnt, __ATOMIC_ACQUIRE);
+    i = end > EVENT_TRACE_SIZE ? end - EVENT_TRACE_SIZE : 0;
+
+    for (; i < end; ++i) {
+        EVENT_TRACE *trace = loop->traces + (i & (EVENT_TRACE_SIZE - 1));
+        int len = 0, type = trace->type;
+
+        len += trace_number(line + len, trace->time, 0);
+
+        if (type >= 0 && type < EVENT_TRACE_MAX) {
+            size_t size = strlen(names[type]);
+            memcpy(line + len, names[type], size);
+            len += size;
+        }
+
+        len += trace_number(line + len, trace->a < 0 ? -(int64_t)trace->a : trace->a, trace->a < 0);
+        len += trace_number(line + len, trace->b < 0 ? -(int64_t)trace->b : trace->b, trace->b < 0);
+        len += trace_number(line + len, trace->c < 0 ? -(int64_t)trace->c : trace->c, trace->c < 0);
+        line[len - 1] = '\n';
+
+        if (write(fd, line, len) != len) break;
+    }
+}
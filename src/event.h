@@ -1,10 +1,16 @@
 #ifndef _EVENT_H
 #define _EVENT_H 1
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#ifndef EVENT_TRACE_LEVEL
+#define EVENT_TRACE_LEVEL 0
+#endif
+
 typedef struct event_loop EVENT_LOOP;
 
 #define EVENT_CB(type) void (*cb)(struct event_loop *loop, struct type *watcher)
@@ -66,6 +72,24 @@ void event_timer_start(EVENT_LOOP *loop, EVENT_TIMER *watcher);
 
 void event_timer_stop(EVENT_LOOP *loop, EVENT_TIMER *watcher);
 
+// The only watcher that may be signalled from another thread, the loop is woken through a pipe
+typedef struct event_async {
+    EVENT_WATCHER(event_async);
+    struct event_async *next;
+
+    int volatile sent;
+} EVENT_ASYNC;
+
+#define event_async_init(ew, cb) do { event_watcher_init((ew), (cb)); (ew)->next = NULL; (ew)->sent = 0; } while(0)
+
+#define event_async_data(ew, data) do { event_watcher_data(ew, data); } while(0)
+
+void event_async_start(EVENT_LOOP *loop, EVENT_ASYNC *watcher);
+
+void event_async_stop(EVENT_LOOP *loop, EVENT_ASYNC *watcher);
+
+void event_async_send(EVENT_LOOP *loop, EVENT_ASYNC *watcher);
+
 enum {
     ANFD_CHANGE = 0x01,
     ANFD_FDSET  = 0x02
@@ -86,6 +110,64 @@ typedef struct pending {
     EVENT_WATCHER *watcher;
 } PENDING;
 
+enum {
+    EVENT_PHASE_FDS,
+    EVENT_PHASE_POLL,
+    EVENT_PHASE_TIMERS,
+    EVENT_PHASE_PENDINGS,
+    EVENT_PHASE_BUSY,
+    EVENT_PHASE_MAX
+};
+
+#define EVENT_PROFILE_SLOTS 64
+#define EVENT_PROFILE_BUCKETS 40
+
+typedef struct event_callback {
+    void *cb;
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+    uint64_t buckets[EVENT_PROFILE_BUCKETS];
+} EVENT_CALLBACK;
+
+typedef struct event_profile {
+    uint64_t iterations;
+    uint64_t total[EVENT_PHASE_MAX];
+    uint64_t max[EVENT_PHASE_MAX];
+    uint64_t last[EVENT_PHASE_MAX];
+
+    uint64_t readys;
+    uint64_t maxready;
+    uint64_t lastready;
+
+    uint64_t pendings;
+    uint64_t maxpending;
+    uint64_t lastpending;
+
+    EVENT_CALLBACK callbacks[EVENT_PROFILE_SLOTS];
+} EVENT_PROFILE;
+
+enum {
+    EVENT_TRACE_LOOP,
+    EVENT_TRACE_POLL,
+    EVENT_TRACE_ADD,
+    EVENT_TRACE_FEED,
+    EVENT_TRACE_INVOKE,
+    EVENT_TRACE_TIMER,
+    EVENT_TRACE_STOP,
+    EVENT_TRACE_MAX
+};
+
+#define EVENT_TRACE_SIZE 4096
+
+typedef struct event_trace {
+    uint64_t time;
+    int32_t type;
+    int32_t a;
+    int32_t b;
+    int32_t c;
+} EVENT_TRACE;
+
 enum {
     EVENT_RUN_DEFAULT = 0x00,
     EVENT_RUN_ONCE    = 0x01,
@@ -128,14 +210,27 @@ typedef struct event_loop {
     int pendingmax;
     int pendingcnt;
 
+    EVENT_ASYNC *asyncs;
+    EVENT_IO asyncio;
+    int asyncfds[2];
+    int volatile asyncpending;
+
     int backend;
     int (*backend_init)(EVENT_LOOP *loop);
     int (*backend_modify)(EVENT_LOOP *loop, int fd, int oevents, int nevents);
     int (*backend_poll)(EVENT_LOOP *loop, double timeout);
     void (*backend_clean)(EVENT_LOOP *loop);
-;
+
+    int volatile profiling;
+    EVENT_PROFILE *profile;
+
+    EVENT_TRACE *traces;
+    uint64_t volatile tracecnt;
+
     int activecnt;
     int breakflag;
+
+    int cpu;
 } EVENT_LOOP;
 
 #define event_default() event_init(EVENT_BACKEND_EPOLL | EVENT_BACKEND_SELECT | EVENT_BACKEND_NONE)
@@ -146,8 +241,17 @@ EVENT_LOOP *event_init(int flags);
 
 void event_run(EVENT_LOOP *loop, int flags);
 
+// Pin the calling thread, the one that runs this loop, returns 0 when pinning is not supported
+int event_affinity(EVENT_LOOP *loop, int cpu);
+
 void event_clean(EVENT_LOOP *loop);
 
+#define event_profile(loop, enable) do { (loop)->profiling = (enable) && (loop)->profile != NULL; } while(0)
+
+void event_profile_snapshot(EVENT_LOOP *loop, EVENT_PROFILE *profile);
+
+void event_trace_dump(EVENT_LOOP *loop, int fd);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,384 @@
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "logger.h"
+
+#define load_acquire(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define store_release(ptr, value) __atomic_store_n(ptr, value, __ATOMIC_RELEASE)
+
+#define LOGGER_DELAY 1000
+#define LOGGER_MAXLINE 512
+#define LOGGER_MAXBATCH (1024 << 6)
+
+enum {
+    LOGGER_ARG_NONE,
+    LOGGER_ARG_INT,
+    LOGGER_ARG_LONG,
+    LOGGER_ARG_LLONG,
+    LOGGER_ARG_SIZE,
+    LOGGER_ARG_DOUBLE,
+    LOGGER_ARG_STRING,
+    LOGGER_ARG_POINTER,
+    LOGGER_ARG_IGNORE
+};
+
+static int logger_flags = LOGGER_NONE;
+static FILE *logger_output = NULL;
+static uint64_t logger_size = 0;
+
+static int volatile logger_running = 0;
+static int volatile logger_breakout = 0;
+static pthread_t logger_thread;
+
+static LOGGER_RING *logger_rings = NULL;
+static pthread_mutex_t logger_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread LOGGER_RING *logger_ring = NULL;
+
+static char logger_batch[LOGGER_MAXBATCH];
+static size_t logger_batchlen = 0;
+
+static time_t logger_second = 0;
+static char logger_stamp[32];
+
+static inline uint64_t now_time(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Walk one conversion specification, p points just after the '%'
+static const char *format_spec(const char *p, int *type, int *stars) {
+    int length = 0;
+
+    *stars = 0;
+
+    while (*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0') ++p;
+
+    if (*p == '*') { ++(*stars); ++p; } else while (*p >= '0' && *p <= '9') ++p;
+
+    if (*p == '.') {
+        ++p;
+
+        if (*p == '*') { ++(*stars); ++p; } else while (*p >= '0' && *p <= '9') ++p;
+    }
+
+    while (*p == 'h' || *p == 'l' || *p == 'L' || *p == 'z' || *p == 'j' || *p == 't') {
+        if (*p == 'l') ++length;
+        if (*p == 'z' || *p == 'j' || *p == 't') length = 3;
+        ++p;
+    }
+
+    switch (*p) {
+        case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+            *type = length == 0 ? LOGGER_ARG_INT : length == 1 ? LOGGER_ARG_LONG : length == 2 ? LOGGER_ARG_LLONG : LOGGER_ARG_SIZE;
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            *type = LOGGER_ARG_DOUBLE;
+            break;
+        case 's':
+            *type = LOGGER_ARG_STRING;
+            break;
+        case 'p':
+            *type = LOGGER_ARG_POINTER;
+            break;
+        case 'n':
+            *type = LOGGER_ARG_IGNORE;
+            break;
+        default:
+            *type = LOGGER_ARG_NONE;
+            return *p ? p + 1 : p;
+    }
+
+    return p + 1;
+}
+
+static LOGGER_RING *ring_attach(void) {
+    LOGGER_RING *ring = NULL;
+
+    if (posix_memalign((void **)&ring, 64, sizeof(LOGGER_RING)) != 0) return NULL;
+    memset(ring, 0, sizeof(LOGGER_RING));
+
+    ring->records = (LOGGER_RECORD *)malloc(sizeof(LOGGER_RECORD) * logger_size);
+    if (ring->records == NULL) { free(ring); return NULL; }
+
+    ring->size = logger_size;
+
+    pthread_mutex_lock(&logger_lock);
+    ring->next = logger_rings;
+    store_release(&logger_rings, ring);
+    pthread_mutex_unlock(&logger_lock);
+
+    logger_ring = ring;
+
+    return ring;
+}
+
+void logger_print(const char *format, ...) {
+    if (!logger_running || format == NULL) return;
+
+    LOGGER_RING *ring = logger_ring != NULL ? logger_ring : ring_attach();
+    if (ring == NULL) return;
+
+    uint64_t write = ring->write;
+
+    if (write - load_acquire(&ring->read) >= ring->size) {
+        store_release(&ring->dropped, ring->dropped + 1);
+        return;
+    }
+
+    LOGGER_RECORD *record = ring->records + (write & (ring->size - 1));
+    const char *p = format; int type = 0, stars = 0;
+    va_list ap;
+
+    record->time = now_time();
+    record->format = format;
+    record->argc = 0;
+    record->textlen = 0;
+    record->text[LOGGER_MAXTEXT - 1] = 0;
+
+    va_start(ap, format);
+
+    while (*p && record->argc < LOGGER_MAXARGS) {
+        if (*p++ != '%') continue;
+        if (*p == '%') { ++p; continue; }
+
+        p = format_spec(p, &type, &stars);
+
+        while (stars-- && record->argc < LOGGER_MAXARGS)
+            record->args[record->argc++] = (uint64_t)va_arg(ap, int);
+
+        if (record->argc == LOGGER_MAXARGS) break;
+
+        switch (type) {
+            case LOGGER_ARG_INT:
+                record->args[record->argc++] = (uint64_t)va_arg(ap, int);
+                break;
+            case LOGGER_ARG_LONG:
+                record->args[record->argc++] = (uint64_t)va_arg(ap, long);
+                break;
+            case LOGGER_ARG_LLONG:
+                record->args[record->argc++] = (uint64_t)va_arg(ap, long long);
+                break;
+            case LOGGER_ARG_SIZE:
+                record->args[record->argc++] = (uint64_t)va_arg(ap, size_t);
+                break;
+            case LOGGER_ARG_DOUBLE: {
+                double value = va_arg(ap, double);
+                memcpy(record->args + record->argc++, &value, sizeof(value));
+                break;
+            }
+            case LOGGER_ARG_STRING: {
+                const char *text = va_arg(ap, const char *);
+                size_t left = LOGGER_MAXTEXT - 1 - record->textlen, len = 0;
+
+                if (text == NULL) text = "(null)";
+                while (len < left && text[len]) ++len;
+
+                memcpy(record->text + record->textlen, text, len);
+                record->text[record->textlen + len] = 0;
+                record->args[record->argc++] = record->textlen;
+                record->textlen += len < left ? len + 1 : len;
+                break;
+            }
+            case LOGGER_ARG_POINTER:
+            case LOGGER_ARG_IGNORE:
+                record->args[record->argc++] = (uint64_t)(uintptr_t)va_arg(ap, void *);
+                break;
+            default:
+                break;
+        }
+    }
+
+    va_end(ap);
+
+    store_release(&ring->write, write + 1);
+}
+
+static size_t record_format(const LOGGER_RECORD *record, char *buff, size_t size) {
+    time_t second = (time_t)(record->time / 1000000000ULL);
+    const char *p = record->format; uint32_t argc = 0;
+    size_t len = 0; int type = 0, stars = 0;
+
+    if (second != logger_second) {
+        logger_second = second;
+        strftime(logger_stamp, sizeof(logger_stamp), "%m-%d %H:%M:%S", localtime(&second));
+    }
+
+    len = snprintf(buff, size, "[%s] ", logger_stamp);
+
+    while (*p && len < size - 2) {
+        if (*p != '%') { buff[len++] = *p++; continue; }
+        if (*(p + 1) == '%') { buff[len++] = '%'; p += 2; continue; }
+
+        const char *start = p, *end = format_spec(p + 1, &type, &stars);
+        char spec[64]; size_t speclen = 0, left = size - 1 - len;
+        int ret = 0;
+
+        if (argc + stars + (type != LOGGER_ARG_NONE) > record->argc) break;
+
+        for (p = start; p < end && speclen < sizeof(spec) - 24; ++p) {
+            if (*p == '*')
+                speclen += snprintf(spec + speclen, sizeof(spec) - speclen, "%d", (int)record->args[argc++]);
+            else
+                spec[speclen++] = *p;
+        }
+
+        spec[speclen] = 0;
+        p = end;
+
+        switch (type) {
+            case LOGGER_ARG_INT:
+                ret = snprintf(buff + len, left, spec, (int)record->args[argc++]);
+                break;
+            case LOGGER_ARG_LONG:
+                ret = snprintf(buff + len, left, spec, (long)record->args[argc++]);
+                break;
+            case LOGGER_ARG_LLONG:
+                ret = snprintf(buff + len, left, spec, (long long)record->args[argc++]);
+                break;
+            case LOGGER_ARG_SIZE:
+                ret = snprintf(buff + len, left, spec, (size_t)record->args[argc++]);
+                break;
+            case LOGGER_ARG_DOUBLE: {
+                double value = 0.0;
+                memcpy(&value, record->args + argc++, sizeof(value));
+                ret = snprintf(buff + len, left, spec, value);
+                break;
+            }
+            case LOGGER_ARG_STRING:
+                ret = snprintf(buff + len, left, spec, record->text + record->args[argc++]);
+                break;
+            case LOGGER_ARG_POINTER:
+                ret = snprintf(buff + len, left, spec, (void *)(uintptr_t)record->args[argc++]);
+                break;
+            case LOGGER_ARG_IGNORE:
+                ++argc;
+                break;
+            default:
+                ret = snprintf(buff + len, left, "%s", spec);
+                break;
+        }
+
+        if (ret > 0) len += (size_t)ret < left ? (size_t)ret : left - 1;
+    }
+
+    buff[len++] = '\n';
+
+    return len;
+}
+
+static void batch_flush(void) {
+    if (logger_batchlen == 0) return;
+
+    if (logger_flags & LOGGER_STDOUT) {
+        fwrite(logger_batch, 1, logger_batchlen, stdout);
+        fflush(stdout);
+    }
+
+    if (logger_flags & LOGGER_FILE && logger_output != NULL) {
+        fwrite(logger_batch, 1, logger_batchlen, logger_output);
+        fflush(logger_output);
+    }
+
+    logger_batchlen = 0;
+}
+
+static size_t logger_drain(void) {
+    LOGGER_RING *ring = NULL; size_t count = 0;
+
+    for (ring = load_acquire(&logger_rings); ring != NULL; ring = ring->next) {
+        uint64_t read = ring->read, write = load_acquire(&ring->write);
+        uint64_t dropped = load_acquire(&ring->dropped);
+
+        for (; read < write; ++read, ++count) {
+            if (LOGGER_MAXBATCH - logger_batchlen < LOGGER_MAXLINE)
+                batch_flush();
+
+            logger_batchlen += record_format(ring->records + (read & (ring->size - 1)), logger_batch + logger_batchlen, LOGGER_MAXLINE);
+            store_release(&ring->read, read + 1);
+        }
+
+        if (dropped != ring->reported) {
+            if (LOGGER_MAXBATCH - logger_batchlen < LOGGER_MAXLINE)
+                batch_flush();
+
+            logger_batchlen += snprintf(logger_batch + logger_batchlen, LOGGER_MAXLINE, "[%s] %lu log record(s) dropped\n", logger_stamp, (unsigned long)(dropped - ring->reported));
+            ring->reported = dropped;
+        }
+    }
+
+    batch_flush();
+
+    return count;
+}
+
+static void *logger_worker(void *data) {
+    while (1) {
+        int breakout = load_acquire(&logger_breakout);
+
+        if (logger_drain() == 0) {
+            if (breakout) break;
+
+            usleep(LOGGER_DELAY);
+        }
+    }
+
+    pthread_exit(NULL);
+}
+
+int logger_init(int flags, FILE *file, uint64_t size) {
+    if (logger_running) return 1;
+    if (flags & ~(LOGGER_STDOUT | LOGGER_FILE) || flags == LOGGER_NONE) return 0;
+    if (flags & LOGGER_FILE && file == NULL) return 0;
+
+    int i = 0; if (size == 0) size = LOGGER_MAXRING;
+    while (size > (2ULL << i)) ++i;
+    size = 2ULL << i;
+
+    logger_flags = flags;
+    logger_output = file;
+    logger_size = size;
+    logger_breakout = 0;
+
+    if (pthread_create(&logger_thread, NULL, logger_worker, NULL) != 0)
+        return 0;
+
+    store_release(&logger_running, 1);
+
+    return 1;
+}
+
+void logger_flush(void) {
+    LOGGER_RING *ring = NULL;
+
+    if (!logger_running) return;
+
+    for (ring = load_acquire(&logger_rings); ring != NULL; ring = ring->next)
+        while (load_acquire(&ring->read) < load_acquire(&ring->write))
+            usleep(LOGGER_DELAY);
+}
+
+void logger_clean(void) {
+    LOGGER_RING *ring = NULL, *next = NULL;
+
+    if (!logger_running) return;
+
+    store_release(&logger_running, 0);
+    store_release(&logger_breakout, 1);
+    pthread_join(logger_thread, NULL);
+
+    for (ring = logger_rings; ring != NULL; ring = next) {
+        next = ring->next;
+        free(ring->records);
+        free(ring);
+    }
+
+    logger_rings = NULL;
+    logger_ring = NULL;
+}
@@ -0,0 +1,57 @@
+#ifndef _LOGGER_H
+#define _LOGGER_H 1
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LOGGER_MAXARGS 8
+#define LOGGER_MAXTEXT 64
+#define LOGGER_MAXRING 4096
+
+enum {
+    LOGGER_NONE   = 0x00,
+    LOGGER_STDOUT = 0x01,
+    LOGGER_FILE   = 0x02
+};
+
+typedef struct logger_record {
+    uint64_t time;
+    const char *format;
+    uint32_t argc;
+    uint32_t textlen;
+    uint64_t args[LOGGER_MAXARGS];
+    char text[LOGGER_MAXTEXT];
+} __attribute__ ((aligned(8))) LOGGER_RECORD;
+
+typedef struct logger_ring {
+    struct logger_ring *next;
+    LOGGER_RECORD *records;
+    uint64_t size;
+    uint64_t p1, p2, p3, p4, p5;
+
+    uint64_t volatile write;
+    uint64_t volatile dropped;
+    uint64_t p6, p7, p8, p9, p10, p11;
+
+    uint64_t volatile read;
+    uint64_t reported;
+    uint64_t p12, p13, p14, p15, p16, p17;
+} __attribute__ ((aligned(64))) LOGGER_RING;
+
+int logger_init(int flags, FILE *file, uint64_t size);
+
+void logger_print(const char *format, ...);
+
+void logger_flush(void);
+
+void logger_clean(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,12 +1,16 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <stdarg.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <regex.h>
+#include <signal.h>
+#include <sched.h>
 #include "socket.h"
 #include "event.h"
+#include "actor.h"
+#include "logger.h"
+#include "metrics.h"
 
 #if defined(__linux__) || defined(__unix__)
 #include <netinet/tcp.h>
@@ -19,6 +23,8 @@
 
 #define MAX_CLIENTS FD_SETSIZE
 #define PROXY_TIMEOUT 10.0
+#define PROXY_MAXINBOX 4
+#define CPU_MAXLIST 256
 
 enum {
     PROXY_HAS_NONE    = 0x00,
@@ -27,6 +33,32 @@ enum {
     PROXY_HAS_NOTEND  = 0x04
 };
 
+enum {
+    PROXY_WAIT_NONE         = 0x00,
+    PROXY_WAIT_CLIENT_READ  = 0x01,
+    PROXY_WAIT_CLIENT_WRITE = 0x02,
+    PROXY_WAIT_REMOTE_READ  = 0x04,
+    PROXY_WAIT_REMOTE_WRITE = 0x08
+};
+
+enum {
+    PROXY_PHASE_ACCEPT,
+    PROXY_PHASE_CLIENT,
+    PROXY_PHASE_HEADER,
+    PROXY_PHASE_RESOLVE,
+    PROXY_PHASE_CONNECT,
+    PROXY_PHASE_REMOTE,
+    PROXY_PHASE_FIRST,
+    PROXY_PHASE_CLOSE,
+    PROXY_PHASE_MAX
+};
+
+typedef struct proxy_record {
+    uint64_t phases[PROXY_PHASE_MAX];
+    uint64_t upload;
+    uint64_t download;
+} PROXY_RECORD;
+
 typedef struct proxy {
     int client;
     EVENT_IO client_read;
@@ -40,11 +72,19 @@ typedef struct proxy {
 
     int status;
 
+    ACTOR_HANDLE actor;
+    int wait;
+
     char data[MAX_DATA_SIZE];
     ssize_t data_size;
     ssize_t data_index;
+
+    uint64_t request_time;
+    PROXY_RECORD record;
 } PROXY;
 
+#define proxy_phase(node, phase) do { if (!(node)->record.phases[phase]) (node)->record.phases[phase] = metrics_now(); } while(0)
+
 static EVENT_LOOP *loop = NULL;
 static EVENT_IO local_accept;
 
@@ -58,25 +98,130 @@ static int debug_flag = 0;
 static int logger_flag = 0;
 static FILE *logger_file = NULL;
 
-static void print_log(const char *format, ...) {
-    if (debug_flag || logger_flag) {
-        char buff[128], message[128];
-        time_t now = time(NULL);
-        va_list ap;
+static int metrics_flag = 0;
+static int metrics_accepts = -1;
+static int metrics_tunnels = -1;
+static int metrics_upload = -1;
+static int metrics_download = -1;
+static int metrics_timeouts = -1;
+static int metrics_inline = -1;
+static int metrics_connect = -1;
+static int metrics_header = -1;
+static int metrics_firstbyte = -1;
+static int metrics_phases[PROXY_PHASE_MAX] = {-1, -1, -1, -1, -1, -1, -1, -1};
+
+static FILE *record_file = NULL;
 
-        va_start(ap, format);
-        strftime(buff, sizeof(buff), "%m-%d %H:%M:%S", localtime(&now));
-        vsnprintf(message, sizeof(message), format, ap);
-        va_end(ap);
+static int profile_flag = 0;
 
-        if (debug_flag)
-            printf("[%s] %s\n", buff, message);
+static int actor_workers = 0;
+static int actor_minworkers = 0;
+static int cpu_list[CPU_MAXLIST];
+static int cpu_count = 0;
+static ACTOR_ROOT *actors = NULL;
+static RING_BUFFER *actor_arms = NULL;
+static EVENT_ASYNC actor_async;
 
-        if (logger_flag && logger_file != NULL)
-            fprintf(logger_file, "[%s] %s\n", buff, message);
+static void proxy_io_cb(EVENT_LOOP *loop, EVENT_IO *watcher);
+
+static size_t profile_collector(char *buff, size_t size, void *data) {
+    static const char *phases[EVENT_PHASE_MAX] = {"fds", "poll", "timers", "pendings", "busy"};
+    static EVENT_PROFILE profile;
+    EVENT_CALLBACK *top[8] = {NULL};
+    size_t len = 0; int i = 0, j = 0;
+
+    event_profile_snapshot((EVENT_LOOP *)data, &profile);
+
+    metrics_print(buff, size, len, "# TYPE nextproxy_loop_iterations_total counter\nnextproxy_loop_iterations_total %llu\n", (unsigned long long)profile.iterations);
+
+    metrics_print(buff, size, len, "# TYPE nextproxy_loop_phase_seconds_total counter\n");
+    for (i = 0; i < EVENT_PHASE_MAX; ++i)
+        metrics_print(buff, size, len, "nextproxy_loop_phase_seconds_total{phase=\"%s\"} %.9f\n", phases[i], profile.total[i] * 1e-9);
+
+    metrics_print(buff, size, len, "# TYPE nextproxy_loop_phase_max_seconds gauge\n");
+    for (i = 0; i < EVENT_PHASE_MAX; ++i)
+        metrics_print(buff, size, len, "nextproxy_loop_phase_max_seconds{phase=\"%s\"} %.9f\n", phases[i], profile.max[i] * 1e-9);
+
+    metrics_print(buff, size, len, "# TYPE nextproxy_loop_ready_total counter\nnextproxy_loop_ready_total %llu\n", (unsigned long long)profile.readys);
+    metrics_print(buff, size, len, "# TYPE nextproxy_loop_ready_max gauge\nnextproxy_loop_ready_max %llu\n", (unsigned long long)profile.maxready);
+    metrics_print(buff, size, len, "# TYPE nextproxy_loop_pending_total counter\nnextproxy_loop_pending_total %llu\n", (unsigned long long)profile.pendings);
+    metrics_print(buff, size, len, "# TYPE nextproxy_loop_pending_max gauge\nnextproxy_loop_pending_max %llu\n", (unsigned long long)profile.maxpending);
+
+    for (i = 0; i < EVENT_PROFILE_SLOTS; ++i) {
+        EVENT_CALLBACK *callback = profile.callbacks + i;
+
+        if (callback->cb == NULL) continue;
+
+        for (j = sizeof(top) / sizeof(top[0]); j > 0 && (top[j - 1] == NULL || top[j - 1]->max < callback->max); --j)
+            if (j < sizeof(top) / sizeof(top[0])) top[j] = top[j - 1];
+
+        if (j < sizeof(top) / sizeof(top[0])) top[j] = callback;
     }
+
+    metrics_print(buff, size, len, "# TYPE nextproxy_loop_callback_seconds histogram\n");
+    for (i = 0; i < sizeof(top) / sizeof(top[0]) && top[i] != NULL; ++i) {
+        uint64_t total = 0;
+
+        for (j = 0; j < EVENT_PROFILE_BUCKETS - 1; ++j) {
+            total += top[i]->buckets[j];
+            metrics_print(buff, size, len, "nextproxy_loop_callback_seconds_bucket{cb=\"%p\",le=\"%g\"} %llu\n", top[i]->cb, (double)(1ULL << j) * 1e-9, (unsigned long long)total);
+        }
+
+        metrics_print(buff, size, len, "nextproxy_loop_callback_seconds_bucket{cb=\"%p\",le=\"+Inf\"} %llu\n", top[i]->cb, (unsigned long long)top[i]->count);
+        metrics_print(buff, size, len, "nextproxy_loop_callback_seconds_sum{cb=\"%p\"} %.9f\n", top[i]->cb, top[i]->total * 1e-9);
+        metrics_print(buff, size, len, "nextproxy_loop_callback_seconds_count{cb=\"%p\"} %llu\n", top[i]->cb, (unsigned long long)top[i]->count);
+        metrics_print(buff, size, len, "nextproxy_loop_callback_max_seconds{cb=\"%p\"} %.9f\n", top[i]->cb, top[i]->max * 1e-9);
+    }
+
+    return len;
 }
 
+static size_t actor_collector(char *buff, size_t size, void *data) {
+    ACTOR_SCALING scaling; ACTOR_STATS stats; size_t len = 0;
+
+    actor_scaling((ACTOR_ROOT *)data, &scaling);
+    actor_stats((ACTOR_ROOT *)data, &stats);
+
+    metrics_print(buff, size, len, "# TYPE nextproxy_actor_task_depth gauge\nnextproxy_actor_task_depth %llu\n", (unsigned long long)stats.taskdepth);
+    metrics_print(buff, size, len, "# TYPE nextproxy_actor_dispatches_total counter\nnextproxy_actor_dispatches_total %llu\n", (unsigned long long)stats.dispatches);
+    metrics_print(buff, size, len, "# TYPE nextproxy_actor_steals_total counter\nnextproxy_actor_steals_total %llu\n", (unsigned long long)stats.steals);
+    metrics_print(buff, size, len, "# TYPE nextproxy_actor_parks_total counter\nnextproxy_actor_parks_total %llu\n", (unsigned long long)stats.parks);
+    metrics_print(buff, size, len, "# TYPE nextproxy_actor_unparks_total counter\nnextproxy_actor_unparks_total %llu\n", (unsigned long long)stats.unparks);
+    metrics_print(buff, size, len, "# TYPE nextproxy_actor_queue_wait_seconds summary\nnextproxy_actor_queue_wait_seconds_sum %.9f\nnextproxy_actor_queue_wait_seconds_count %llu\n",
+        stats.waittime * 1e-9, (unsigned long long)stats.waits);
+
+    metrics_print(buff, size, len, "# TYPE nextproxy_actor_workers gauge\nnextproxy_actor_workers %lu\n", (unsigned long)scaling.workers);
+    metrics_print(buff, size, len, "# TYPE nextproxy_actor_workers_min gauge\nnextproxy_actor_workers_min %lu\n", (unsigned long)scaling.minworker);
+    metrics_print(buff, size, len, "# TYPE nextproxy_actor_workers_max gauge\nnextproxy_actor_workers_max %lu\n", (unsigned long)scaling.maxworker);
+    metrics_print(buff, size, len, "# TYPE nextproxy_actor_scale_total counter\n");
+    metrics_print(buff, size, len, "nextproxy_actor_scale_total{action=\"grow\",reason=\"depth\"} %llu\n", (unsigned long long)scaling.deepgrows);
+    metrics_print(buff, size, len, "nextproxy_actor_scale_total{action=\"grow\",reason=\"latency\"} %llu\n", (unsigned long long)scaling.lategrows);
+    metrics_print(buff, size, len, "nextproxy_actor_scale_total{action=\"retire\",reason=\"idle\"} %llu\n", (unsigned long long)scaling.retires);
+
+    return len;
+}
+
+#if defined(__linux__) || defined(__unix__)
+static void profile_signal(int sig) {
+    if (loop != NULL) event_profile(loop, !loop->profiling);
+}
+#endif
+
+static void break_signal(int sig) {
+    if (loop != NULL) event_break(loop, EVENT_BREAK_ALL);
+}
+
+#if EVENT_TRACE_LEVEL > 0 && (defined(__linux__) || defined(__unix__))
+static void trace_signal(int sig) {
+    if (loop != NULL) event_trace_dump(loop, STDERR_FILENO);
+
+    if (sig != SIGUSR2) {
+        signal(sig, SIG_DFL);
+        raise(sig);
+    }
+}
+#endif
+
 static int match_regex(const char *text, const char *pattern, const int index, char *result) {
     regex_t regex;
 
@@ -134,10 +279,23 @@ static inline PROXY *new_proxy(void) {
     *(node->data) = 0;
     node->data_size = 0;
     node->data_index = 0;
+    node->request_time = 0;
 
     return node;
 }
 
+static inline void finish_proxy(PROXY *node) {
+    uint64_t *phases = node->record.phases; int i = 0;
+
+    proxy_phase(node, PROXY_PHASE_CLOSE);
+
+    for (i = PROXY_PHASE_CLIENT; i < PROXY_PHASE_MAX; ++i)
+        if (phases[i]) metrics_record(metrics_phases[i], phases[i] - phases[PROXY_PHASE_ACCEPT]);
+
+    if (record_file != NULL)
+        fwrite(&node->record, sizeof(PROXY_RECORD), 1, record_file);
+}
+
 static inline void delete_proxy(PROXY *node) {
     if (node->client != INVALID_SOCKET)
         socket_close(node->client);
@@ -200,7 +358,7 @@ static int handle_data(char * buff) {
 }
 
 static void timer_clean_cb(EVENT_LOOP *loop, EVENT_TIMER *watcher) {
-    print_log("timeout: %lf, repeat: %lf, callback: %s, enter", watcher->timeout, watcher->repeat, __func__);
+    logger_print("timeout: %lf, repeat: %lf, callback: %s, enter", watcher->timeout, watcher->repeat, __func__);
 
     PROXY *node = (PROXY *)(watcher->data);
 
@@ -210,170 +368,153 @@ static void timer_clean_cb(EVENT_LOOP *loop, EVENT_TIMER *watcher) {
     event_io_stop(loop, &node->remote_write);
     event_timer_stop(loop, &node->timer_clean);
 
+    // Delete only takes a stopped actor, the clean timer runs while the tunnel has nothing in flight
+    if (node->actor && !(actorh_stop(actors, node->actor) && actorh_delete(actors, node->actor)))
+        logger_print("tunnel actor delete error: %llx", (unsigned long long)node->actor);
 
+    finish_proxy(node);
     delete_proxy(node);
 
     if (clients == MAX_CLIENTS)
         event_io_start(loop, &local_accept);
 
     --clients;
+
+    metrics_add(metrics_tunnels, -1);
+    metrics_add(metrics_timeouts, 1);
 }
 
-static void remote_write_cb(EVENT_LOOP *loop, EVENT_IO *watcher) {
-    print_log("fd: %d, events: %d, callback: %s, enter", watcher->fd, watcher->events, __func__);
-
-    PROXY *node = (PROXY *)(watcher->data);
-    event_io_stop(loop, &node->remote_write);
-    event_timer_stop(loop, &node->timer_clean);
+// Handlers below only touch the tunnel, they return the watchers to start next and never the loop itself
+static int handle_remote_write(PROXY *node) {
+    logger_print("fd: %d, callback: %s, enter", node->remote, __func__);
 
     ssize_t len = 0; int ignore = 0;
+    if (!node->record.phases[PROXY_PHASE_CONNECT]) {
+        proxy_phase(node, PROXY_PHASE_CONNECT);
+        metrics_record(metrics_connect, node->record.phases[PROXY_PHASE_CONNECT] - node->record.phases[PROXY_PHASE_RESOLVE]);
+    }
+
     len = socket_send(node->remote, node->data + node->data_index, node->data_size - node->data_index, 0, &ignore);
-    if (len > 0) node->data_index += len;
+    if (len > 0) { node->data_index += len; node->record.upload += len; metrics_add(metrics_upload, len); }
 
     if (len < 0 && ignore == 0) {
-        print_log("remote socket write error: %d", node->remote);
-
-        event_timer_start(loop, &node->timer_clean);
+        logger_print("remote socket write error: %d", node->remote);
 
-        return;
+        return PROXY_WAIT_NONE;
     } else if ((len < 0 && ignore == 1) || node->data_index < node->data_size) {
-        print_log("remote socket write retry: %d", node->remote);
+        logger_print("remote socket write retry: %d", node->remote);
 
-        event_io_start(loop, &node->remote_write);
-        event_timer_start(loop, &node->timer_clean);
-
-        return;
+        return PROXY_WAIT_REMOTE_WRITE;
     }
 
     *(node->data) = 0;
     node->data_size = 0;
     node->data_index = 0;
 
-    if (node->status & PROXY_HAS_NOTEND) {
-        event_io_start(loop, &node->client_read);
-        event_timer_start(loop, &node->timer_clean);
-
-        return;
+    if (!(node->status & PROXY_HAS_TUNNEL)) {
+        node->status |= PROXY_HAS_TUNNEL;
+        node->request_time = metrics_now();
     }
 
-    event_io_start(loop, &node->remote_read);
-    event_timer_start(loop, &node->timer_clean);
-}
+    if (node->status & PROXY_HAS_NOTEND)
+        return PROXY_WAIT_CLIENT_READ;
 
-static void remote_read_cb(EVENT_LOOP *loop, EVENT_IO *watcher) {
-    print_log("fd: %d, events: %d, callback: %s, enter", watcher->fd, watcher->events, __func__);
+    return PROXY_WAIT_REMOTE_READ;
+}
 
-    PROXY *node = (PROXY *)(watcher->data);
-    event_io_stop(loop, &node->remote_read);
-    event_timer_stop(loop, &node->timer_clean);
+static int handle_remote_read(PROXY *node) {
+    logger_print("fd: %d, callback: %s, enter", node->remote, __func__);
 
     ssize_t len = 0; int ignore = 0;
     len = socket_recv(node->remote, node->data, MAX_DATA_SIZE, 0, &ignore);
 
     if ((len < 0 && ignore == 0) || len == 0) {
-        print_log("remote socket read error: %d", node->remote);
+        logger_print("remote socket read error: %d", node->remote);
 
-        event_timer_start(loop, &node->timer_clean);
-
-        return;
+        return PROXY_WAIT_NONE;
     } else if (len < 0 && ignore == 1) {
-        print_log("remote socket read retry: %d", node->remote);
-
-        event_io_start(loop, &node->remote_read);
-        event_timer_start(loop, &node->timer_clean);
+        logger_print("remote socket read retry: %d", node->remote);
 
-        return;
+        return PROXY_WAIT_REMOTE_READ;
     }
 
     node->data_size = len;
 
-    event_io_start(loop, &node->client_write);
-    event_timer_start(loop, &node->timer_clean);
-}
+    proxy_phase(node, PROXY_PHASE_REMOTE);
 
-static void client_write_cb(EVENT_LOOP *loop, EVENT_IO *watcher) {
-    print_log("fd: %d, events: %d, callback: %s, enter", watcher->fd, watcher->events, __func__);
+    if (node->request_time) {
+        metrics_record(metrics_firstbyte, metrics_now() - node->request_time);
+        node->request_time = 0;
+    }
 
-    PROXY *node = (PROXY *)(watcher->data);
-    event_io_stop(loop, &node->client_write);
-    event_timer_stop(loop, &node->timer_clean);
+    return PROXY_WAIT_CLIENT_WRITE;
+}
+
+static int handle_client_write(PROXY *node) {
+    logger_print("fd: %d, callback: %s, enter", node->client, __func__);
 
     ssize_t len = 0; int ignore = 0;
     len = socket_send(node->client, node->data + node->data_index, node->data_size - node->data_index, 0, &ignore);
-    if (len > 0) node->data_index += len;
+    if (len > 0) { node->data_index += len; node->record.download += len; metrics_add(metrics_download, len); proxy_phase(node, PROXY_PHASE_FIRST); }
 
     if (len < 0 && ignore == 0) {
-        print_log("client socket write error: %d", node->client);
-
-        event_timer_start(loop, &node->timer_clean);
+        logger_print("client socket write error: %d", node->client);
 
-        return;
+        return PROXY_WAIT_NONE;
     } else if ((len < 0 && ignore == 1) || node->data_index < node->data_size) {
-        print_log("client socket write retry: %d", node->client);
-
-        event_io_start(loop, &node->client_write);
-        event_timer_start(loop, &node->timer_clean);
+        logger_print("client socket write retry: %d", node->client);
 
-        return;
+        return PROXY_WAIT_CLIENT_WRITE;
     }
 
     *(node->data) = 0;
     node->data_size = 0;
     node->data_index = 0;
 
-    event_io_start(loop, &node->remote_read);
-    event_timer_start(loop, &node->timer_clean);
+    return PROXY_WAIT_REMOTE_READ;
 }
 
-static void client_read_cb(EVENT_LOOP *loop, EVENT_IO *watcher) {
-    print_log("fd: %d, events: %d, callback: %s, enter", watcher->fd, watcher->events, __func__);
-
-    PROXY *node = (PROXY *)(watcher->data);
-    event_io_stop(loop, &node->client_read);
-    event_timer_stop(loop, &node->timer_clean);
+static int handle_client_read(PROXY *node) {
+    logger_print("fd: %d, callback: %s, enter", node->client, __func__);
 
     ssize_t len = 0; int ignore = 0;
     len = socket_recv(node->client, node->data, MAX_DATA_SIZE, 0, &ignore);
 
     if ((len < 0 && ignore == 0) || len == 0) {
-        print_log("client socket read error: %d", node->client);
+        logger_print("client socket read error: %d", node->client);
 
-        event_timer_start(loop, &node->timer_clean);
-
-        return;
+        return PROXY_WAIT_NONE;
     } else if (len < 0 && ignore == 1) {
-        print_log("client socket read retry: %d", node->client);
-
-        event_io_start(loop, &node->client_read);
-        event_timer_start(loop, &node->timer_clean);
+        logger_print("client socket read retry: %d", node->client);
 
-        return;
+        return PROXY_WAIT_CLIENT_READ;
     }
 
     node->data_size = len;
 
+    proxy_phase(node, PROXY_PHASE_CLIENT);
+
     if (len == MAX_DATA_SIZE)
         node->status |= PROXY_HAS_NOTEND;
     else if (node->status & PROXY_HAS_NOTEND)
         node->status ^= PROXY_HAS_NOTEND;
 
-    if (node->status & PROXY_HAS_CONNECT) {
-        event_io_start(loop, &node->remote_write);
-        event_timer_start(loop, &node->timer_clean);
-
-        return;
-    }
+    if (node->status & PROXY_HAS_CONNECT)
+        return PROXY_WAIT_REMOTE_WRITE;
 
     char host[BUFF_SIZE] = {0}, port[BUFF_SIZE] = {0};
+    uint64_t start = metrics_now();
 
     if (!handle_header(node->data, host, port)) {
-        print_log("handle header error, not supported protocol");
-
-        event_timer_start(loop, &node->timer_clean);
+        logger_print("handle header error, not supported protocol");
 
-        return;
+        return PROXY_WAIT_NONE;
     }
 
+    metrics_record(metrics_header, metrics_now() - start);
+
+    proxy_phase(node, PROXY_PHASE_HEADER);
+
     if (node->remote == INVALID_SOCKET) {
         if (ipv6_mode == 0)
             node->remote = socket_create(AF_INET, SOCK_STREAM, 0);
@@ -381,45 +522,105 @@ static void client_read_cb(EVENT_LOOP *loop, EVENT_IO *watcher) {
             node->remote = socket_create(AF_INET6, SOCK_STREAM, 0);
 
         if (node->remote == INVALID_SOCKET) {
-            print_log("remote socket create error: %d", node->remote);
-
-            event_timer_start(loop, &node->timer_clean);
+            logger_print("remote socket create error: %d", node->remote);
 
-            return;
+            return PROXY_WAIT_NONE;
         }
 
         set_socket(node->remote);
         set_nodelay(node->remote, 1);
 
-        event_io_init(&node->remote_read, remote_read_cb, node->remote, EVENT_IO_READ);
-        event_io_init(&node->remote_write, remote_write_cb, node->remote, EVENT_IO_WRITE);
+        event_io_init(&node->remote_read, proxy_io_cb, node->remote, EVENT_IO_READ);
+        event_io_init(&node->remote_write, proxy_io_cb, node->remote, EVENT_IO_WRITE);
         event_io_data(&node->remote_read, node);
         event_io_data(&node->remote_write, node);
     }
 
-    int ret = socket_connect(node->remote, host, port, &ignore);
+    struct addrinfo *list = NULL;
 
-    if (ret < 0 && ignore == 0) {
-        print_log("connect remote socket error: %d", node->remote);
+    if (socket_resolve(host, port, &list) == SOCKET_ERROR) {
+        logger_print("resolve remote host error: %s", host);
 
-        event_timer_start(loop, &node->timer_clean);
+        return PROXY_WAIT_NONE;
+    }
+
+    proxy_phase(node, PROXY_PHASE_RESOLVE);
+
+    int ret = socket_connectaddr(node->remote, list, &ignore);
+
+    socket_release(list);
+
+    if (ret < 0 && ignore == 0) {
+        logger_print("connect remote socket error: %d", node->remote);
 
-        return;
+        return PROXY_WAIT_NONE;
     }
 
-    print_log("connect to %s:%s, using socket: %d", host, port, node->remote);
+    logger_print("connect to %s:%s, using socket: %d", host, port, node->remote);
 
     node->status |= PROXY_HAS_CONNECT;
 
-    event_io_start(loop, &node->remote_write);
+    return PROXY_WAIT_REMOTE_WRITE;
+}
+
+static int proxy_handle(PROXY *node, EVENT_IO *watcher) {
+    if (watcher == &node->client_read) return handle_client_read(node);
+    if (watcher == &node->client_write) return handle_client_write(node);
+    if (watcher == &node->remote_read) return handle_remote_read(node);
+    if (watcher == &node->remote_write) return handle_remote_write(node);
+
+    return PROXY_WAIT_NONE;
+}
+
+// The clean timer always restarts, an error leaves it as the only watcher so the tunnel closes on timeout
+static void proxy_arm(EVENT_LOOP *loop, PROXY *node, int wait) {
+    if (wait & PROXY_WAIT_CLIENT_READ) event_io_start(loop, &node->client_read);
+    if (wait & PROXY_WAIT_CLIENT_WRITE) event_io_start(loop, &node->client_write);
+    if (wait & PROXY_WAIT_REMOTE_READ) event_io_start(loop, &node->remote_read);
+    if (wait & PROXY_WAIT_REMOTE_WRITE) event_io_start(loop, &node->remote_write);
+
     event_timer_start(loop, &node->timer_clean);
 }
 
+// Runs on an actor worker, a tunnel has at most one readiness message in flight at a time
+static void tunnel_cb(ACTOR_ROOT *root, void *data) {
+    EVENT_IO *watcher = (EVENT_IO *)data;
+    PROXY *node = (PROXY *)(watcher->data);
+
+    node->wait = proxy_handle(node, watcher);
+
+    while (!buffer_write(actor_arms, node)) sched_yield();
+
+    event_async_send(loop, &actor_async);
+}
+
+static void actor_async_cb(EVENT_LOOP *loop, EVENT_ASYNC *watcher) {
+    void *data = NULL;
+
+    while (buffer_read(actor_arms, &data)) {
+        PROXY *node = (PROXY *)data;
+
+        proxy_arm(loop, node, node->wait);
+    }
+}
+
+static void proxy_io_cb(EVENT_LOOP *loop, EVENT_IO *watcher) {
+    logger_print("fd: %d, events: %d, callback: %s, enter", watcher->fd, watcher->events, __func__);
+
+    PROXY *node = (PROXY *)(watcher->data);
+    event_io_stop(loop, watcher);
+    event_timer_stop(loop, &node->timer_clean);
+
+    if (node->actor && actorh_send(actors, node->actor, watcher)) return;
+
+    proxy_arm(loop, node, proxy_handle(node, watcher));
+}
+
 static void local_accept_cb(EVENT_LOOP *loop, EVENT_IO *watcher) {
-    print_log("fd: %d, events: %d, callback: %s, enter", watcher->fd, watcher->events, __func__);
+    logger_print("fd: %d, events: %d, callback: %s, enter", watcher->fd, watcher->events, __func__);
 
     if (clients == MAX_CLIENTS) {
-        print_log("%d client(s) online, stop listening for more clients", clients);
+        logger_print("%d client(s) online, stop listening for more clients", clients);
 
         event_io_stop(loop, &local_accept);
     } else {
@@ -438,12 +639,25 @@ static void local_accept_cb(EVENT_LOOP *loop, EVENT_IO *watcher) {
 
         ++clients;
 
-        print_log("accept client: %s/%s, total: %d, using socket: %d", host, port, clients, client);
+        metrics_add(metrics_accepts, 1);
+        metrics_add(metrics_tunnels, 1);
+
+        logger_print("accept client: %s/%s, total: %d, using socket: %d", host, port, clients, client);
 
         node->client = client;
 
-        event_io_init(&node->client_read, client_read_cb, client, EVENT_IO_READ);
-        event_io_init(&node->client_write, client_write_cb, client, EVENT_IO_WRITE);
+        proxy_phase(node, PROXY_PHASE_ACCEPT);
+
+        // Without a free actor slot the tunnel simply runs on the loop thread
+        if (actors != NULL && (node->actor = actorh_create(actors, tunnel_cb)) != 0)
+            actorh_start(actors, node->actor);
+        else if (actors != NULL) {
+            logger_print("no free actor slot, relay on the loop thread: %d", client);
+            metrics_add(metrics_inline, 1);
+        }
+
+        event_io_init(&node->client_read, proxy_io_cb, client, EVENT_IO_READ);
+        event_io_init(&node->client_write, proxy_io_cb, client, EVENT_IO_WRITE);
         event_timer_init(&node->timer_clean, timer_clean_cb, PROXY_TIMEOUT, 0);
 
         event_io_data(&node->client_read, node);
@@ -456,10 +670,16 @@ static void local_accept_cb(EVENT_LOOP *loop, EVENT_IO *watcher) {
 }
 
 static void usage(const char *name) {
-    printf("Usage: %s [-l http://local_server:local_port] [-p protocol://[method:password@]remote_server:remote_port] [-6] [-g] [-d] [-h]\n", name);
+    printf("Usage: %s [-l http://local_server:local_port] [-p protocol://[method:password@]remote_server:remote_port] [-m http://admin_server:admin_port] [-r record_file] [-w workers[:min]] [-c cpu,...] [-6] [-t] [-g] [-d] [-h]\n", name);
     printf("  -l: listen address of the local http proxy server, also support http proxy tunnel, default: \"http://localhost:7788\"\n");
     printf("  -p: remote server address as the parent proxy, now support socks5 and shadowsocks, without this option as a normal http proxy server\n");
+    printf("  -m: admin address serving prometheus metrics over http, without this option metrics are not exported\n");
+    printf("  -r: record mode, append a binary phase timestamp record of every closed tunnel to record_file\n");
+    printf("  -w: actor mode, relay every tunnel as an actor on this many worker threads while the event loop only polls,\n");
+    printf("      with a min the pool grows and shrinks between both as load changes\n");
+    printf("  -c: pin the event loop to the first cpu of the list and actor workers to the rest, e.g. 0,2,4,6\n");
     printf("  -6: ipv6 mode, use ipv6 socket and network address\n");
+    printf("  -t: profile mode, measure event loop phases and callbacks, toggle at runtime with SIGUSR1\n");
     printf("  -g: logger mode, write output to stat.log\n");
     printf("  -d: debug mode, write output to stdout\n");
     printf("  -h: show help information\n");
@@ -474,9 +694,11 @@ int main(int argc, char **argv) {
     char remote_port[BUFF_SIZE] = {0};
     char remote_method[BUFF_SIZE] = {0};
     char remote_password[BUFF_SIZE] = {0};
+    char admin_host[BUFF_SIZE] = "127.0.0.1";
+    char admin_port[BUFF_SIZE] = "7789";
     int opt = 0; char result[BUFF_SIZE] = {0};
 
-    while ((opt = getopt(argc, argv, "l:p:6gdh")) != -1) {
+    while ((opt = getopt(argc, argv, "l:p:m:r:w:c:6tgdh")) != -1) {
         switch (opt) {
             case 'l':
                 if (match_regex(optarg, "(.+)://(.+):(.+)", 1, result))
@@ -527,9 +749,34 @@ int main(int argc, char **argv) {
                 } else
                     relay_mode = 0;
                 break;
+            case 'm':
+                metrics_flag = 1;
+
+                if (match_regex(optarg, "(.+)://(.+):(.+)", 2, result))
+                    strcpy(admin_host, result);
+                if (match_regex(optarg, "(.+)://(.+):(.+)", 3, result))
+                    strcpy(admin_port, result);
+                break;
+            case 'r':
+                if (record_file == NULL)
+                    record_file = fopen(optarg, "ab");
+                break;
+            case 'w':
+                actor_workers = (int)strtol(optarg, &optarg, 10);
+                actor_minworkers = *optarg == ':' ? atoi(optarg + 1) : 0;
+                break;
+            case 'c':
+                for (cpu_count = 0; *optarg && cpu_count < CPU_MAXLIST; ++optarg) {
+                    cpu_list[cpu_count++] = (int)strtol(optarg, &optarg, 10);
+                    if (*optarg != ',') break;
+                }
+                break;
             case '6':
                 ipv6_mode = 1;
                 break;
+            case 't':
+                profile_flag = 1;
+                break;
             case 'g':
                 logger_flag = 1;
                 break;
@@ -561,8 +808,79 @@ int main(int argc, char **argv) {
     if (logger_flag && logger_file == NULL)
         logger_file = fopen("stat.log", "wb");
 
+    if (debug_flag || logger_flag)
+        logger_init((debug_flag ? LOGGER_STDOUT : LOGGER_NONE) | (logger_file != NULL ? LOGGER_FILE : LOGGER_NONE), logger_file, LOGGER_MAXRING);
+
+    metrics_accepts = metrics_register("nextproxy_accepts_total", "Accepted client connections", METRICS_TYPE_COUNTER);
+    metrics_tunnels = metrics_register("nextproxy_tunnels", "Currently active tunnels", METRICS_TYPE_GAUGE);
+    metrics_upload = metrics_register("nextproxy_upload_bytes_total", "Bytes relayed from client to remote", METRICS_TYPE_COUNTER);
+    metrics_download = metrics_register("nextproxy_download_bytes_total", "Bytes relayed from remote to client", METRICS_TYPE_COUNTER);
+    metrics_timeouts = metrics_register("nextproxy_timeouts_total", "Tunnels closed by the clean timer", METRICS_TYPE_COUNTER);
+    metrics_inline = metrics_register("nextproxy_actor_inline_total", "Tunnels relayed on the loop thread in actor mode for lack of a free actor slot", METRICS_TYPE_COUNTER);
+    metrics_connect = metrics_register("nextproxy_connect_seconds", "Latency of remote connect", METRICS_TYPE_HISTOGRAM);
+    metrics_header = metrics_register("nextproxy_header_seconds", "Time spent parsing request header", METRICS_TYPE_HISTOGRAM);
+    metrics_firstbyte = metrics_register("nextproxy_firstbyte_seconds", "Time from request forwarded to first remote byte", METRICS_TYPE_HISTOGRAM);
+    metrics_phases[PROXY_PHASE_CLIENT] = metrics_register("nextproxy_phase_client_seconds", "Time from accept to first client byte", METRICS_TYPE_HISTOGRAM);
+    metrics_phases[PROXY_PHASE_HEADER] = metrics_register("nextproxy_phase_header_seconds", "Time from accept to request header parsed", METRICS_TYPE_HISTOGRAM);
+    metrics_phases[PROXY_PHASE_RESOLVE] = metrics_register("nextproxy_phase_resolve_seconds", "Time from accept to remote host resolved", METRICS_TYPE_HISTOGRAM);
+    metrics_phases[PROXY_PHASE_CONNECT] = metrics_register("nextproxy_phase_connect_seconds", "Time from accept to remote connected", METRICS_TYPE_HISTOGRAM);
+    metrics_phases[PROXY_PHASE_REMOTE] = metrics_register("nextproxy_phase_remote_seconds", "Time from accept to first remote byte", METRICS_TYPE_HISTOGRAM);
+    metrics_phases[PROXY_PHASE_FIRST] = metrics_register("nextproxy_phase_first_seconds", "Time from accept to first byte sent to client", METRICS_TYPE_HISTOGRAM);
+    metrics_phases[PROXY_PHASE_CLOSE] = metrics_register("nextproxy_phase_close_seconds", "Time from accept to tunnel closed", METRICS_TYPE_HISTOGRAM);
+
+    if (metrics_flag) {
+        if (metrics_serve(admin_host, admin_port))
+            printf("serve metrics on http://%s:%s\n", admin_host, admin_port);
+        else
+            printf("serve metrics on http://%s:%s failed\n", admin_host, admin_port);
+    }
+
     loop = event_init(EVENT_BACKEND_SELECT);
 
+    if (loop != NULL) {
+        event_profile(loop, profile_flag);
+        metrics_collector(profile_collector, loop);
+
+        signal(SIGINT, break_signal);
+        signal(SIGTERM, break_signal);
+
+#if defined(__linux__) || defined(__unix__)
+        signal(SIGUSR1, profile_signal);
+#endif
+
+        if (cpu_count > 0 && event_affinity(loop, cpu_list[0]))
+            printf("event loop pinned to cpu %d\n", cpu_list[0]);
+
+        if (actor_workers > 0 && (actors = actor_init("nextproxy", MAX_CLIENTS + 1, actor_workers, PROXY_MAXINBOX)) != NULL) {
+            actor_arms = buffer_init(MAX_CLIENTS);
+
+            // With a single cpu given the workers share it with the loop
+            if (cpu_count > 1)
+                actor_affinity(actors, cpu_list + 1, cpu_count - 1);
+            else if (cpu_count == 1)
+                actor_affinity(actors, cpu_list, 1);
+
+            if (actor_minworkers > 0 && actor_minworkers < actor_workers)
+                actor_elastic(actors, actor_minworkers, 0, 0, 0);
+
+            metrics_collector(actor_collector, actors);
+
+            event_async_init(&actor_async, actor_async_cb);
+            event_async_start(loop, &actor_async);
+
+            actor_run(actors);
+
+            printf("actor mode, %d worker(s)\n", actor_workers);
+        }
+
+#if EVENT_TRACE_LEVEL > 0 && (defined(__linux__) || defined(__unix__))
+        signal(SIGUSR2, trace_signal);
+        signal(SIGSEGV, trace_signal);
+        signal(SIGBUS, trace_signal);
+        signal(SIGABRT, trace_signal);
+#endif
+    }
+
     if (local != INVALID_SOCKET && loop != NULL) {
         set_socket(local);
         set_nodelay(local, 1);
@@ -579,11 +897,26 @@ int main(int argc, char **argv) {
 
     event_run(loop, EVENT_RUN_DEFAULT);
 
+    if (actors != NULL) {
+        actor_break(actors);
+        actor_wait(actors);
+        actor_clean(actors);
+
+        buffer_clean(actor_arms);
+    }
+
     event_clean(loop);
 
+    metrics_clean();
+
+    logger_clean();
+
     if (logger_flag && logger_file != NULL)
         fclose(logger_file);
 
+    if (record_file != NULL)
+        fclose(record_file);
+
     if (local != INVALID_SOCKET)
         socket_close(local);
 
@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "socket.h"
+#include "metrics.h"
+
+#define METRICS_MAXOUTPUT (1024 << 6)
+
+typedef struct metrics_entry {
+    const char *name;
+    const char *help;
+    int type;
+} METRICS_ENTRY;
+
+static METRICS_ENTRY metrics_counters[METRICS_MAXCOUNTER];
+static METRICS_ENTRY metrics_histograms[METRICS_MAXHISTOGRAM];
+static int metrics_countercnt = 0;
+static int metrics_histogramcnt = 0;
+
+static METRICS_COLLECTOR metrics_collectors[METRICS_MAXCOLLECTOR];
+static void *metrics_collectordata[METRICS_MAXCOLLECTOR];
+static int metrics_collectorcnt = 0;
+
+static METRICS_SHARD *metrics_shards = NULL;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+__thread METRICS_SHARD *metrics_shard = NULL;
+
+static int metrics_socket = INVALID_SOCKET;
+static pthread_t metrics_thread;
+static int volatile metrics_running = 0;
+
+// Histogram bounds exported to prometheus, in seconds
+static const double metrics_bounds[] = {
+    0.00001, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005,
+    0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0
+};
+
+int metrics_register(const char *name, const char *help, int type) {
+    int id = -1;
+
+    pthread_mutex_lock(&metrics_lock);
+
+    if (type == METRICS_TYPE_HISTOGRAM) {
+        if (metrics_histogramcnt < METRICS_MAXHISTOGRAM) {
+            metrics_histograms[metrics_histogramcnt].name = name;
+            metrics_histograms[metrics_histogramcnt].help = help;
+            metrics_histograms[metrics_histogramcnt].type = type;
+            id = METRICS_MAXCOUNTER + metrics_histogramcnt++;
+        }
+    } else if (type == METRICS_TYPE_COUNTER || type == METRICS_TYPE_GAUGE) {
+        if (metrics_countercnt < METRICS_MAXCOUNTER) {
+            metrics_counters[metrics_countercnt].name = name;
+            metrics_counters[metrics_countercnt].help = help;
+            metrics_counters[metrics_countercnt].type = type;
+            id = metrics_countercnt++;
+        }
+    }
+
+    pthread_mutex_unlock(&metrics_lock);
+
+    return id;
+}
+
+int metrics_collector(METRICS_COLLECTOR cb, void *data) {
+    int ret = 0;
+
+    if (cb == NULL) return 0;
+
+    pthread_mutex_lock(&metrics_lock);
+
+    if (metrics_collectorcnt < METRICS_MAXCOLLECTOR) {
+        metrics_collectors[metrics_collectorcnt] = cb;
+        metrics_collectordata[metrics_collectorcnt] = data;
+        ++metrics_collectorcnt;
+        ret = 1;
+    }
+
+    pthread_mutex_unlock(&metrics_lock);
+
+    return ret;
+}
+
+METRICS_SHARD *metrics_attach(void) {
+    METRICS_SHARD *shard = NULL;
+
+    if (posix_memalign((void **)&shard, 64, sizeof(METRICS_SHARD)) != 0) return NULL;
+    memset(shard, 0, sizeof(METRICS_SHARD));
+
+    pthread_mutex_lock(&metrics_lock);
+    shard->next = metrics_shards;
+    __atomic_store_n(&metrics_shards, shard, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&metrics_lock);
+
+    metrics_shard = shard;
+
+    return shard;
+}
+
+size_t metrics_format(char *buff, size_t size) {
+    METRICS_SHARD *shard = NULL; size_t len = 0;
+    int i = 0, j = 0, k = 0, counters = 0, histograms = 0, collectors = 0;
+
+    if (buff == NULL || size == 0) return 0;
+
+    pthread_mutex_lock(&metrics_lock);
+    counters = metrics_countercnt;
+    histograms = metrics_histogramcnt;
+    collectors = metrics_collectorcnt;
+    pthread_mutex_unlock(&metrics_lock);
+
+    for (i = 0; i < counters; ++i) {
+        int64_t value = 0;
+
+        for (shard = __atomic_load_n(&metrics_shards, __ATOMIC_ACQUIRE); shard != NULL; shard = shard->next)
+            value += __atomic_load_n(&shard->counters[i], __ATOMIC_RELAXED);
+
+        metrics_print(buff, size, len, "# HELP %s %s\n# TYPE %s %s\n%s %lld\n",
+            metrics_counters[i].name, metrics_counters[i].help, metrics_counters[i].name,
+            metrics_counters[i].type == METRICS_TYPE_GAUGE ? "gauge" : "counter",
+            metrics_counters[i].name, (long long)value);
+    }
+
+    for (i = 0; i < histograms; ++i) {
+        uint64_t count = 0, sum = 0, buckets[METRICS_BUCKETS] = {0}, total = 0;
+
+        for (shard = __atomic_load_n(&metrics_shards, __ATOMIC_ACQUIRE); shard != NULL; shard = shard->next) {
+            METRICS_HISTOGRAM *histogram = shard->histograms + i;
+
+            for (j = 0; j < METRICS_BUCKETS; ++j)
+                buckets[j] += __atomic_load_n(&histogram->buckets[j], __ATOMIC_RELAXED);
+
+            sum += __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED);
+            count += __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+        }
+
+        metrics_print(buff, size, len, "# HELP %s %s\n# TYPE %s histogram\n",
+            metrics_histograms[i].name, metrics_histograms[i].help, metrics_histograms[i].name);
+
+        for (j = 0, k = 0; j < sizeof(metrics_bounds) / sizeof(metrics_bounds[0]); ++j) {
+            uint64_t bound = (uint64_t)(metrics_bounds[j] * 1e9);
+
+            for (; k < METRICS_BUCKETS && metrics_bound(k) <= bound; ++k)
+                total += buckets[k];
+
+            metrics_print(buff, size, len, "%s_bucket{le=\"%g\"} %llu\n", metrics_histograms[i].name, metrics_bounds[j], (unsigned long long)total);
+        }
+
+        metrics_print(buff, size, len, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n",
+            metrics_histograms[i].name, (unsigned long long)count,
+            metrics_histograms[i].name, sum * 1e-9,
+            metrics_histograms[i].name, (unsigned long long)count);
+    }
+
+    for (i = 0; i < collectors && len + 1 < size; ++i)
+        len += metrics_collectors[i](buff + len, size - len, metrics_collectordata[i]);
+
+    return len < size ? len : size - 1;
+}
+
+static void *metrics_worker(void *data) {
+    char *output = (char *)malloc(METRICS_MAXOUTPUT), request[1024];
+    char header[128];
+
+    if (output == NULL) pthread_exit(NULL);
+
+    while (metrics_running) {
+        int client = socket_accept(metrics_socket, NULL, NULL, NULL);
+
+        if (client == INVALID_SOCKET) continue;
+
+        socket_timeout(client, 1);
+        socket_recv(client, request, sizeof(request), 0, NULL);
+
+        size_t len = metrics_format(output, METRICS_MAXOUTPUT);
+        int hlen = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n", (unsigned long)len);
+
+        socket_send(client, header, hlen, 0, NULL);
+        socket_send(client, output, len, 0, NULL);
+        socket_close(client);
+    }
+
+    free(output);
+
+    pthread_exit(NULL);
+}
+
+int metrics_serve(const char *host, const char *port) {
+    if (metrics_running || host == NULL || port == NULL) return 0;
+
+    metrics_socket = socket_create(strchr(host, ':') != NULL ? AF_INET6 : AF_INET, SOCK_STREAM, 0);
+    if (metrics_socket == INVALID_SOCKET) return 0;
+
+    int opt = 1;
+    setsockopt(metrics_socket, SOL_SOCKET, SO_REUSEADDR, (char *)&opt, sizeof(opt));
+
+    if (socket_bind(metrics_socket, host, port) == SOCKET_ERROR || socket_listen(metrics_socket, 16) == SOCKET_ERROR) {
+        socket_close(metrics_socket);
+        metrics_socket = INVALID_SOCKET;
+
+        return 0;
+    }
+
+    metrics_running = 1;
+
+    if (pthread_create(&metrics_thread, NULL, metrics_worker, NULL) != 0) {
+        metrics_running = 0;
+        socket_close(metrics_socket);
+        metrics_socket = INVALID_SOCKET;
+
+        return 0;
+    }
+
+    return 1;
+}
+
+void metrics_clean(void) {
+    METRICS_SHARD *shard = NULL, *next = NULL;
+
+    if (metrics_running) {
+        metrics_running = 0;
+
+        shutdown(metrics_socket, 2);
+        socket_close(metrics_socket);
+        pthread_join(metrics_thread, NULL);
+
+        metrics_socket = INVALID_SOCKET;
+    }
+
+    for (shard = metrics_shards; shard != NULL; shard = next) {
+        next = shard->next;
+        free(shard);
+    }
+
+    metrics_shards = NULL;
+    metrics_shard = NULL;
+}
@@ -0,0 +1,110 @@
+#ifndef _METRICS_H
+#define _METRICS_H 1
+
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define METRICS_MAXCOUNTER 32
+#define METRICS_MAXHISTOGRAM 16
+#define METRICS_MAXCOLLECTOR 8
+#define METRICS_SUBBITS 3
+#define METRICS_BUCKETS ((65 - METRICS_SUBBITS) << METRICS_SUBBITS)
+
+enum {
+    METRICS_TYPE_COUNTER,
+    METRICS_TYPE_GAUGE,
+    METRICS_TYPE_HISTOGRAM
+};
+
+typedef struct metrics_histogram {
+    uint64_t volatile count;
+    uint64_t volatile sum;
+    uint64_t volatile buckets[METRICS_BUCKETS];
+} METRICS_HISTOGRAM;
+
+typedef struct metrics_shard {
+    struct metrics_shard *next;
+    int64_t volatile counters[METRICS_MAXCOUNTER];
+    METRICS_HISTOGRAM histograms[METRICS_MAXHISTOGRAM];
+} __attribute__ ((aligned(64))) METRICS_SHARD;
+
+static inline uint64_t metrics_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline int metrics_bucket(uint64_t value) {
+    if (value < (2 << METRICS_SUBBITS)) return (int)value;
+
+    int shift = 63 - __builtin_clzll(value) - METRICS_SUBBITS;
+
+    return ((shift + 1) << METRICS_SUBBITS) + (int)((value >> shift) & ((1 << METRICS_SUBBITS) - 1));
+}
+
+static inline uint64_t metrics_bound(int bucket) {
+    if (bucket < (2 << METRICS_SUBBITS)) return (uint64_t)bucket + 1;
+
+    int shift = (bucket >> METRICS_SUBBITS) - 1;
+    uint64_t base = (uint64_t)((bucket & ((1 << METRICS_SUBBITS) - 1)) | (1 << METRICS_SUBBITS));
+
+    return (base + 1) << shift;
+}
+
+int metrics_register(const char *name, const char *help, int type);
+
+METRICS_SHARD *metrics_attach(void);
+
+extern __thread METRICS_SHARD *metrics_shard;
+
+static inline void metrics_add(int id, int64_t value) {
+    METRICS_SHARD *shard = metrics_shard != NULL ? metrics_shard : metrics_attach();
+
+    if (shard == NULL || id < 0 || id >= METRICS_MAXCOUNTER) return;
+
+    __atomic_store_n(&shard->counters[id], shard->counters[id] + value, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_record(int id, uint64_t value) {
+    METRICS_SHARD *shard = metrics_shard != NULL ? metrics_shard : metrics_attach();
+
+    if (shard == NULL || id < METRICS_MAXCOUNTER || id >= METRICS_MAXCOUNTER + METRICS_MAXHISTOGRAM) return;
+
+    METRICS_HISTOGRAM *histogram = shard->histograms + (id - METRICS_MAXCOUNTER);
+    int bucket = metrics_bucket(value);
+
+    __atomic_store_n(&histogram->buckets[bucket], histogram->buckets[bucket] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->sum, histogram->sum + value, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->count, histogram->count + 1, __ATOMIC_RELAXED);
+}
+
+// On truncation len stops at size - 1, the last byte always holds the terminating NUL
+#define metrics_print(buff, size, len, ...) do {\
+    if ((len) + 1 < (size)) {\
+        int ret = snprintf((buff) + (len), (size) - (len), __VA_ARGS__);\
+        if (ret > 0) (len) += ret;\
+        if ((len) >= (size)) (len) = (size) - 1;\
+    }\
+} while (0)
+
+typedef size_t (*METRICS_COLLECTOR)(char *buff, size_t size, void *data);
+
+int metrics_collector(METRICS_COLLECTOR cb, void *data);
+
+size_t metrics_format(char *buff, size_t size);
+
+int metrics_serve(const char *host, const char *port);
+
+void metrics_clean(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
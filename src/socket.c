@@ -47,18 +47,24 @@ int socket_accept(int fd, char *host, char *port, int *ignore) {
     return sock;
 }
 
-int socket_connect(int fd, const char *host, const char *port, int *ignore) {
-    int ret = 0, error = 0, retry = 0;
-    struct addrinfo temp, *hit = NULL, *list = NULL;
+int socket_resolve(const char *host, const char *port, struct addrinfo **list) {
+    struct addrinfo temp;
 
     memset(&temp, 0, sizeof(temp));
     temp.ai_family = AF_UNSPEC;
     temp.ai_socktype = 0;
     temp.ai_protocol = 0;
 
-    if (getaddrinfo(host, port, &temp, &list) != 0)
+    if (getaddrinfo(host, port, &temp, list) != 0)
         return SOCKET_ERROR;
 
+    return SOCKET_SUCCESS;
+}
+
+int socket_connectaddr(int fd, struct addrinfo *list, int *ignore) {
+    int ret = 0, error = 0, retry = 0;
+    struct addrinfo *hit = NULL;
+
     for (hit = list; hit != NULL; hit = hit->ai_next) {
         ret = connect(fd, hit->ai_addr, hit->ai_addrlen);
 
@@ -74,7 +80,18 @@ int socket_connect(int fd, const char *host, const char *port, int *ignore) {
         if (error == 0 || retry == 0) break;
     }
 
-    freeaddrinfo(list);
+    return ret;
+}
+
+int socket_connect(int fd, const char *host, const char *port, int *ignore) {
+    int ret = 0; struct addrinfo *list = NULL;
+
+    if (socket_resolve(host, port, &list) == SOCKET_ERROR)
+        return SOCKET_ERROR;
+
+    ret = socket_connectaddr(fd, list, ignore);
+
+    socket_release(list);
 
     return ret;
 }
@@ -142,6 +159,37 @@ ssize_t socket_send(int fd, void *buf, size_t len, int flags, int *ignore) {
     return length;
 }
 
+// Gathers every entry into one syscall, a short write returns what the kernel took like socket_send
+ssize_t socket_sendv(int fd, SOCKET_IOVEC *vec, int count, int flags, int *ignore) {
+#if defined(__linux__) || defined(__unix__)
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vec;
+    msg.msg_iovlen = count;
+
+    ssize_t length = sendmsg(fd, &msg, flags | MSG_NOSIGNAL);
+#else
+    DWORD sent = 0;
+
+    ssize_t length = WSASend(fd, vec, (DWORD)count, &sent, (DWORD)flags, NULL, NULL) == 0 ? (ssize_t)sent : SOCKET_ERROR;
+#endif
+
+    if (ignore != NULL) {
+        int error = 0;
+
+#if defined(__linux__) || defined(__unix__)
+        error = errno;
+        *ignore = (error == EINTR || error == EWOULDBLOCK || error == EAGAIN || error == EINPROGRESS);
+#else
+        error = WSAGetLastError();
+        *ignore = (error == WSAEINTR || error == WSAEWOULDBLOCK || error == WSATRY_AGAIN || error == WSAEINPROGRESS);
+#endif
+    }
+
+    return length;
+}
+
 ssize_t socket_sendto(int fd, void *buf, size_t len, int flags, const char *host, const char *port, int *ignore) {
     ssize_t length = 0; int error = 0, retry = 0;
     struct addrinfo temp, *hit = NULL, *list = NULL;
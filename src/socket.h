@@ -6,8 +6,11 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #else
 #include <winsock2.h>
+#include <ws2tcpip.h>
 #endif
 
 #ifdef __cplusplus
@@ -21,6 +24,17 @@ extern "C" {
 
 #define SOCKET_SUCCESS 0
 
+// One scatter entry of socket_sendv, filled with socket_iovec so callers stay portable
+#if defined(__linux__) || defined(__unix__)
+typedef struct iovec SOCKET_IOVEC;
+
+#define socket_iovec(vec, base, size) do { (vec)->iov_base = (void *)(base); (vec)->iov_len = (size); } while (0)
+#else
+typedef WSABUF SOCKET_IOVEC;
+
+#define socket_iovec(vec, base, size) do { (vec)->buf = (char *)(base); (vec)->len = (ULONG)(size); } while (0)
+#endif
+
 static inline int socket_init(void) {
 #if defined(__linux__) || defined(__unix__)
     // No need to init on linux
@@ -73,6 +87,12 @@ int socket_bind(int fd, const char *host, const char *port);
 
 int socket_accept(int fd, char *host, char *port, int *ignore);
 
+int socket_resolve(const char *host, const char *port, struct addrinfo **list);
+
+#define socket_release(list) freeaddrinfo(list)
+
+int socket_connectaddr(int fd, struct addrinfo *list, int *ignore);
+
 int socket_connect(int fd, const char *host, const char *port, int *ignore);
 
 ssize_t socket_recv(int fd, void *buf, size_t len, int flags, int *ignore);
@@ -81,6 +101,8 @@ ssize_t socket_recvfrom(int fd, void *buf, size_t len, int flags, char *host, ch
 
 ssize_t socket_send(int fd, void *buf, size_t len, int flags, int *ignore);
 
+ssize_t socket_sendv(int fd, SOCKET_IOVEC *vec, int count, int flags, int *ignore);
+
 ssize_t socket_sendto(int fd, void *buf, size_t len, int flags, const char *host, const char *port, int *ignore);
 
 static inline void socket_close(int fd) {